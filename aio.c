@@ -1,17 +1,54 @@
 /* This is free and unencumbered software released into the public domain.
  * Refer to LICENSE.txt in this directory. */
 
-/* Simple asynchronous I/O example using libaio. */
+/* Asynchronous I/O example using libaio and io_uring.
+ *
+ * With just a filename, submits a single read with libaio and waits for a
+ * debugger to attach before collecting it.
+ *
+ * With --bench, streams the whole file through a queue-depth-aware reader
+ * (struct reader below) at queue depths 1, 2, 4, ... and reports throughput
+ * and CPU time for each I/O engine: io_uring (with and without a kernel
+ * submission-polling thread), libaio and a pool of threads calling pread(),
+ * then checks that each engine recovers from a read error by truncating a
+ * scratch file while it is being read.
+ * Set AIO_ENGINE to one of their names to benchmark only that engine, or to
+ * "auto" for the first one the kernel supports. */
+
+#define _GNU_SOURCE /* For O_DIRECT. */
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <libaio.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef HAVE_LIBAIO
+#include <libaio.h>
+#endif
+
+/* There is no libc wrapper for io_uring, so the system calls are made
+ * directly; only the kernel's header is needed. */
+#ifdef __has_include
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef SYS_io_uring_setup
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
 static void
 handle_io_error(int r, const char *s)
 {
@@ -23,14 +60,1005 @@ handle_io_error(int r, const char *s)
     }
 }
 
+/* O_DIRECT needs buffers, offsets and lengths aligned to the logical block
+ * size of the device; 4096 covers every common device. */
+#define READER_ALIGN 4096
+
+/* Called with each block of the file in order. <len> is less than the block
+ * size only for the last block. */
+typedef void reader_callback(void *arg, uint64_t offset, const char *buf, size_t len);
+
+struct reader_slot
+{
+    char *buf;
+    uint64_t seq; /* Index of the block being read into buf. */
+    long result;  /* Bytes read, or -errno. */
+    bool done;
+};
+
+struct reader;
+
+/* An I/O engine issues the reads for a reader. queue() prepares the read of
+ * block slots[i].seq into slots[i].buf, submit() starts every queued read (an
+ * engine may defer that to the next reap()) and passes the number started to
+ * reader_submitted(), and reap() waits until at least <min_nr> reads have
+ * completed and passes each completed one to reader_complete(). The functions
+ * returning int return -errno on failure; setup() fails if the engine is not
+ * supported. */
+struct reader_engine
+{
+    const char *name;
+    bool automatic; /* Whether reader_open() tries it when no engine is named. */
+    int (*setup)(struct reader *reader);
+    void (*queue)(struct reader *reader, unsigned i);
+    int (*submit)(struct reader *reader);
+    int (*reap)(struct reader *reader, unsigned min_nr);
+    void (*teardown)(struct reader *reader);
+};
+
+/* Streaming reader that keeps up to queue_depth reads in flight.
+ *
+ * Block i is always read into slot i % queue_depth, so the slots form a ring
+ * in file order: completions may arrive in any order, but a block is handed
+ * to the callback only once all blocks before it have been, and its slot is
+ * then reused for the block queue_depth further on. */
+struct reader
+{
+    int fd;
+    bool direct; /* Whether fd was opened with O_DIRECT. */
+    uint64_t size;
+    size_t block_size;
+    unsigned queue_depth;
+    unsigned queued;    /* Reads queued but not yet submitted. */
+    unsigned in_flight; /* Reads submitted but not yet completed. */
+    struct reader_slot *slots;
+    const struct reader_engine *engine;
+    void *state; /* Engine-specific. */
+};
+
+/* Record that <n> queued reads have been submitted. Called by engines. */
+static void
+reader_submitted(struct reader *reader, unsigned n)
+{
+    assert(n <= reader->queued);
+    reader->queued -= n;
+    reader->in_flight += n;
+}
+
+/* Record the completion of the read into slot <i>. Called by engines. */
+static void
+reader_complete(struct reader *reader, unsigned i, long result)
+{
+    reader->slots[i].result = result;
+    reader->slots[i].done = true;
+    --reader->in_flight;
+}
+
+#ifdef HAVE_IO_URING
+
+/* io_uring: reads are written into a submission ring shared with the kernel
+ * and completions are read from a completion ring, so a single
+ * io_uring_enter() both submits and waits, and with SQPOLL a kernel thread
+ * picks up submissions without any system call at all. The file is
+ * registered, and so are the buffers if the memory lock limit allows, which
+ * saves the kernel looking them up and pinning them for every read. */
+struct uring_state
+{
+    int ring_fd;
+    bool sqpoll;
+    bool fixed_buffers; /* Registered buffers, otherwise readv() of iovecs. */
+    unsigned *sq_tail, *sq_mask, *sq_flags;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned sq_local_tail; /* Tail including reads queued but not yet published. */
+    unsigned to_submit;     /* Published reads the kernel has not consumed yet. */
+    struct iovec *iovecs;
+};
+
+static int
+uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    long r = syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+    return r < 0 ? -errno : (int)r;
+}
+
+static void uring_teardown(struct reader *reader);
+
+static int
+uring_setup_common(struct reader *reader, bool sqpoll)
+{
+    struct uring_state *u = calloc(1, sizeof *u);
+    assert(u);
+    u->sqpoll = sqpoll;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    if (sqpoll)
+    {
+        p.flags = IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = 100; /* Milliseconds before the poller sleeps. */
+    }
+    u->ring_fd = (int)syscall(SYS_io_uring_setup, reader->queue_depth, &p);
+    if (u->ring_fd < 0)
+    {
+        int e = -errno;
+        free(u);
+        return e;
+    }
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (u->cq_ring_size > u->sq_ring_size)
+        {
+            u->sq_ring_size = u->cq_ring_size;
+        }
+        u->cq_ring_size = u->sq_ring_size;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->ring_fd, IORING_OFF_SQ_RING);
+    u->cq_ring = p.features & IORING_FEAT_SINGLE_MMAP
+                     ? u->sq_ring
+                     : mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->ring_fd, IORING_OFF_SQES);
+    assert(u->sq_ring != MAP_FAILED && u->cq_ring != MAP_FAILED && u->sqes != MAP_FAILED);
+
+    char *sq = u->sq_ring, *cq = u->cq_ring;
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_flags = (unsigned *)(sq + p.sq_off.flags);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->sq_local_tail = *u->sq_tail;
+
+    /* Each submission queue entry is always used at the same index. */
+    unsigned *sq_array = (unsigned *)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; ++i)
+    {
+        sq_array[i] = i;
+    }
+
+    u->iovecs = calloc(reader->queue_depth, sizeof *u->iovecs);
+    assert(u->iovecs);
+    for (unsigned i = 0; i < reader->queue_depth; ++i)
+    {
+        u->iovecs[i].iov_base = reader->slots[i].buf;
+        u->iovecs[i].iov_len = reader->block_size;
+    }
+    reader->state = u;
+    if (syscall(SYS_io_uring_register, u->ring_fd, IORING_REGISTER_FILES, &reader->fd, 1) < 0)
+    {
+        int e = -errno;
+        uring_teardown(reader);
+        return e;
+    }
+    u->fixed_buffers = syscall(SYS_io_uring_register, u->ring_fd, IORING_REGISTER_BUFFERS,
+                               u->iovecs, reader->queue_depth) == 0;
+    return 0;
+}
+
+static int
+uring_setup(struct reader *reader)
+{
+    return uring_setup_common(reader, false);
+}
+
+static int
+uring_sqpoll_setup(struct reader *reader)
+{
+    return uring_setup_common(reader, true);
+}
+
+static void
+uring_queue(struct reader *reader, unsigned i)
+{
+    struct uring_state *u = reader->state;
+    struct io_uring_sqe *sqe = &u->sqes[u->sq_local_tail++ & *u->sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->fd = 0; /* Index of the registered file. */
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->off = reader->slots[i].seq * reader->block_size;
+    if (u->fixed_buffers)
+    {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->addr = (uintptr_t)reader->slots[i].buf;
+        sqe->len = reader->block_size;
+        sqe->buf_index = i;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_READV;
+        sqe->addr = (uintptr_t)&u->iovecs[i];
+        sqe->len = 1;
+    }
+    sqe->user_data = i;
+}
+
+/* Publish the queued reads. Without SQPOLL they are submitted by the
+ * io_uring_enter() in the next uring_reap(), together with the wait. */
+static int
+uring_submit(struct reader *reader)
+{
+    struct uring_state *u = reader->state;
+    unsigned n = u->sq_local_tail - *u->sq_tail;
+    u->to_submit += n;
+    /* Pairs with the kernel's acquire of the tail before reading entries. */
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    /* Once published the reads are as good as submitted: any later
+     * uring_reap(), including reader_close()'s, enters them. */
+    reader_submitted(reader, n);
+    if (u->sqpoll)
+    {
+        u->to_submit = 0;
+        /* The store to the tail must be visible before the flags are read,
+         * or a poller going to sleep could miss the new entries. */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+        {
+            int r = uring_enter(u->ring_fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+            if (r < 0)
+            {
+                return r;
+            }
+        }
+    }
+    return 0;
+}
+
+static int
+uring_reap(struct reader *reader, unsigned min_nr)
+{
+    struct uring_state *u = reader->state;
+    unsigned head = *u->cq_head;
+    unsigned ready = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) - head;
+    while (u->to_submit || ready < min_nr)
+    {
+        unsigned wait = ready < min_nr ? min_nr - ready : 0;
+        int r = uring_enter(u->ring_fd, u->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+        if (r == -EINTR)
+        {
+            continue;
+        }
+        if (r < 0)
+        {
+            return r;
+        }
+        u->to_submit -= r;
+        ready = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) - head;
+    }
+
+    for (unsigned n = 0; n < ready; ++n)
+    {
+        struct io_uring_cqe *cqe = &u->cqes[head++ & *u->cq_mask];
+        reader_complete(reader, (unsigned)cqe->user_data, cqe->res);
+    }
+    /* The entries have been read, so the kernel may reuse them. */
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    return (int)ready;
+}
+
+static void
+uring_teardown(struct reader *reader)
+{
+    struct uring_state *u = reader->state;
+    munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring != u->sq_ring)
+    {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    munmap(u->sq_ring, u->sq_ring_size);
+    close(u->ring_fd);
+    free(u->iovecs);
+    free(u);
+}
+
+static const struct reader_engine uring_engine = {
+    "io_uring", true, uring_setup, uring_queue, uring_submit, uring_reap, uring_teardown,
+};
+
+/* Not tried automatically: the polling thread keeps a CPU busy. */
+static const struct reader_engine uring_sqpoll_engine = {
+    "io_uring-sqpoll", false, uring_sqpoll_setup, uring_queue, uring_submit, uring_reap,
+    uring_teardown,
+};
+
+#endif /* HAVE_IO_URING */
+
+#ifdef HAVE_LIBAIO
+
+/* libaio: one io_submit() per batch of reads and one io_getevents() per
+ * batch of completions. */
+struct libaio_state
+{
+    io_context_t ctx;
+    struct iocb *cbs;        /* One per slot. */
+    struct iocb **submit;    /* Reads to submit in the next io_submit(). */
+    unsigned n_submit;
+    struct io_event *events; /* Completions reaped by one io_getevents(). */
+};
+
+static int
+libaio_setup(struct reader *reader)
+{
+    struct libaio_state *a = calloc(1, sizeof *a);
+    assert(a);
+    int r = io_setup(reader->queue_depth, &a->ctx);
+    if (r < 0)
+    {
+        free(a);
+        return r;
+    }
+    a->cbs = calloc(reader->queue_depth, sizeof *a->cbs);
+    a->submit = calloc(reader->queue_depth, sizeof *a->submit);
+    a->events = calloc(reader->queue_depth, sizeof *a->events);
+    assert(a->cbs && a->submit && a->events);
+    reader->state = a;
+    return 0;
+}
+
+static void
+libaio_queue(struct reader *reader, unsigned i)
+{
+    struct libaio_state *a = reader->state;
+    io_prep_pread(&a->cbs[i], reader->fd, reader->slots[i].buf, reader->block_size,
+                  (long long)(reader->slots[i].seq * reader->block_size));
+    a->cbs[i].data = &reader->slots[i];
+    a->submit[a->n_submit++] = &a->cbs[i];
+}
+
+static int
+libaio_submit(struct reader *reader)
+{
+    struct libaio_state *a = reader->state;
+    unsigned done = 0;
+    while (done < a->n_submit)
+    {
+        int r = io_submit(a->ctx, a->n_submit - done, a->submit + done);
+        if (r < 0)
+        {
+            /* Keep the rest queued; they are not in flight. */
+            memmove(a->submit, a->submit + done, (a->n_submit - done) * sizeof *a->submit);
+            a->n_submit -= done;
+            return r;
+        }
+        done += r;
+        reader_submitted(reader, r);
+    }
+    a->n_submit = 0;
+    return 0;
+}
+
+static int
+libaio_reap(struct reader *reader, unsigned min_nr)
+{
+    struct libaio_state *a = reader->state;
+    int r = io_getevents(a->ctx, min_nr, reader->queue_depth, a->events, NULL);
+    if (r == -EINTR)
+    {
+        return 0;
+    }
+    for (int i = 0; i < r; ++i)
+    {
+        struct reader_slot *slot = a->events[i].data;
+        reader_complete(reader, slot - reader->slots, (long)a->events[i].res);
+    }
+    return r;
+}
+
+static void
+libaio_teardown(struct reader *reader)
+{
+    struct libaio_state *a = reader->state;
+    io_destroy(a->ctx);
+    free(a->cbs);
+    free(a->submit);
+    free(a->events);
+    free(a);
+}
+
+static const struct reader_engine libaio_engine = {
+    "libaio", true, libaio_setup, libaio_queue, libaio_submit, libaio_reap, libaio_teardown,
+};
+
+#endif /* HAVE_LIBAIO */
+
+/* pread(): queue_depth threads each issue one blocking read at a time. Works
+ * everywhere, at the cost of a context switch per read. */
+struct pread_state
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work; /* Signalled when reads are added to pending. */
+    pthread_cond_t done; /* Signalled when a read is added to completed. */
+    bool stop;
+    /* Rings of slot indices; neither ever holds more than queue_depth. */
+    unsigned *pending, pending_head, pending_tail;
+    unsigned *completed, completed_head, completed_tail;
+    unsigned *staged, n_staged; /* Queued, not yet submitted. */
+    long *results;
+    pthread_t *threads;
+    struct reader *reader;
+};
+
+static void *
+pread_worker(void *arg)
+{
+    struct pread_state *p = arg;
+    struct reader *reader = p->reader;
+    unsigned n = reader->queue_depth;
+    pthread_mutex_lock(&p->lock);
+    for (;;)
+    {
+        while (p->pending_head == p->pending_tail && !p->stop)
+        {
+            pthread_cond_wait(&p->work, &p->lock);
+        }
+        if (p->pending_head == p->pending_tail)
+        {
+            break;
+        }
+        unsigned i = p->pending[p->pending_head++ % n];
+        pthread_mutex_unlock(&p->lock);
+
+        struct reader_slot *slot = &reader->slots[i];
+        size_t len = 0;
+        long result = 0;
+        while (len < reader->block_size)
+        {
+            ssize_t r = pread(reader->fd, slot->buf + len, reader->block_size - len,
+                              (off_t)(slot->seq * reader->block_size + len));
+            if (r < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (r < 0)
+            {
+                result = -errno;
+                break;
+            }
+            if (r == 0)
+            {
+                break; /* End of file. */
+            }
+            len += r;
+            result = len;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        p->results[i] = result;
+        p->completed[p->completed_tail++ % n] = i;
+        pthread_cond_signal(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static int
+pread_setup(struct reader *reader)
+{
+    unsigned n = reader->queue_depth;
+    struct pread_state *p = calloc(1, sizeof *p);
+    assert(p);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->done, NULL);
+    p->pending = calloc(n, sizeof *p->pending);
+    p->completed = calloc(n, sizeof *p->completed);
+    p->staged = calloc(n, sizeof *p->staged);
+    p->results = calloc(n, sizeof *p->results);
+    p->threads = calloc(n, sizeof *p->threads);
+    assert(p->pending && p->completed && p->staged && p->results && p->threads);
+    p->reader = reader;
+    reader->state = p;
+    for (unsigned i = 0; i < n; ++i)
+    {
+        int r = pthread_create(&p->threads[i], NULL, pread_worker, p);
+        assert(r == 0);
+        (void)r;
+    }
+    return 0;
+}
+
+static void
+pread_queue(struct reader *reader, unsigned i)
+{
+    struct pread_state *p = reader->state;
+    p->staged[p->n_staged++] = i;
+}
+
+static int
+pread_submit(struct reader *reader)
+{
+    struct pread_state *p = reader->state;
+    if (!p->n_staged)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&p->lock);
+    for (unsigned k = 0; k < p->n_staged; ++k)
+    {
+        p->pending[p->pending_tail++ % reader->queue_depth] = p->staged[k];
+    }
+    if (p->n_staged == 1)
+    {
+        pthread_cond_signal(&p->work);
+    }
+    else
+    {
+        pthread_cond_broadcast(&p->work);
+    }
+    pthread_mutex_unlock(&p->lock);
+    reader_submitted(reader, p->n_staged);
+    p->n_staged = 0;
+    return 0;
+}
+
+static int
+pread_reap(struct reader *reader, unsigned min_nr)
+{
+    struct pread_state *p = reader->state;
+    pthread_mutex_lock(&p->lock);
+    while (p->completed_tail - p->completed_head < min_nr)
+    {
+        pthread_cond_wait(&p->done, &p->lock);
+    }
+    int n = 0;
+    while (p->completed_head != p->completed_tail)
+    {
+        unsigned i = p->completed[p->completed_head++ % reader->queue_depth];
+        reader_complete(reader, i, p->results[i]);
+        ++n;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return n;
+}
+
+static void
+pread_teardown(struct reader *reader)
+{
+    struct pread_state *p = reader->state;
+    pthread_mutex_lock(&p->lock);
+    p->stop = true;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    for (unsigned i = 0; i < reader->queue_depth; ++i)
+    {
+        pthread_join(p->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->work);
+    pthread_cond_destroy(&p->done);
+    free(p->pending);
+    free(p->completed);
+    free(p->staged);
+    free(p->results);
+    free(p->threads);
+    free(p);
+}
+
+static const struct reader_engine pread_engine = {
+    "pread", true, pread_setup, pread_queue, pread_submit, pread_reap, pread_teardown,
+};
+
+/* In order of preference. */
+static const struct reader_engine *const reader_engines[] = {
+#ifdef HAVE_IO_URING
+    &uring_engine,
+    &uring_sqpoll_engine,
+#endif
+#ifdef HAVE_LIBAIO
+    &libaio_engine,
+#endif
+    &pread_engine,
+};
+
+#define N_READER_ENGINES (sizeof reader_engines / sizeof reader_engines[0])
+
+/* Open <path> for streaming reads of <block_size> bytes with up to
+ * <queue_depth> in flight, using the engine called <engine_name>, or if that
+ * is NULL the first automatic engine that the kernel supports. Tries O_DIRECT
+ * first, so that the page cache is bypassed, and falls back to buffered reads
+ * on file systems that reject it. Returns 0 or -errno; -ENOENT for an unknown
+ * engine name. */
+static int
+reader_open(struct reader *reader, const char *path, unsigned queue_depth, size_t block_size,
+            const char *engine_name)
+{
+    if (!queue_depth || !block_size || block_size % READER_ALIGN)
+    {
+        return -EINVAL;
+    }
+    memset(reader, 0, sizeof *reader);
+    reader->queue_depth = queue_depth;
+    reader->block_size = block_size;
+
+    reader->direct = true;
+    reader->fd = open(path, O_RDONLY | O_DIRECT);
+    if (reader->fd < 0 && errno == EINVAL)
+    {
+        reader->direct = false;
+        reader->fd = open(path, O_RDONLY);
+    }
+    if (reader->fd < 0)
+    {
+        return -errno;
+    }
+    struct stat st;
+    if (fstat(reader->fd, &st) != 0)
+    {
+        int e = -errno;
+        close(reader->fd);
+        return e;
+    }
+    reader->size = st.st_size;
+
+    reader->slots = calloc(queue_depth, sizeof *reader->slots);
+    assert(reader->slots);
+    for (unsigned i = 0; i < queue_depth; ++i)
+    {
+        void *buf;
+        int r = posix_memalign(&buf, READER_ALIGN, block_size);
+        assert(r == 0);
+        (void)r;
+        reader->slots[i].buf = buf;
+    }
+
+    int r = -ENOENT;
+    for (size_t i = 0; i < N_READER_ENGINES; ++i)
+    {
+        const struct reader_engine *engine = reader_engines[i];
+        if (engine_name ? strcmp(engine_name, engine->name) != 0 : !engine->automatic)
+        {
+            continue;
+        }
+        reader->engine = engine;
+        r = engine->setup(reader);
+        if (r == 0)
+        {
+            return 0;
+        }
+    }
+    for (unsigned i = 0; i < queue_depth; ++i)
+    {
+        free(reader->slots[i].buf);
+    }
+    free(reader->slots);
+    close(reader->fd);
+    return r;
+}
+
+/* Prepare the read of block <seq> into its slot. */
+static void
+reader_queue(struct reader *reader, uint64_t seq)
+{
+    unsigned i = seq % reader->queue_depth;
+    reader->slots[i].seq = seq;
+    reader->slots[i].done = false;
+    ++reader->queued;
+    reader->engine->queue(reader, i);
+}
+
+/* Read the whole file, calling <callback> for each block in file order.
+ * Each reap collects every completion that is ready, waiting until at least
+ * <batch> are; a larger batch saves system calls but lets the queue drain
+ * further before it is refilled. Returns 0 or -errno; on error, submitted
+ * reads still in flight are waited for by reader_close(), and queued reads
+ * are never submitted. */
+static int
+reader_run(struct reader *reader, unsigned batch, reader_callback *callback, void *arg)
+{
+    const struct reader_engine *engine = reader->engine;
+    uint64_t n_blocks = (reader->size + reader->block_size - 1) / reader->block_size;
+    uint64_t next_seq = 0;     /* Next block to submit. */
+    uint64_t next_deliver = 0; /* Next block to hand to the callback. */
+    if (!batch || batch > reader->queue_depth)
+    {
+        batch = reader->queue_depth;
+    }
+
+    while (next_seq < n_blocks && next_seq < reader->queue_depth)
+    {
+        reader_queue(reader, next_seq++);
+    }
+    int r = engine->submit(reader);
+    if (r < 0)
+    {
+        return r;
+    }
+
+    while (next_deliver < n_blocks)
+    {
+        /* Wait for a full batch unless fewer reads than that are in flight. */
+        r = engine->reap(reader, reader->in_flight < batch ? reader->in_flight : batch);
+        if (r < 0)
+        {
+            return r;
+        }
+
+        /* Deliver the completed prefix, reusing each slot for a new read. */
+        for (;;)
+        {
+            struct reader_slot *slot = &reader->slots[next_deliver % reader->queue_depth];
+            if (!slot->done || slot->seq != next_deliver)
+            {
+                break;
+            }
+            if (slot->result < 0)
+            {
+                return (int)slot->result;
+            }
+            uint64_t offset = next_deliver * reader->block_size;
+            size_t expected = reader->size - offset < reader->block_size
+                                  ? (size_t)(reader->size - offset)
+                                  : reader->block_size;
+            if ((size_t)slot->result != expected)
+            {
+                /* Short read, e.g. the file was truncated while being read. */
+                return -EIO;
+            }
+            callback(arg, offset, slot->buf, expected);
+            slot->done = false;
+            ++next_deliver;
+            if (next_seq < n_blocks)
+            {
+                reader_queue(reader, next_seq++);
+            }
+        }
+        r = engine->submit(reader);
+        if (r < 0)
+        {
+            return r;
+        }
+    }
+    return 0;
+}
+
+static void
+reader_close(struct reader *reader)
+{
+    /* Reads still in flight after an error must finish before their buffers
+     * are freed. Only submitted reads count: waiting for one that was queued
+     * but never submitted would block for ever. */
+    while (reader->in_flight && reader->engine->reap(reader, reader->in_flight) >= 0)
+    {
+    }
+    reader->engine->teardown(reader);
+    for (unsigned i = 0; i < reader->queue_depth; ++i)
+    {
+        free(reader->slots[i].buf);
+    }
+    free(reader->slots);
+    close(reader->fd);
+}
+
+static uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* User plus system CPU time used by the process so far. */
+static uint64_t
+cpu_ns(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    uint64_t us = (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000
+                  + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+    return us * 1000;
+}
+
+/* Consumer for the benchmark: checks the blocks arrive in order and touches
+ * every cache line so that the data is really read. */
+struct bench_state
+{
+    uint64_t next_offset;
+    uint64_t checksum;
+};
+
+static void
+bench_consume(void *arg, uint64_t offset, const char *buf, size_t len)
+{
+    struct bench_state *state = arg;
+    assert(offset == state->next_offset);
+    for (size_t i = 0; i < len; i += 64)
+    {
+        state->checksum += (unsigned char)buf[i];
+    }
+    state->next_offset = offset + len;
+}
+
+/* Consumer for the error injection run: truncates the file under the
+ * reader when the first block arrives. */
+struct truncate_state
+{
+    int fd; /* Writable descriptor for the file being read. */
+    uint64_t delivered;
+};
+
+static void
+truncate_consume(void *arg, uint64_t offset, const char *buf, size_t len)
+{
+    struct truncate_state *state = arg;
+    (void)offset;
+    (void)buf;
+    (void)len;
+    if (state->delivered++ == 0)
+    {
+        handle_io_error(ftruncate(state->fd, 0) ? -errno : 0, "ftruncate");
+    }
+}
+
+/* Stream a scratch file of 4 * <qd> blocks, created next to <path>, and
+ * truncate it to nothing as the first block is delivered. The reads issued
+ * after that come back short, so reader_run() must fail with -EIO and
+ * reader_close() must still return, with reads both in flight and queued
+ * at the time of the error. Returns -errno if the engine cannot be used. */
+static int
+bench_truncated(const char *path, const char *engine_name, unsigned qd, size_t block_size)
+{
+    size_t len = strlen(path);
+    char *scratch = malloc(len + sizeof ".truncate-XXXXXX");
+    assert(scratch);
+    memcpy(scratch, path, len);
+    strcpy(scratch + len, ".truncate-XXXXXX");
+    int fd = mkstemp(scratch);
+    if (fd < 0)
+    {
+        int e = -errno;
+        free(scratch);
+        return e;
+    }
+    char *block = calloc(1, block_size);
+    assert(block);
+    for (unsigned i = 0; i < 4 * qd; ++i)
+    {
+        handle_io_error(write(fd, block, block_size) == (ssize_t)block_size ? 0 : -EIO, scratch);
+    }
+    free(block);
+
+    struct reader reader;
+    int r = reader_open(&reader, scratch, qd, block_size, engine_name);
+    if (r == 0)
+    {
+        struct truncate_state state = { fd, 0 };
+        r = reader_run(&reader, 1, truncate_consume, &state);
+        unsigned queued = reader.queued, in_flight = reader.in_flight;
+        reader_close(&reader);
+        printf("%-16s qd=%-4u truncated after block 0: %s after %llu blocks, "
+               "%u queued and %u in flight at the error\n",
+               reader.engine->name, qd, r < 0 ? strerror(-r) : "no error",
+               (unsigned long long)state.delivered, queued, in_flight);
+        assert(r == -EIO);
+        r = 0;
+    }
+    close(fd);
+    unlink(scratch);
+    free(scratch);
+    return r;
+}
+
+/* Read <path> with the engine called <engine_name> (NULL to choose one
+ * automatically) at queue depths 1, 2, 4, ... <max_qd> and print MB/s, IOPS
+ * and the CPU time per read, which is mostly submission and completion
+ * overhead; recent kernels include the SQPOLL thread's polling in it. With
+ * O_DIRECT the page cache is bypassed, so repeated runs read the device; the
+ * file should be a few GB so that each run lasts long enough to measure.
+ * Finally checks that the reader recovers from an error at <max_qd>, see
+ * bench_truncated(). Returns -errno if the engine cannot be used. */
+static int
+bench_engine(const char *path, const char *engine_name, unsigned max_qd, size_t block_size)
+{
+    for (unsigned qd = 1; qd <= max_qd; qd *= 2)
+    {
+        struct reader reader;
+        int r = reader_open(&reader, path, qd, block_size, engine_name);
+        if (r < 0)
+        {
+            return r;
+        }
+        if (qd == 1)
+        {
+            bool fixed = false;
+#ifdef HAVE_IO_URING
+            fixed = reader.engine->teardown == uring_teardown
+                    && ((struct uring_state *)reader.state)->fixed_buffers;
+#endif
+            printf("%s: reading %s (%llu MB) in %zu KB blocks%s%s\n", reader.engine->name, path,
+                   (unsigned long long)(reader.size >> 20), block_size >> 10,
+                   reader.direct ? " with O_DIRECT" : " (O_DIRECT not supported, page cache in use)",
+                   fixed ? ", registered buffers" : "");
+        }
+
+        struct bench_state state = { 0, 0 };
+        uint64_t start = monotonic_ns(), start_cpu = cpu_ns();
+        handle_io_error(reader_run(&reader, 1, bench_consume, &state), "reader_run");
+        double elapsed = (monotonic_ns() - start) * 1e-9;
+        double cpu = (cpu_ns() - start_cpu) * 1e-9;
+        assert(state.next_offset == reader.size);
+
+        uint64_t n_blocks = (reader.size + block_size - 1) / block_size;
+        printf("%-16s qd=%-4u %9.1f MB/s %10.0f IOPS %8.2f us CPU/read\n", reader.engine->name, qd,
+               reader.size / elapsed / (1 << 20), n_blocks / elapsed,
+               n_blocks ? cpu * 1e6 / n_blocks : 0.0);
+        reader_close(&reader);
+    }
+    return bench_truncated(path, engine_name, max_qd, block_size);
+}
+
+/* Benchmark every engine, or just the one named by AIO_ENGINE. Engines the
+ * kernel does not support are reported and skipped. */
+static int
+bench(const char *path, unsigned max_qd, size_t block_size)
+{
+    const char *only = getenv("AIO_ENGINE");
+    if (only && !strcmp(only, "auto"))
+    {
+        int r = bench_engine(path, NULL, max_qd, block_size);
+        handle_io_error(r, path);
+        return EXIT_SUCCESS;
+    }
+    bool found = false;
+    for (size_t i = 0; i < N_READER_ENGINES; ++i)
+    {
+        if (only && strcmp(only, reader_engines[i]->name) != 0)
+        {
+            continue;
+        }
+        found = true;
+        int r = bench_engine(path, reader_engines[i]->name, max_qd, block_size);
+        if (r < 0)
+        {
+            errno = -r;
+            fprintf(stderr, "%s: %s: %s\n", path, reader_engines[i]->name, strerror(errno));
+            if (only)
+            {
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    if (!found)
+    {
+        fprintf(stderr, "AIO_ENGINE=%s: no such engine in this build\n", only);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
 int
 main(int argc, char **argv)
 {
+    if (argc >= 3 && !strcmp(argv[1], "--bench"))
+    {
+        unsigned max_qd = argc > 3 ? strtoul(argv[3], NULL, 10) : 128;
+        unsigned long block_kb = argc > 4 ? strtoul(argv[4], NULL, 10) : 128;
+        if (argc > 5 || !max_qd || !block_kb || (block_kb << 10) % READER_ALIGN)
+        {
+            fprintf(stderr, "Usage: %s --bench FILENAME [MAX-QUEUE-DEPTH [BLOCK-KB]]\n"
+                            "BLOCK-KB must be a multiple of %d.\n",
+                    argv[0], READER_ALIGN >> 10);
+            return EXIT_FAILURE;
+        }
+        return bench(argv[2], max_qd, block_kb << 10);
+    }
     if (argc != 2)
     {
-        fprintf(stderr, "Usage: %s FILENAME\n", argv[0]);
+        fprintf(stderr, "Usage: %s FILENAME\n"
+                        "       %s --bench FILENAME [MAX-QUEUE-DEPTH [BLOCK-KB]]\n",
+                argv[0], argv[0]);
         return EXIT_FAILURE;
     }
+#ifdef HAVE_LIBAIO
     int fd = open(argv[1], O_RDONLY);
     if (fd < 0)
     {
@@ -67,4 +1095,8 @@ main(int argc, char **argv)
     handle_io_error(io_destroy(ctx), "io_destroy");
     close(fd);
     return EXIT_SUCCESS;
+#else
+    fprintf(stderr, "%s was built without libaio, so only --bench is available.\n", argv[0]);
+    return EXIT_FAILURE;
+#endif
 }
@@ -4,14 +4,14 @@
 #include <stdlib.h>
 #include <string.h>
 
-void sort(long* array) {
+void sort(long* array, int n) {
   int i = 0;
   bool sorted;
 
   do {
     sorted = true;
 
-    for( i = 0; i < 31; i++ ) {
+    for( i = 0; i < n - 1; i++ ) {
       long* item_one = &array[i]; 
       long* item_two = &array[i+1];
       long swap_store;
@@ -30,14 +30,18 @@ void sort(long* array) {
 
 int main() {
   long array[32];
+  int n;
   int i = 0;
 
+  /* Fill a random number of elements, from none to all of them, and sort only
+   * those. */
   srand(time(NULL));
-  for( i = 0; i < rand() % sizeof array; i++ ) {
+  n = rand() % (sizeof array / sizeof array[0] + 1);
+  for( i = 0; i < n; i++ ) {
     array[i] = rand();
   }
 
-  sort(array);
+  sort(array, n);
 
   return 0;
 }
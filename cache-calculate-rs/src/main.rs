@@ -1,5 +1,7 @@
 use rand::Rng;
 
+mod trace;
+
 #[derive(Clone, Copy)]
 struct CacheEntry {
     number: u8,
@@ -42,6 +44,9 @@ fn main() {
 
     let mut rng = rand::rng();
 
+    // The buffered trace is written out when the assertion's panic unwinds.
+    let mut capture = trace::Capture::from_env();
+
     let mut iter_count = 0;
     loop {
         if iter_count % 100 == 0 {
@@ -49,6 +54,7 @@ fn main() {
         }
 
         let number: u8 = rng.random();
+        capture.add(number as i64);
         let sqroot_cache = cache_calculate(number as i32, &mut cache);
         let sqroot_correct = (number as f64).sqrt() as u8;
 
@@ -0,0 +1,55 @@
+//! Capture of the numbers looked up, in the trace format of `../trace.h`, for
+//! replay with `cache-replay`. Enabled by setting `SQRT_TRACE=FILE`.
+
+use std::fs::File;
+use std::io::{BufWriter, Write};
+
+pub struct Capture {
+    out: Option<BufWriter<File>>,
+    prev: i64,
+}
+
+impl Capture {
+    pub fn from_env() -> Capture {
+        let out = std::env::var_os("SQRT_TRACE")
+            .filter(|path| !path.is_empty())
+            .and_then(|path| match File::create(&path) {
+                Ok(file) => Some(BufWriter::with_capacity(1 << 16, file)),
+                Err(err) => {
+                    eprintln!("SQRT_TRACE={}: {err}; not capturing", path.to_string_lossy());
+                    None
+                }
+            });
+        let mut capture = Capture { out, prev: 0 };
+        capture.write(b"SQTRACE1");
+        capture
+    }
+
+    /// Append `key` as the zigzag varint of its difference from the previous key.
+    pub fn add(&mut self, key: i64) {
+        if self.out.is_none() {
+            return;
+        }
+        let delta = key.wrapping_sub(self.prev);
+        let mut value = ((delta << 1) ^ (delta >> 63)) as u64;
+        let mut record = [0u8; 10];
+        let mut n = 0;
+        while value >= 0x80 {
+            record[n] = value as u8 | 0x80;
+            value >>= 7;
+            n += 1;
+        }
+        record[n] = value as u8;
+        self.prev = key;
+        self.write(&record[..=n]);
+    }
+
+    fn write(&mut self, bytes: &[u8]) {
+        if let Some(out) = &mut self.out {
+            if let Err(err) = out.write_all(bytes) {
+                eprintln!("SQRT_TRACE: {err}; capture stopped");
+                self.out = None;
+            }
+        }
+    }
+}
@@ -1,7 +1,10 @@
 /* This is free and unencumbered software released into the public domain.
  * Refer to LICENSE.txt in this directory. */
 
-/* Randomized stress test of a sqrt(x) caching mechanism. */
+/* Randomized stress test of a sqrt(x) caching mechanism.
+ *
+ * With SQRT_TRACE=FILE, the numbers looked up are captured to FILE for
+ * cache-replay; see trace.h. */
 
 #include <algorithm>
 #include <cmath>
@@ -9,21 +12,19 @@
 #include <exception>
 #include <iostream>
 #include <map>
-#include <random>
 #include <sstream>
 #include <vector>
 
+#include "prng.h"
+#include "trace.h"
+
 /*
  * Returns a random integer in the range [0, max]
  */
 static int
 random_int(int max)
 {
-    /* Just use a deterministic PRNG for demo purposes */
-    static std::mt19937 generator;
-    static std::uniform_int_distribution<int> distribution(0, max);
-
-    return distribution(generator);
+    return static_cast<int>(prng_bounded(max + 1));
 }
 
 /*
@@ -119,12 +120,14 @@ void
 CacheTester::operator()(int number)
 {
     /* Check cache_calculate() with the given number. */
+    trace_capture(number);
     int sqroot_cache = sqrooter(number);
     int sqroot_correct = static_cast<int>(sqrt(number));
 
     if (sqroot_cache != sqroot_correct)
     {
         /* cache.calculate() returned incorrect value. */
+        trace_capture_flush();
         throw CacheFailure(number, sqroot_cache, sqroot_correct);
     }
 }
@@ -0,0 +1,385 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/* Multi-process sqrt(x) cache in POSIX shared memory.
+ *
+ * Several processes attach to one cache segment with shm_open() and mmap().
+ * Each entry is protected by its own sequence count (a seqlock): a writer
+ * makes the count odd while it updates the entry and even again afterwards,
+ * and a reader retries, or treats the lookup as a miss, if the count was odd
+ * or changed while it read the entry. Readers therefore never block or write
+ * to shared memory, and a value computed by one process on a miss is a hit
+ * for every other process.
+ *
+ * The program is its own load generator: it forks PROCESSES workers that look
+ * up random numbers in [0, RANGE), check every result against sqrt() and fill
+ * the cache on a miss. Once a second it prints the aggregate lookup rate, the
+ * hit rate and the cross-process hit rate (the share of lookups answered by an
+ * entry that another process filled). SECONDS of 0 runs until interrupted. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../prng.h"
+
+#define CACHE_BITS 16
+#define CACHE_ENTRIES (1u << CACHE_BITS)
+#define MAX_PROCESSES 64
+
+/* Lookups between checks of the stop flag and updates of the statistics. */
+#define BATCH 1024
+
+/* Sequence count of an entry that has never been written. */
+#define SEQ_EMPTY 0
+
+typedef struct
+{
+    uint32_t seq;    /* Odd while a writer is updating the entry. */
+    uint32_t number;
+    uint32_t sqroot;
+    uint32_t owner;  /* Index of the worker that filled the entry. */
+} cache_entry_t;
+
+/* Statistics of one worker, written only by that worker. Aligned to a cache
+ * line, so that each worker's counters have a line of their own and workers
+ * do not contend on each other's. */
+typedef struct
+{
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t cross_hits;
+    uint64_t retries;
+} __attribute__((aligned(64))) worker_stats_t;
+
+typedef struct
+{
+    uint32_t attached;  /* Workers that have mapped the segment. */
+    uint32_t start;     /* Set once all workers are attached. */
+    uint32_t stop;
+    uint32_t failed;    /* Set by a worker that got a wrong result. */
+    worker_stats_t stats[MAX_PROCESSES];
+    cache_entry_t entries[CACHE_ENTRIES];
+} cache_t;
+
+static cache_entry_t *
+cache_slot(cache_t *cache, uint32_t number)
+{
+    return &cache->entries[(number * 0x9e3779b1u) >> (32 - CACHE_BITS)];
+}
+
+/*
+ * Look up <number>. Returns true and sets <*sqroot> and <*owner> on a hit.
+ * The read is retried a few times if a writer changes the entry meanwhile;
+ * an entry that is being written is treated as a miss, so a reader never
+ * waits for a writer that may have been descheduled. <*retries> counts the
+ * reads that had to be repeated.
+ */
+static bool
+cache_lookup(cache_t *cache, uint32_t number, uint32_t *sqroot, uint32_t *owner, uint64_t *retries)
+{
+    cache_entry_t *entry = cache_slot(cache, number);
+    int attempt;
+    for (attempt = 0; attempt < 4; ++attempt)
+    {
+        uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+        if (seq == SEQ_EMPTY || (seq & 1))
+        {
+            return false;
+        }
+        uint32_t entry_number = __atomic_load_n(&entry->number, __ATOMIC_RELAXED);
+        uint32_t entry_sqroot = __atomic_load_n(&entry->sqroot, __ATOMIC_RELAXED);
+        uint32_t entry_owner = __atomic_load_n(&entry->owner, __ATOMIC_RELAXED);
+        /* Order the loads of the fields before the second load of seq. */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) == seq)
+        {
+            if (entry_number != number)
+            {
+                return false;
+            }
+            *sqroot = entry_sqroot;
+            *owner = entry_owner;
+            return true;
+        }
+        ++*retries;
+    }
+    return false;
+}
+
+/* Store <number> and <sqroot> in the entry for <number>. If another process
+ * is writing that entry already, give up rather than wait: losing a cache
+ * fill costs only a later miss. */
+static void
+cache_store(cache_t *cache, uint32_t number, uint32_t sqroot, uint32_t owner)
+{
+    cache_entry_t *entry = cache_slot(cache, number);
+    uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+    if ((seq & 1)
+        || !__atomic_compare_exchange_n(&entry->seq, &seq, seq + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    /* Make the odd count visible before any of the new fields. */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&entry->number, number, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->sqroot, sqroot, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->owner, owner, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Map the cache segment <name>, creating and sizing it if <create>. */
+static cache_t *
+cache_attach(const char *name, bool create)
+{
+    int fd = shm_open(name, create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600);
+    if (fd < 0)
+    {
+        fprintf(stderr, "shm_open(%s): %s\n", name, strerror(errno));
+        return NULL;
+    }
+    if (create && ftruncate(fd, sizeof(cache_t)) < 0)
+    {
+        fprintf(stderr, "ftruncate(%s): %s\n", name, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    /* A new segment is zero-filled, so every entry starts out SEQ_EMPTY. */
+    void *cache = mmap(NULL, sizeof(cache_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (cache == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap(%s): %s\n", name, strerror(errno));
+        return NULL;
+    }
+    return cache;
+}
+
+static void
+publish_stats(worker_stats_t *stats, uint64_t lookups, uint64_t hits, uint64_t cross_hits, uint64_t retries)
+{
+    __atomic_store_n(&stats->lookups, lookups, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->hits, hits, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->cross_hits, cross_hits, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->retries, retries, __ATOMIC_RELAXED);
+}
+
+/* Body of worker <index>: attach to the segment by name, as an unrelated
+ * process would, then look up random numbers until told to stop. */
+static int
+worker(const char *name, uint32_t index, uint32_t range)
+{
+    cache_t *cache = cache_attach(name, false);
+    if (cache == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    worker_stats_t *stats = &cache->stats[index];
+    uint32_t self = index + 1;
+    uint64_t lookups = 0, hits = 0, cross_hits = 0, retries = 0;
+
+    prng_seed(self);
+    __atomic_add_fetch(&cache->attached, 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&cache->start, __ATOMIC_ACQUIRE))
+    {
+        sched_yield();
+    }
+
+    while (!__atomic_load_n(&cache->stop, __ATOMIC_RELAXED))
+    {
+        int i;
+        for (i = 0; i < BATCH; ++i)
+        {
+            uint32_t number = prng_bounded(range);
+            uint32_t sqroot_correct = (uint32_t)sqrt(number);
+            uint32_t sqroot, owner;
+            if (cache_lookup(cache, number, &sqroot, &owner, &retries))
+            {
+                ++hits;
+                cross_hits += owner != self;
+            }
+            else
+            {
+                sqroot = sqroot_correct;
+                cache_store(cache, number, sqroot, self);
+            }
+            if (sqroot != sqroot_correct)
+            {
+                /* The cache returned an incorrect value. */
+                fprintf(stderr, "worker %u: number=%u sqroot_cache=%u sqroot_correct=%u\n",
+                        self, number, sqroot, sqroot_correct);
+                __atomic_store_n(&cache->failed, 1, __ATOMIC_RELAXED);
+                abort();
+            }
+        }
+        lookups += BATCH;
+        publish_stats(stats, lookups, hits, cross_hits, retries);
+    }
+    return EXIT_SUCCESS;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Sum the statistics of all workers into <total>. */
+static void
+collect_stats(cache_t *cache, int processes, worker_stats_t *total)
+{
+    int i;
+    memset(total, 0, sizeof *total);
+    for (i = 0; i < processes; ++i)
+    {
+        total->lookups += __atomic_load_n(&cache->stats[i].lookups, __ATOMIC_RELAXED);
+        total->hits += __atomic_load_n(&cache->stats[i].hits, __ATOMIC_RELAXED);
+        total->cross_hits += __atomic_load_n(&cache->stats[i].cross_hits, __ATOMIC_RELAXED);
+        total->retries += __atomic_load_n(&cache->stats[i].retries, __ATOMIC_RELAXED);
+    }
+}
+
+static void
+print_stats(const char *label, const worker_stats_t *stats, double seconds)
+{
+    double lookups = stats->lookups ? (double)stats->lookups : 1;
+    printf("%s: %.0f lookups/s, hit rate %.1f%%, cross-process hit rate %.1f%%, %llu retried reads\n",
+           label, stats->lookups / seconds, 100 * stats->hits / lookups, 100 * stats->cross_hits / lookups,
+           (unsigned long long)stats->retries);
+    fflush(stdout);
+}
+
+static volatile sig_atomic_t g_interrupted;
+
+static void
+on_interrupt(int sig)
+{
+    (void)sig;
+    g_interrupted = 1;
+}
+
+int
+main(int argc, char **argv)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int processes = argc > 1 ? atoi(argv[1]) : (cpus > 2 ? (int)cpus : 2);
+    int seconds = argc > 2 ? atoi(argv[2]) : 10;
+    long range = argc > 3 ? atol(argv[3]) : 2 * CACHE_ENTRIES;
+    if (argc > 4 || processes < 1 || processes > MAX_PROCESSES || seconds < 0 || range < 1
+        || range > UINT32_MAX)
+    {
+        fprintf(stderr, "Usage: %s [PROCESSES [SECONDS [RANGE]]]\n"
+                "Up to %d processes; SECONDS of 0 runs until interrupted.\n", argv[0], MAX_PROCESSES);
+        return EXIT_FAILURE;
+    }
+
+    char name[64];
+    snprintf(name, sizeof name, "/cache-distributed.%ld", (long)getpid());
+    cache_t *cache = cache_attach(name, true);
+    if (cache == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    printf("%d processes sharing %u entries in %s, numbers in [0, %ld)\n", processes, CACHE_ENTRIES, name,
+           range);
+    fflush(stdout);
+
+    /* Workers stop at the stop flag, not at the signal, so that the final
+     * statistics are complete. */
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = on_interrupt;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    int i;
+    pid_t pids[MAX_PROCESSES];
+    for (i = 0; i < processes; ++i)
+    {
+        pids[i] = fork();
+        if (pids[i] == 0)
+        {
+            signal(SIGINT, SIG_IGN);
+            signal(SIGTERM, SIG_IGN);
+            _exit(worker(name, i, (uint32_t)range));
+        }
+        if (pids[i] < 0)
+        {
+            perror("fork");
+            processes = i;
+            __atomic_store_n(&cache->stop, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    /* Once every worker has mapped the segment the name is no longer needed;
+     * the memory stays until the last process unmaps it. */
+    while (__atomic_load_n(&cache->attached, __ATOMIC_ACQUIRE) < (uint32_t)processes && !g_interrupted)
+    {
+        int status;
+        if (waitpid(-1, &status, WNOHANG) > 0)
+        {
+            fprintf(stderr, "A worker exited before starting\n");
+            __atomic_store_n(&cache->stop, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        sched_yield();
+    }
+    shm_unlink(name);
+
+    double start = now();
+    double last = start;
+    worker_stats_t previous;
+    memset(&previous, 0, sizeof previous);
+    __atomic_store_n(&cache->start, 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&cache->stop, __ATOMIC_RELAXED) && !g_interrupted
+           && !__atomic_load_n(&cache->failed, __ATOMIC_RELAXED) && (seconds == 0 || last - start < seconds))
+    {
+        struct timespec second = { 1, 0 };
+        nanosleep(&second, NULL);
+        double t = now();
+        worker_stats_t total, interval;
+        collect_stats(cache, processes, &total);
+        interval.lookups = total.lookups - previous.lookups;
+        interval.hits = total.hits - previous.hits;
+        interval.cross_hits = total.cross_hits - previous.cross_hits;
+        interval.retries = total.retries - previous.retries;
+        char label[32];
+        snprintf(label, sizeof label, "t=%.0fs", t - start);
+        print_stats(label, &interval, t - last);
+        previous = total;
+        last = t;
+    }
+    __atomic_store_n(&cache->stop, 1, __ATOMIC_RELAXED);
+
+    int result = EXIT_SUCCESS;
+    for (i = 0; i < processes; ++i)
+    {
+        int status;
+        if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        {
+            result = EXIT_FAILURE;
+        }
+    }
+    worker_stats_t total;
+    collect_stats(cache, processes, &total);
+    print_stats("total", &total, now() - start);
+    munmap(cache, sizeof(cache_t));
+    return result;
+}
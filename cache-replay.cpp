@@ -0,0 +1,508 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/* Replay of captured sqrt cache traffic through cache policies.
+ *
+ * Run cache or cache-cpp with SQRT_TRACE=FILE to capture the numbers they
+ * look up (see trace.h), then replay FILE here; or replay a synthetic stream
+ * with "--zipf SKEW", in which key k of 100000 is looked up with probability
+ * proportional to 1 / k^SKEW. Every policy is run at every size over the
+ * whole stream, and the hit rate and the time per lookup are printed. The
+ * policies model the sqrt caches and alternatives to them:
+ *
+ *   random   cache.c: on a miss, store number - 1 and number in random slots.
+ *   fifo     cache-cpp.cpp: on a miss, append number - 1 and number to a
+ *            queue and drop the oldest entries beyond the size.
+ *   lru      Least recently used, admitting only the number looked up.
+ *   tinylfu  W-TinyLFU: new numbers enter a window LRU of 1% of the size;
+ *            one leaving the window enters the main segmented LRU only if a
+ *            count-min sketch of recent lookups has seen it more often than
+ *            the entry it would evict, so numbers looked up once cannot
+ *            flush out the hot ones.
+ *
+ * The stream is decoded or generated into memory first, so the times are of
+ * the policies alone. */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <chrono>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "prng.h"
+#include "trace.h"
+
+class Policy
+{
+public:
+    virtual ~Policy()
+    {
+    }
+
+    /* Look up <key>, admitting it on a miss. Returns true on a hit. */
+    virtual bool access(int64_t key) = 0;
+};
+
+/* Counts of the keys held, for policies that may hold a key more than once. */
+class KeyCounts
+{
+public:
+    bool contains(int64_t key) const
+    {
+        return counts.find(key) != counts.end();
+    }
+
+    void add(int64_t key)
+    {
+        ++counts[key];
+    }
+
+    void remove(int64_t key)
+    {
+        auto it = counts.find(key);
+        if (--it->second == 0)
+        {
+            counts.erase(it);
+        }
+    }
+
+private:
+    std::unordered_map<int64_t, unsigned> counts;
+};
+
+class RandomPolicy : public Policy
+{
+public:
+    explicit RandomPolicy(size_t size) : slots(size), used(size)
+    {
+    }
+
+    bool access(int64_t key) override
+    {
+        if (held.contains(key))
+        {
+            return true;
+        }
+        store(key - 1);
+        store(key);
+        return false;
+    }
+
+private:
+    void store(int64_t key)
+    {
+        size_t i = prng_bounded(static_cast<uint32_t>(slots.size()));
+        if (used[i])
+        {
+            held.remove(slots[i]);
+        }
+        slots[i] = key;
+        used[i] = true;
+        held.add(key);
+    }
+
+    std::vector<int64_t> slots;
+    std::vector<bool> used;
+    KeyCounts held;
+};
+
+class FifoPolicy : public Policy
+{
+public:
+    explicit FifoPolicy(size_t size) : size(size)
+    {
+    }
+
+    bool access(int64_t key) override
+    {
+        if (held.contains(key))
+        {
+            return true;
+        }
+        store(key - 1);
+        store(key);
+        return false;
+    }
+
+private:
+    void store(int64_t key)
+    {
+        queue.push_back(key);
+        held.add(key);
+        if (queue.size() > size)
+        {
+            held.remove(queue.front());
+            queue.pop_front();
+        }
+    }
+
+    size_t size;
+    std::deque<int64_t> queue;
+    KeyCounts held;
+};
+
+class LruPolicy : public Policy
+{
+public:
+    explicit LruPolicy(size_t size) : size(size)
+    {
+    }
+
+    bool access(int64_t key) override
+    {
+        auto it = index.find(key);
+        if (it != index.end())
+        {
+            /* Move to the front, the most recently used end. */
+            order.splice(order.begin(), order, it->second);
+            return true;
+        }
+        if (index.size() == size)
+        {
+            index.erase(order.back());
+            order.pop_back();
+        }
+        order.push_front(key);
+        index[key] = order.begin();
+        return false;
+    }
+
+private:
+    size_t size;
+    std::list<int64_t> order;
+    std::unordered_map<int64_t, std::list<int64_t>::iterator> index;
+};
+
+/* Approximate counts of recent lookups: a count-min sketch of 4-bit counters,
+ * four rows of <width> counters packed 16 to a word. Once there have been 10
+ * increments per cache entry, every counter is halved, so old popularity
+ * fades. */
+class FrequencySketch
+{
+public:
+    explicit FrequencySketch(size_t size) : increments(0), sample_size(10 * std::max<size_t>(size, 1))
+    {
+        width = 64;
+        while (width < 8 * size)
+        {
+            width *= 2;
+        }
+        words.assign(rows * width / 16, 0);
+    }
+
+    void increment(int64_t key)
+    {
+        bool added = false;
+        for (unsigned row = 0; row < rows; ++row)
+        {
+            size_t i = index(key, row);
+            unsigned shift = (i % 16) * 4;
+            if ((words[i / 16] >> shift & 0xf) != 0xf)
+            {
+                words[i / 16] += (uint64_t)1 << shift;
+                added = true;
+            }
+        }
+        if (added && ++increments == sample_size)
+        {
+            age();
+        }
+    }
+
+    /* The smallest of the key's counters, which is at least its count of
+     * lookups since aging, over-estimated only by collisions. */
+    unsigned frequency(int64_t key) const
+    {
+        unsigned f = 0xf;
+        for (unsigned row = 0; row < rows; ++row)
+        {
+            size_t i = index(key, row);
+            f = std::min(f, (unsigned)(words[i / 16] >> (i % 16) * 4 & 0xf));
+        }
+        return f;
+    }
+
+private:
+    static const unsigned rows = 4;
+
+    /* Counter of <key> in <row>, as an index into all the counters. */
+    size_t index(int64_t key, unsigned row) const
+    {
+        uint64_t x = (uint64_t)key + (row + 1) * 0x9e3779b97f4a7c15ull;
+        return row * width + (prng_splitmix64(&x) & (width - 1));
+    }
+
+    void age()
+    {
+        for (uint64_t &word : words)
+        {
+            word = (word >> 1) & 0x7777777777777777ull;
+        }
+        increments /= 2;
+    }
+
+    size_t width; /* Counters per row; a power of 2. */
+    std::vector<uint64_t> words;
+    size_t increments;
+    size_t sample_size;
+};
+
+class TinyLfuPolicy : public Policy
+{
+public:
+    explicit TinyLfuPolicy(size_t size)
+        : sketch(size), window_size(std::max<size_t>(size / 100, 1)), main_size(size - std::min(size, window_size)),
+          protected_size(main_size * 4 / 5)
+    {
+    }
+
+    bool access(int64_t key) override
+    {
+        sketch.increment(key);
+        auto it = index.find(key);
+        if (it != index.end())
+        {
+            Entry &entry = it->second;
+            if (entry.segment == PROBATION)
+            {
+                /* A second hit: promote to protected, demoting its least
+                 * recently used entry to probation if it is full. */
+                move(entry, PROTECTED);
+                if (segments[PROTECTED].size() > protected_size)
+                {
+                    move(index[segments[PROTECTED].back()], PROBATION);
+                }
+            }
+            else
+            {
+                move(entry, entry.segment);
+            }
+            return true;
+        }
+
+        segments[WINDOW].push_front(key);
+        index[key] = Entry{ WINDOW, segments[WINDOW].begin() };
+        if (segments[WINDOW].size() <= window_size)
+        {
+            return false;
+        }
+
+        /* The window is full: its least recently used entry is a candidate
+         * for the main cache. */
+        int64_t candidate = segments[WINDOW].back();
+        if (segments[PROBATION].size() + segments[PROTECTED].size() < main_size)
+        {
+            move(index[candidate], PROBATION);
+            return false;
+        }
+        Segment victim_segment = segments[PROBATION].empty() ? PROTECTED : PROBATION;
+        int64_t victim = segments[victim_segment].empty() ? candidate : segments[victim_segment].back();
+        if (victim != candidate && sketch.frequency(candidate) > sketch.frequency(victim))
+        {
+            evict(victim);
+            move(index[candidate], PROBATION);
+        }
+        else
+        {
+            evict(candidate);
+        }
+        return false;
+    }
+
+private:
+    enum Segment
+    {
+        WINDOW,
+        PROBATION,
+        PROTECTED,
+        SEGMENTS
+    };
+
+    struct Entry
+    {
+        Segment segment;
+        std::list<int64_t>::iterator position;
+    };
+
+    /* Move <entry> to the most recently used end of <segment>. */
+    void move(Entry &entry, Segment segment)
+    {
+        segments[segment].splice(segments[segment].begin(), segments[entry.segment], entry.position);
+        entry.segment = segment;
+    }
+
+    void evict(int64_t key)
+    {
+        auto it = index.find(key);
+        segments[it->second.segment].erase(it->second.position);
+        index.erase(it);
+    }
+
+    FrequencySketch sketch;
+    size_t window_size;
+    size_t main_size;
+    size_t protected_size;
+    std::list<int64_t> segments[SEGMENTS]; /* Most recently used first. */
+    std::unordered_map<int64_t, Entry> index;
+};
+
+template <typename P>
+static std::unique_ptr<Policy>
+make_policy(size_t size)
+{
+    return std::unique_ptr<Policy>(new P(size));
+}
+
+struct PolicyType
+{
+    const char *name;
+    std::unique_ptr<Policy> (*make)(size_t size);
+};
+
+static const PolicyType policies[] = {
+    { "random", make_policy<RandomPolicy> },
+    { "fifo", make_policy<FifoPolicy> },
+    { "lru", make_policy<LruPolicy> },
+    { "tinylfu", make_policy<TinyLfuPolicy> },
+};
+
+static bool
+load_trace(const char *path, std::vector<int64_t> &keys)
+{
+    struct trace trace;
+    if (trace_open(&trace, path) < 0)
+    {
+        std::cerr << path << ": " << (errno == EINVAL ? "not a trace file" : strerror(errno)) << std::endl;
+        return false;
+    }
+    auto start = std::chrono::steady_clock::now();
+    struct trace_cursor cursor;
+    int64_t key;
+    trace_begin(&trace, &cursor);
+    while (trace_next(&cursor, &key))
+    {
+        keys.push_back(key);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << path << ": " << keys.size() << " keys in " << trace.size << " bytes (" << std::fixed
+              << std::setprecision(2) << (keys.empty() ? 0.0 : double(trace.size) / keys.size())
+              << " bytes/key), decoded at " << std::setprecision(1) << keys.size() / elapsed.count() / 1e6
+              << " M keys/s" << std::endl;
+    trace_close(&trace);
+    return true;
+}
+
+/* Fill <keys> with <length> lookups of 100000 keys with Zipf exponent
+ * <skew>. Keys are ranks scrambled by an odd multiplier, so that hot keys are
+ * not neighbours, which the random and fifo policies would also admit. */
+static void
+zipf_keys(double skew, size_t length, std::vector<int64_t> &keys)
+{
+    const size_t n = 100000;
+    std::vector<double> cdf(n);
+    double sum = 0;
+    for (size_t k = 0; k < n; ++k)
+    {
+        sum += pow(k + 1.0, -skew);
+        cdf[k] = sum;
+    }
+    for (size_t i = 0; i < length; ++i)
+    {
+        double u = ldexp((double)(prng_next() >> 11), -53) * sum;
+        size_t rank = std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+        keys.push_back((int64_t)((std::min(rank, n - 1) * 0x9e3779b1u) & 0xfffffff));
+    }
+    std::cout << "zipf " << skew << ": " << length << " lookups of " << n << " keys" << std::endl;
+}
+
+static void
+replay(const PolicyType &type, size_t size, const std::vector<int64_t> &keys)
+{
+    std::unique_ptr<Policy> policy = type.make(size);
+    size_t hits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int64_t key : keys)
+    {
+        hits += policy->access(key);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << std::left << std::setw(8) << type.name << std::right << std::setw(8) << size << std::fixed
+              << std::setprecision(2) << std::setw(11) << 100.0 * hits / keys.size() << "%" << std::setprecision(1)
+              << std::setw(10) << elapsed.count() * 1e9 / keys.size() << std::endl;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *program = argv[0];
+    bool zipf = argc > 1 && !strcmp(argv[1], "--zipf");
+    char *end = NULL;
+    double skew = zipf && argc > 2 ? strtod(argv[2], &end) : 0;
+    if (zipf)
+    {
+        /* Shift the arguments so that policy and sizes follow the stream. */
+        ++argv;
+        --argc;
+    }
+    const char *policy_name = argc > 2 ? argv[2] : "all";
+    bool known = !strcmp(policy_name, "all");
+    for (const auto &type : policies)
+    {
+        known = known || !strcmp(policy_name, type.name);
+    }
+    std::vector<size_t> sizes;
+    for (int i = 3; i < argc; ++i)
+    {
+        sizes.push_back(strtoul(argv[i], NULL, 10));
+        known = known && sizes.back() > 0;
+    }
+    if (argc < 2 || !known || (zipf && (end == argv[1] || *end || skew < 0)))
+    {
+        std::cerr << "Usage: " << program << " TRACE|--zipf SKEW [random|fifo|lru|tinylfu|all [SIZE...]]\n"
+                  << "Capture TRACE by running cache or cache-cpp with SQRT_TRACE=TRACE.\n";
+        return EXIT_FAILURE;
+    }
+    if (sizes.empty())
+    {
+        sizes = { 25, 50, 100, 200, 400, 800 };
+    }
+
+    std::vector<int64_t> keys;
+    if (zipf)
+    {
+        zipf_keys(skew, 1000000, keys);
+    }
+    else if (!load_trace(argv[1], keys))
+    {
+        return EXIT_FAILURE;
+    }
+    if (keys.empty())
+    {
+        std::cerr << argv[1] << ": trace is empty" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "policy      size   hit rate     ns/op" << std::endl;
+    for (const auto &type : policies)
+    {
+        if (strcmp(policy_name, "all") && strcmp(policy_name, type.name))
+        {
+            continue;
+        }
+        for (size_t size : sizes)
+        {
+            replay(type, size, keys);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,12 +1,23 @@
 /* This is free and unencumbered software released into the public domain.
  * Refer to LICENSE.txt in this directory. */
 
-/* Randomized stress test of a sqrt(x) caching mechanism. */
+/* Randomized stress test of a sqrt(x) caching mechanism.
+ *
+ * With PERF_REGIONS=1 in the environment, each batch of 100 iterations is
+ * profiled with hardware counters, as a single call is too short to measure,
+ * and a report is printed on failure. With SQRT_TRACE=FILE, the numbers looked up are captured to FILE
+ * for cache-replay; see trace.h. */
+
+#define _GNU_SOURCE
 
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "perf-region.h"
+#include "prng.h"
+#include "trace.h"
+
 typedef struct
 {
     unsigned char number;
@@ -46,7 +57,7 @@ cache_calculate(int number)
     for (number_adj = number - 1; number_adj < number + 1; ++number_adj)
     {
         int sqroot_adj = (int)(sqrt(number_adj));
-        i = (int)(1.0 * g_cache_size * rand() / (RAND_MAX + 1.0));
+        i = (int)prng_bounded(g_cache_size);
         g_cache[i].number = number_adj;
         g_cache[i].sqroot = sqroot_adj;
         if (number_adj == number)
@@ -70,10 +81,16 @@ main(void)
     {
         if (i % 100 == 0)
         {
+            if (i > 0)
+            {
+                perf_region_end("100 iterations");
+            }
             printf("i=%i\n", i);
+            perf_region_begin("100 iterations");
         }
         /* Check cache_calculate() with a random number. */
-        int number = (int)(256.0 * rand() / (RAND_MAX + 1.0));
+        int number = (int)prng_bounded(256);
+        trace_capture(number);
         int sqroot_cache = cache_calculate(number);
         int sqroot_correct = (int)sqrt(number);
 
@@ -82,6 +99,9 @@ main(void)
             /* cached_calculate() returned incorrect value. */
             printf("i=%i: number=%i sqroot_cache=%i sqroot_correct=%i\n",
                    i, number, sqroot_cache, sqroot_correct);
+            perf_region_end("100 iterations");
+            perf_region_report(stdout);
+            trace_capture_flush();
             abort();
         }
     }
@@ -1,31 +1,626 @@
 /* This is free and unencumbered software released into the public domain.
  * Refer to LICENSE.txt in this directory. */
 
-/* Compute-bound workload that sorts random numbers. */
+/* Compute-bound workload that sorts random numbers.
+ *
+ * By default sorts 1,000,000 numbers with std::sort, forever. The sort engine
+ * can be chosen on the command line:
+ *
+ *   std     std::sort on the calling thread.
+ *   sample  Parallel sample sort: bucket by sampled splitters, sort buckets.
+ *   merge   Parallel merge sort: sort chunks, then merge pairs, splitting each
+ *           merge into independent pieces so that every round is parallel.
+ *   radix   Parallel LSD radix sort on the 32-bit keys, 8 bits per pass.
+ *
+ * --bench times every engine at sizes 10^6, 10^7, ... for choosing one. The
+ * parallel engines use one thread per CPU, or CPUBOUND_THREADS threads.
+ *
+ * The random numbers come from a counter-based generator, so they are filled
+ * in parallel and the values depend only on the seed, not on the number of
+ * threads. CPUBOUND_SEED fixes the seed, which is otherwise random. The next
+ * buffer is filled in the background while the current one is sorted.
+ *
+ * With PERF_REGIONS=1 in the environment, the fills, the sorts and the pool
+ * workers' share of each sort are profiled with hardware counters; see
+ * perf-region.h. The report is printed every 10 sorts, or at the end of
+ * --bench. */
+
+#include <unistd.h>
 
 #include <algorithm>
-#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <random>
+#include <thread>
+#include <vector>
+
+#include "perf-region.h"
+#include "prng.h"
+
+/*
+ * Fixed set of worker threads that run parallel_for() loops. The calling
+ * thread takes part as well, so a pool of size N uses N threads in total.
+ * Loops must not be nested.
+ */
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned n_threads) : generation(0), stopping(false)
+    {
+        for (unsigned i = 1; i < n_threads; ++i)
+        {
+            workers.emplace_back(&ThreadPool::worker, this);
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    unsigned size() const
+    {
+        return static_cast<unsigned>(workers.size()) + 1;
+    }
+
+    /* Call fn(i) for every i in [0, n), spread over the pool, and wait. */
+    void parallel_for(size_t n, const std::function<void(size_t)> &fn)
+    {
+        if (n == 0)
+        {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        job_fn = &fn;
+        job_size = n;
+        next_index = 0;
+        remaining = n;
+        ++generation;
+        lock.unlock();
+        wake.notify_all();
+
+        run_indices(fn, n);
+
+        lock.lock();
+        /* Also wait for workers to leave run_indices(), so that none of them
+         * can claim an index of the next loop with this loop's job_fn. */
+        finished.wait(lock, [this]() { return remaining == 0 && busy == 0; });
+        job_fn = nullptr;
+    }
+
+private:
+    /* Claim and run indices of the current loop, fn over [0, n), until none
+     * are left. */
+    void run_indices(const std::function<void(size_t)> &fn, size_t n)
+    {
+        size_t done = 0;
+        for (;;)
+        {
+            size_t i = next_index.fetch_add(1, std::memory_order_relaxed);
+            if (i >= n)
+            {
+                break;
+            }
+            fn(i);
+            ++done;
+        }
+        if (done)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            remaining -= done;
+        }
+    }
+
+    void worker()
+    {
+        uint64_t seen = 0;
+        for (;;)
+        {
+            /* The loop is copied under the lock that parallel_for() published
+             * it under, and is only read from the copies. */
+            const std::function<void(size_t)> *fn;
+            size_t n;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&]() { return stopping || generation != seen; });
+                if (stopping)
+                {
+                    return;
+                }
+                seen = generation;
+                if (!job_fn)
+                {
+                    continue; /* Woke too late: that loop has finished. */
+                }
+                fn = job_fn;
+                n = job_size;
+                ++busy;
+            }
+            perf_region_begin("pool worker");
+            run_indices(*fn, n);
+            perf_region_end("pool worker");
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy == 0 && remaining == 0)
+            {
+                finished.notify_all();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;     /* A new loop has started, or stopping. */
+    std::condition_variable finished; /* The current loop has completed. */
+    uint64_t generation;
+    bool stopping;
+    const std::function<void(size_t)> *job_fn = nullptr; /* Protected by mutex. */
+    size_t job_size = 0;                                 /* Protected by mutex. */
+    std::atomic<size_t> next_index{ 0 };
+    size_t remaining = 0; /* Indices not yet completed; protected by mutex. */
+    unsigned busy = 0;    /* Workers inside run_indices(); protected by mutex. */
+};
+
+/* Below this many elements the parallel sorts just call std::sort. */
+static const size_t parallel_threshold = 1 << 14;
+
+/* Split [0, n) into <parts> nearly equal ranges and return the start of the
+ * <i>th; part_begin(n, parts, parts) == n. */
+static size_t
+part_begin(size_t n, size_t parts, size_t i)
+{
+    return n / parts * i + std::min(i, n % parts);
+}
+
+static void
+std_sort(ThreadPool &, std::vector<int> &data, std::vector<int> &)
+{
+    std::sort(data.begin(), data.end());
+}
+
+/*
+ * Sample sort: pick bucket splitters from a sorted random sample, count each
+ * block's elements per bucket, scatter every block into its buckets' space in
+ * <tmp>, then sort each bucket and copy it back. With 4 buckets per thread and
+ * 64 samples per bucket the buckets are close to even unless there are many
+ * duplicate keys.
+ */
+static void
+sample_sort(ThreadPool &pool, std::vector<int> &data, std::vector<int> &tmp)
+{
+    const size_t n = data.size();
+    if (n < parallel_threshold || pool.size() == 1)
+    {
+        std::sort(data.begin(), data.end());
+        return;
+    }
+    const size_t n_buckets = 4 * pool.size();
+    const size_t n_blocks = 4 * pool.size();
+    const size_t oversample = 64;
+
+    std::mt19937_64 rng(n);
+    std::vector<int> sample(n_buckets * oversample);
+    for (auto &s : sample)
+    {
+        s = data[rng() % n];
+    }
+    std::sort(sample.begin(), sample.end());
+    std::vector<int> splitters(n_buckets - 1);
+    for (size_t b = 1; b < n_buckets; ++b)
+    {
+        splitters[b - 1] = sample[b * oversample];
+    }
+    auto bucket_of = [&splitters](int x) {
+        return static_cast<size_t>(std::upper_bound(splitters.begin(), splitters.end(), x)
+                                   - splitters.begin());
+    };
+
+    /* counts[block * n_buckets + bucket], then turned into scatter offsets. */
+    std::vector<size_t> counts(n_blocks * n_buckets);
+    pool.parallel_for(n_blocks, [&](size_t block) {
+        size_t *count = &counts[block * n_buckets];
+        for (size_t i = part_begin(n, n_blocks, block); i < part_begin(n, n_blocks, block + 1); ++i)
+        {
+            ++count[bucket_of(data[i])];
+        }
+    });
+    std::vector<size_t> bucket_begin(n_buckets + 1);
+    size_t offset = 0;
+    for (size_t bucket = 0; bucket < n_buckets; ++bucket)
+    {
+        bucket_begin[bucket] = offset;
+        for (size_t block = 0; block < n_blocks; ++block)
+        {
+            size_t count = counts[block * n_buckets + bucket];
+            counts[block * n_buckets + bucket] = offset;
+            offset += count;
+        }
+    }
+    bucket_begin[n_buckets] = n;
+
+    pool.parallel_for(n_blocks, [&](size_t block) {
+        size_t *next = &counts[block * n_buckets];
+        for (size_t i = part_begin(n, n_blocks, block); i < part_begin(n, n_blocks, block + 1); ++i)
+        {
+            tmp[next[bucket_of(data[i])]++] = data[i];
+        }
+    });
+
+    pool.parallel_for(n_buckets, [&](size_t bucket) {
+        int *begin = tmp.data() + bucket_begin[bucket];
+        int *end = tmp.data() + bucket_begin[bucket + 1];
+        std::sort(begin, end);
+        std::copy(begin, end, data.data() + bucket_begin[bucket]);
+    });
+}
+
+/* Return how many of the first <k> elements of the merge of sorted ranges
+ * <a> and <b> come from <a>, taking from <a> first on ties like std::merge. */
+static size_t
+merge_split(const int *a, size_t na, const int *b, size_t nb, size_t k)
+{
+    size_t lo = k > nb ? k - nb : 0;
+    size_t hi = std::min(k, na);
+    while (lo < hi)
+    {
+        size_t i = lo + (hi - lo) / 2;
+        if (a[i] <= b[k - i - 1])
+        {
+            lo = i + 1;
+        }
+        else
+        {
+            hi = i;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Merge sort: sort one chunk per thread with std::sort, then merge pairs of
+ * runs until one is left, alternating between <data> and <tmp>. Each round's
+ * output is cut into pool-size pieces at merge_split() points, so the last
+ * rounds, with only one or two merges, are as parallel as the first.
+ */
+static void
+merge_sort(ThreadPool &pool, std::vector<int> &data, std::vector<int> &tmp)
+{
+    const size_t n = data.size();
+    if (n < parallel_threshold || pool.size() == 1)
+    {
+        std::sort(data.begin(), data.end());
+        return;
+    }
+    size_t n_runs = pool.size();
+    pool.parallel_for(n_runs, [&](size_t run) {
+        std::sort(data.begin() + part_begin(n, n_runs, run),
+                  data.begin() + part_begin(n, n_runs, run + 1));
+    });
+
+    /* run_begin[r] is the start of run r; runs are merged pairwise. */
+    std::vector<size_t> run_begin(n_runs + 1);
+    for (size_t run = 0; run <= n_runs; ++run)
+    {
+        run_begin[run] = part_begin(n, n_runs, run);
+    }
+    int *src = data.data(), *dst = tmp.data();
+    while (n_runs > 1)
+    {
+        size_t n_pairs = (n_runs + 1) / 2;
+        size_t pieces = (pool.size() + n_pairs - 1) / n_pairs;
+        pool.parallel_for(n_pairs * pieces, [&](size_t task) {
+            size_t pair = task / pieces, piece = task % pieces;
+            size_t begin = run_begin[2 * pair];
+            size_t mid = run_begin[std::min(2 * pair + 1, n_runs)];
+            size_t end = run_begin[std::min(2 * pair + 2, n_runs)];
+            const int *a = src + begin, *b = src + mid;
+            size_t na = mid - begin, nb = end - mid;
+            size_t k0 = part_begin(na + nb, pieces, piece), k1 = part_begin(na + nb, pieces, piece + 1);
+            size_t i0 = merge_split(a, na, b, nb, k0), i1 = merge_split(a, na, b, nb, k1);
+            std::merge(a + i0, a + i1, b + (k0 - i0), b + (k1 - i1), dst + begin + k0);
+        });
+        for (size_t pair = 0; pair < n_pairs; ++pair)
+        {
+            run_begin[pair] = run_begin[2 * pair];
+        }
+        run_begin[n_pairs] = n;
+        n_runs = n_pairs;
+        std::swap(src, dst);
+    }
+
+    if (src != data.data())
+    {
+        size_t n_chunks = pool.size();
+        pool.parallel_for(n_chunks, [&](size_t chunk) {
+            std::copy(src + part_begin(n, n_chunks, chunk), src + part_begin(n, n_chunks, chunk + 1),
+                      data.data() + part_begin(n, n_chunks, chunk));
+        });
+    }
+}
+
+/*
+ * LSD radix sort of the 32-bit keys, 8 bits per pass, so four passes leave
+ * the result back in <data>. Each pass counts digits per block in parallel,
+ * turns the counts into per-block offsets (digit-major, so the scatter is
+ * stable) and scatters the blocks in parallel. The sign bit is flipped so
+ * that negative numbers sort first. A pass whose digit is the same for every
+ * element is skipped, which is common for the top byte.
+ */
+static void
+radix_sort(ThreadPool &pool, std::vector<int> &data, std::vector<int> &tmp)
+{
+    const size_t n = data.size();
+    const size_t n_blocks = pool.size();
+    const size_t radix = 256;
+    std::vector<size_t> counts(n_blocks * radix);
+    uint32_t *src = reinterpret_cast<uint32_t *>(data.data());
+    uint32_t *dst = reinterpret_cast<uint32_t *>(tmp.data());
+
+    for (unsigned shift = 0; shift < 32; shift += 8)
+    {
+        auto digit = [shift](uint32_t x) { return ((x ^ 0x80000000u) >> shift) & 0xff; };
+        std::fill(counts.begin(), counts.end(), 0);
+        pool.parallel_for(n_blocks, [&](size_t block) {
+            size_t *count = &counts[block * radix];
+            for (size_t i = part_begin(n, n_blocks, block); i < part_begin(n, n_blocks, block + 1); ++i)
+            {
+                ++count[digit(src[i])];
+            }
+        });
+
+        size_t offset = 0;
+        bool trivial = false;
+        for (size_t d = 0; d < radix; ++d)
+        {
+            size_t total = 0;
+            for (size_t block = 0; block < n_blocks; ++block)
+            {
+                size_t count = counts[block * radix + d];
+                counts[block * radix + d] = offset;
+                offset += count;
+                total += count;
+            }
+            trivial = trivial || total == n;
+        }
+        if (trivial)
+        {
+            /* The scatter would copy src unchanged; leave the data in src. */
+            continue;
+        }
+
+        pool.parallel_for(n_blocks, [&](size_t block) {
+            size_t *next = &counts[block * radix];
+            for (size_t i = part_begin(n, n_blocks, block); i < part_begin(n, n_blocks, block + 1); ++i)
+            {
+                dst[next[digit(src[i])]++] = src[i];
+            }
+        });
+        std::swap(src, dst);
+    }
+
+    if (src != reinterpret_cast<uint32_t *>(data.data()))
+    {
+        std::memcpy(data.data(), src, n * sizeof(int));
+    }
+}
+
+typedef void sort_fn(ThreadPool &pool, std::vector<int> &data, std::vector<int> &tmp);
+
+struct SortEngine
+{
+    const char *name;
+    sort_fn *sort;
+};
+
+static const SortEngine engines[] = {
+    { "std", std_sort },
+    { "sample", sample_sort },
+    { "merge", merge_sort },
+    { "radix", radix_sort },
+};
+
+static const SortEngine *
+find_engine(const char *name)
+{
+    for (const auto &engine : engines)
+    {
+        if (!strcmp(engine.name, name))
+        {
+            return &engine;
+        }
+    }
+    return nullptr;
+}
+
+/* Elements filled by each parallel_for() index in fill_random(). */
+static const size_t fill_chunk = 1 << 16;
+
+/*
+ * Fill <numbers> with elements <first>, <first> + 1, ... of random stream
+ * <seed>, as non-negative ints like std::uniform_int_distribution<int>. Each
+ * element depends only on its index in the stream, so the result is the same
+ * for any pool size, and consecutive calls continue one reproducible stream.
+ */
+static void
+fill_random(ThreadPool &pool, std::vector<int> &numbers, uint64_t seed, uint64_t first)
+{
+    const size_t n = numbers.size();
+    pool.parallel_for((n + fill_chunk - 1) / fill_chunk, [&](size_t chunk) {
+        size_t end = std::min(n, (chunk + 1) * fill_chunk);
+        for (size_t i = chunk * fill_chunk; i < end; ++i)
+        {
+            numbers[i] = static_cast<int>(prng_at(seed, first + i) >> 33);
+        }
+    });
+}
+
+static double
+seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * Sort sizes 10^6, 10^7, ... up to <max_size> with every engine, <iterations>
+ * times each on fresh random numbers, and print each iteration's time and
+ * the best. The time to fill the numbers is shown first as "fill". Sizes
+ * whose two buffers do not fit in the available memory are skipped.
+ */
+static int
+bench(ThreadPool &pool, unsigned iterations, size_t max_size)
+{
+    uint64_t filled = 0;
+    uint64_t available = static_cast<uint64_t>(sysconf(_SC_AVPHYS_PAGES)) * sysconf(_SC_PAGESIZE);
+    std::cout << "threads=" << pool.size() << std::endl;
+    for (size_t size = 1000000; size <= max_size; size *= 10)
+    {
+        uint64_t needed = 2 * static_cast<uint64_t>(size) * sizeof(int);
+        if (needed > available)
+        {
+            std::cout << "n=" << size << ": skipped, needs " << (needed >> 20) << " MB but only "
+                      << (available >> 20) << " MB is available" << std::endl;
+            continue;
+        }
+        std::vector<int> numbers(size), tmp(size);
+        double best_fill = 0;
+        std::cout << std::left << std::setw(7) << "fill" << std::right << "n=" << std::setw(10) << size
+                  << " seconds:";
+        for (unsigned i = 0; i < iterations; ++i)
+        {
+            auto start = std::chrono::steady_clock::now();
+            perf_region_begin("fill");
+            fill_random(pool, numbers, 1, 0);
+            perf_region_end("fill");
+            double elapsed = seconds_since(start);
+            best_fill = i == 0 ? elapsed : std::min(best_fill, elapsed);
+            std::cout << " " << std::fixed << std::setprecision(3) << elapsed << std::flush;
+        }
+        std::cout << "  best " << best_fill << " (" << std::setprecision(1) << size / best_fill / 1e6
+                  << " M/s)" << std::endl;
+
+        for (const auto &engine : engines)
+        {
+            double best = 0;
+            std::cout << std::left << std::setw(7) << engine.name << std::right << "n=" << std::setw(10)
+                      << size << " seconds:";
+            for (unsigned i = 0; i < iterations; ++i)
+            {
+                fill_random(pool, numbers, 1, filled);
+                filled += size;
+                uint64_t sum = 0;
+                for (int x : numbers)
+                {
+                    sum += x;
+                }
+                auto start = std::chrono::steady_clock::now();
+                perf_region_begin(engine.name);
+                engine.sort(pool, numbers, tmp);
+                perf_region_end(engine.name);
+                double elapsed = seconds_since(start);
+                for (int x : numbers)
+                {
+                    sum -= x;
+                }
+                if (sum != 0 || !std::is_sorted(numbers.begin(), numbers.end()))
+                {
+                    std::cout << std::endl << engine.name << ": output is not a sorted permutation" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                best = i == 0 ? elapsed : std::min(best, elapsed);
+                std::cout << " " << std::fixed << std::setprecision(3) << elapsed << std::flush;
+            }
+            std::cout << "  best " << best << " (" << std::setprecision(1) << size / best / 1e6
+                      << " M/s)" << std::endl;
+        }
+    }
+    perf_region_report(stdout);
+    return EXIT_SUCCESS;
+}
+
+static void
+usage(const char *argv0)
+{
+    std::cerr << "Usage: " << argv0 << " [std|sample|merge|radix]\n"
+              << "       " << argv0 << " --bench [ITERATIONS [MAX-SIZE]]\n";
+}
 
 int
-main()
+main(int argc, char **argv)
 {
-    std::array<int, 1000000> numbers;
+    const char *threads_env = getenv("CPUBOUND_THREADS");
+    unsigned n_threads = threads_env ? strtoul(threads_env, NULL, 10) : std::thread::hardware_concurrency();
+    ThreadPool pool(n_threads ? n_threads : 1);
+
+    if (argc >= 2 && !strcmp(argv[1], "--bench"))
+    {
+        unsigned iterations = argc > 2 ? strtoul(argv[2], NULL, 10) : 3;
+        size_t max_size = argc > 3 ? strtoull(argv[3], NULL, 10) : 1000000000;
+        if (argc > 4 || !iterations)
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        return bench(pool, iterations, max_size);
+    }
+    const SortEngine *engine = argc == 2 ? find_engine(argv[1]) : &engines[0];
+    if (argc > 2 || !engine)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *seed_env = getenv("CPUBOUND_SEED");
     std::random_device rng_device;
-    std::default_random_engine rng(rng_device());
-    std::uniform_int_distribution<int> uint_dist;
+    uint64_t seed = seed_env ? strtoull(seed_env, NULL, 0) : (uint64_t(rng_device()) << 32) | rng_device();
+
+    /* Double buffering: <next> is filled by a background task, with its own
+     * pool so that it does not wait for the sort's parallel_for() loops, while
+     * <numbers> is sorted. The default std engine sorts on one thread, so
+     * there the fill uses otherwise idle CPUs. */
+    ThreadPool fill_pool(pool.size());
+    std::vector<int> numbers(1000000), next(numbers.size()), tmp(numbers.size());
+    uint64_t filled = 0;
+    auto fill_next = [&]() {
+        perf_region_begin("fill");
+        fill_random(fill_pool, next, seed, filled);
+        perf_region_end("fill");
+        filled += next.size();
+    };
+    std::future<void> fill = std::async(std::launch::async, fill_next);
 
-    for (;;)
+    for (unsigned iteration = 1;; ++iteration)
     {
         std::cout << "Initialising random numbers..." << std::endl;
-        for (auto &number : numbers)
+        fill.get();
+        numbers.swap(next);
+        fill = std::async(std::launch::async, fill_next);
+        std::cout << "Starting sort..." << std::endl;
+        auto start = std::chrono::steady_clock::now();
+        perf_region_begin(engine->name);
+        engine->sort(pool, numbers, tmp);
+        perf_region_end(engine->name);
+        std::cout << "Sorted with " << engine->name << " in " << std::fixed << std::setprecision(3)
+                  << seconds_since(start) << "s." << std::endl;
+        if (iteration % 10 == 0)
         {
-            number = uint_dist(rng);
+            perf_region_report(stdout);
         }
-        std::cout << "Starting sort..." << std::endl;
-        std::sort(numbers.begin(), numbers.end());
-        std::cout << "Sorted." << std::endl;
     }
 
     return EXIT_SUCCESS;
@@ -1,26 +1,53 @@
 /* This is free and unencumbered software released into the public domain.
  * Refer to LICENSE.txt in this directory. */
 
-/* Randomized threaded stress test of a singly-linked list. */
+/* Randomized threaded stress test of a linked list.
+ *
+ * THREAD_PLACEMENT pins the testers to CPUs; see topology.h. */
+
+#define _GNU_SOURCE
 
 #include <assert.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "topology.h"
+
+/* Maximum height of a skip list tower. With p = 1/2 this comfortably covers
+ * lists of up to 2^32 elements. */
+enum
+{
+    max_level = 32
+};
+
+/* One level of a skip list tower: a forward pointer and the number of
+ * level-0 steps it spans. */
+struct skiplink
+{
+    struct element *next;
+    unsigned width;
+};
+
 /* A simple element of a list (see struct list below). */
 struct element
 {
-    struct element *next;
     unsigned value;
+    unsigned height;
+    struct skiplink link[]; /* <height> levels. */
 };
 
-/* A singly-linked list of struct elements. */
+/* A list of struct elements, stored as an indexable skip list so that the
+ * nth element can be found in O(log n). Elements are kept in list order, so
+ * level 0 is the plain singly-linked list. The width of a link whose next is
+ * NULL counts the steps to one past the end of the list. */
 struct list
 {
     pthread_mutex_t lock;
-    struct element *elements;
+    struct skiplink head[max_level];
     unsigned n_elements;
 };
 
@@ -30,7 +57,11 @@ list_init(struct list *l)
     int r = pthread_mutex_init(&l->lock, NULL);
     assert(!r);
     l->n_elements = 0;
-    l->elements = NULL;
+    for (unsigned level = 0; level < max_level; ++level)
+    {
+        l->head[level].next = NULL;
+        l->head[level].width = 1;
+    }
 }
 
 static void
@@ -47,77 +78,230 @@ list_unlock(struct list *l)
     assert(!r);
 }
 
+/* Lock two lists, which may be the same list. Locks are always taken in
+ * address order so that concurrent moves in opposite directions cannot
+ * deadlock. */
+static void
+list_lock2(struct list *l1, struct list *l2)
+{
+    if (l1 == l2)
+    {
+        list_lock(l1);
+    }
+    else if (l1 < l2)
+    {
+        list_lock(l1);
+        list_lock(l2);
+    }
+    else
+    {
+        list_lock(l2);
+        list_lock(l1);
+    }
+}
+
+/* Unlock two lists locked by list_lock2(). */
+static void
+list_unlock2(struct list *l1, struct list *l2)
+{
+    list_unlock(l1);
+    if (l1 != l2)
+    {
+        list_unlock(l2);
+    }
+}
+
+/* Pick a tower height with P(height > k) = 2^-k, from a per-thread xorshift
+ * generator so that threads do not contend on the random state. */
+static unsigned
+random_height(void)
+{
+    static __thread unsigned state;
+    if (!state)
+    {
+        state = (unsigned)(size_t)&state | 1;
+    }
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    unsigned height = 1 + __builtin_ctz(state | (1u << (max_level - 1)));
+    return height;
+}
+
 /* Allocs memory for element and initializes it to <value>, and returns a pointer to the new
  * element. Does not return NULL (aborts if unable to allocate memory). */
 static struct element *
 element_new(unsigned value)
 {
-    struct element *new_el = malloc(sizeof(*new_el));
+    unsigned height = random_height();
+    size_t size = sizeof(struct element) + height * sizeof(struct skiplink);
+    struct element *new_el = malloc(size);
     if (!new_el)
     {
-        fprintf(stderr, "Out of memory allocating %zu bytes\n", sizeof(*new_el));
+        fprintf(stderr, "Out of memory allocating %zu bytes\n", size);
         abort();
     }
 
     new_el->value = value;
+    new_el->height = height;
     return new_el;
 }
 
+/* Return the link at <level> of <el>, where NULL is the head of list <l>. */
+static struct skiplink *
+list_link(struct list *l, struct element *el, unsigned level)
+{
+    return el ? &el->link[level] : &l->head[level];
+}
+
+/* Link element <new_el> at position <n> of list <l>, which must be at most
+ * l->n_elements. Caller must hold the lock of <l>. */
 static void
-list_prepend(struct list *l, struct element *new_el)
+list_insert_locked(struct list *l, unsigned n, struct element *new_el)
+{
+    /* Positions are 1-based with the head at 0; the new element goes to n + 1. */
+    struct element *x = NULL;
+    unsigned pos = 0;
+    for (unsigned level = max_level; level-- > 0;)
+    {
+        struct skiplink *link = list_link(l, x, level);
+        while (link->next && pos + link->width <= n)
+        {
+            pos += link->width;
+            x = link->next;
+            link = &x->link[level];
+        }
+        if (level < new_el->height)
+        {
+            new_el->link[level].next = link->next;
+            new_el->link[level].width = pos + link->width - n;
+            link->next = new_el;
+            link->width = n + 1 - pos;
+        }
+        else
+        {
+            link->width++;
+        }
+    }
+    l->n_elements++;
+}
+
+/* Link element <new_el> at the head of list <l>. Caller must hold the lock of <l>. */
+static void
+list_prepend_locked(struct list *l, struct element *new_el)
+{
+    list_insert_locked(l, 0, new_el);
+}
+
 /* Link element <new_el> at the head of list <l>. */
+static void
+list_prepend(struct list *l, struct element *new_el)
 {
     list_lock(l);
-    new_el->next = l->elements;
-    l->elements = new_el;
-    l->n_elements++;
+    list_prepend_locked(l, new_el);
     list_unlock(l);
 }
 
-/* Unlink the nth element from list <l> and return a pointer to it. */
+/* Unlink the nth element from list <l> in O(log n) and return a pointer to it,
+ * or NULL if there is no nth element. Caller must hold the lock of <l>. */
 static struct element *
-list_unlink(struct list *l, unsigned n)
+list_unlink_locked(struct list *l, unsigned n)
 {
-    struct element *ret = NULL;
-    struct element **el_pp;
-    list_lock(l);
-    for (el_pp = &l->elements; (*el_pp) && n--; el_pp = &((*el_pp)->next))
+    if (n >= l->n_elements)
     {
+        return NULL; // No nth element.
     }
 
-    if (!(*el_pp))
+    struct skiplink *update[max_level];
+    struct element *x = NULL;
+    unsigned pos = 0;
+    for (unsigned level = max_level; level-- > 0;)
     {
-        return NULL; // No nth element.
+        struct skiplink *link = list_link(l, x, level);
+        while (link->next && pos + link->width <= n)
+        {
+            pos += link->width;
+            x = link->next;
+            link = &x->link[level];
+        }
+        update[level] = link;
     }
 
-    ret = (*el_pp);
-    (*el_pp) = (*el_pp)->next;
+    struct element *ret = update[0]->next;
+    for (unsigned level = 0; level < max_level; ++level)
+    {
+        if (level < ret->height)
+        {
+            update[level]->next = ret->link[level].next;
+            update[level]->width += ret->link[level].width - 1;
+        }
+        else
+        {
+            update[level]->width--;
+        }
+    }
     l->n_elements--;
+    return ret;
+}
 
+/* Unlink the nth element from list <l> and return a pointer to it, or NULL if
+ * there is no nth element. */
+static struct element *
+list_unlink(struct list *l, unsigned n)
+{
+    list_lock(l);
+    struct element *ret = list_unlink_locked(l, n);
     list_unlock(l);
     return ret;
 }
 
-/* Unlink the <n>th element from list <l1> and link it into list <l2>. */
-static void
+/* Unlink the <n>th element from list <l1> and link it into list <l2>. Returns
+ * the moved element, or NULL if <l1> has no nth element. */
+static struct element *
 list_move_element(struct list *l1, unsigned n, struct list *l2)
 {
-    list_lock(l1);
-    list_lock(l2);
-    struct element *el = list_unlink(l1, n);
-    list_prepend(l2, el);
-    list_unlock(l2);
-    list_unlock(l1);
+    list_lock2(l1, l2);
+    struct element *el = list_unlink_locked(l1, n);
+    if (el)
+    {
+        list_prepend_locked(l2, el);
+    }
+    list_unlock2(l1, l2);
+    return el;
 }
 
 /* Unlinks all elements from list <l> and frees associated memory. */
 static void
 list_free(struct list *l)
 {
-    while (l->elements)
+    list_lock(l);
+    struct element *el = l->head[0].next;
+    while (el)
+    {
+        struct element *next = el->link[0].next;
+        free(el);
+        el = next;
+    }
+    l->n_elements = 0;
+    for (unsigned level = 0; level < max_level; ++level)
+    {
+        l->head[level].next = NULL;
+        l->head[level].width = 1;
+    }
+    list_unlock(l);
+}
+
+/* Return the nth element of list <l> by walking level 0, as a plain
+ * singly-linked list would. Only used as the benchmark baseline. Caller must
+ * hold the lock of <l>. */
+static struct element *
+list_nth_linear_locked(struct list *l, unsigned n)
+{
+    struct element *el;
+    for (el = l->head[0].next; el && n--; el = el->link[0].next)
     {
-        free(list_unlink(l, 0));
     }
+    return el;
 }
 
 /* Some lists which we will use to test the above implementaiton. */
@@ -127,35 +311,54 @@ enum
 };
 static struct list g_lists[n_lists];
 
+/* Per-thread parameters and results of tester(). */
+struct tester_args
+{
+    pthread_t thread;
+    unsigned index;
+    unsigned seed;
+    unsigned long iters;
+    unsigned long ops[3]; /* Successful add, remove and move operations. */
+};
+
 static void *
 tester(void *p)
 {
-    (void)p;
-    unsigned iters = 1000;
+    struct tester_args *args = p;
+    unsigned long iters = args->iters;
+    topology_pin_self(args->index);
     while (iters--)
     {
-        printf("iters=%d\n", iters);
         struct list *l2;
-        struct list *l = &g_lists[rand() % n_lists];
+        struct list *l = &g_lists[rand_r(&args->seed) % n_lists];
+        struct element *el;
+        unsigned op = rand_r(&args->seed) % 3;
+        /* Random position; list_unlink() and list_move_element() bounds-check
+         * it under the lock, so reading n_elements racily here is harmless. */
+        unsigned n = __atomic_load_n(&l->n_elements, __ATOMIC_RELAXED);
+        n = n ? rand_r(&args->seed) % n : 0;
 
-        switch (rand() % 2) // note: currently only tests add and remove
+        switch (op)
         {
             case 0: // add
-                list_prepend(l, element_new(rand()));
+                list_prepend(l, element_new(rand_r(&args->seed)));
+                args->ops[op]++;
                 break;
 
             case 1: // remove
-                if (l->n_elements)
+                el = list_unlink(l, n);
+                if (el)
                 {
-                    list_unlink(l, (rand() % l->n_elements) + 1);
+                    free(el);
+                    args->ops[op]++;
                 }
                 break;
 
             case 2: // move
-                l2 = &g_lists[rand() % n_lists];
-                if (l->n_elements)
+                l2 = &g_lists[rand_r(&args->seed) % n_lists];
+                if (list_move_element(l, n, l2))
                 {
-                    list_move_element(l, rand() % l->n_elements, l2);
+                    args->ops[op]++;
                 }
                 break;
         }
@@ -164,10 +367,127 @@ tester(void *p)
     return NULL;
 }
 
+static double
+now(void)
+{
+    struct timespec ts;
+    int r = clock_gettime(CLOCK_MONOTONIC, &ts);
+    assert(!r);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Check positional unlinks against an array oracle, then time random
+ * positional moves between two lists of <n_elements> elements in total and
+ * compare with finding the element by walking the list. */
+static void
+bench(unsigned n_elements, unsigned long n_ops)
+{
+    unsigned seed = 1;
+    struct list *l1 = &g_lists[0], *l2 = &g_lists[1];
+
+    /* Oracle check on a small list: element values are their positions. */
+    enum
+    {
+        n_check = 10000
+    };
+    static unsigned oracle[n_check];
+    for (unsigned i = n_check; i-- > 0;)
+    {
+        list_prepend(l1, element_new(i));
+        oracle[i] = i;
+    }
+    for (unsigned len = n_check; len > 0; --len)
+    {
+        unsigned n = rand_r(&seed) % len;
+        struct element *el = list_unlink(l1, n);
+        assert(el && el->value == oracle[n]);
+        free(el);
+        for (unsigned i = n; i + 1 < len; ++i)
+        {
+            oracle[i] = oracle[i + 1];
+        }
+    }
+    assert(l1->n_elements == 0 && list_unlink(l1, 0) == NULL);
+
+    double start = now();
+    for (unsigned i = 0; i < n_elements; ++i)
+    {
+        list_prepend(i % 2 ? l2 : l1, element_new(i));
+    }
+    printf("built %u elements in %.3fs\n", n_elements, now() - start);
+
+    start = now();
+    for (unsigned long i = 0; i < n_ops; ++i)
+    {
+        struct list *from = i % 2 ? l2 : l1;
+        struct list *to = i % 2 ? l1 : l2;
+        unsigned n = rand_r(&seed) % from->n_elements;
+        struct element *el = list_move_element(from, n, to);
+        assert(el);
+    }
+    double elapsed = now() - start;
+    printf("skip list: %lu random moves, %.0f ns/op, %.0f ops/sec\n",
+           n_ops, elapsed * 1e9 / n_ops, n_ops / elapsed);
+
+    unsigned long n_linear = n_ops / 10000 ? n_ops / 10000 : 1;
+    start = now();
+    for (unsigned long i = 0; i < n_linear; ++i)
+    {
+        list_lock(l1);
+        struct element *el = list_nth_linear_locked(l1, rand_r(&seed) % l1->n_elements);
+        assert(el);
+        list_unlock(l1);
+    }
+    elapsed = now() - start;
+    printf("linear walk: %lu random lookups, %.0f ns/op, %.0f ops/sec\n",
+           n_linear, elapsed * 1e9 / n_linear, n_linear / elapsed);
+
+    unsigned count = 0;
+    for (struct element *el = l1->head[0].next; el; el = el->link[0].next)
+    {
+        ++count;
+    }
+    for (struct element *el = l2->head[0].next; el; el = el->link[0].next)
+    {
+        ++count;
+    }
+    assert(count == n_elements && l1->n_elements + l2->n_elements == n_elements);
+}
+
 int
-main(void)
+main(int argc, char **argv)
 {
     int r;
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+    {
+        unsigned n_elements = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+        unsigned long n_ops = argc > 3 ? strtoul(argv[3], NULL, 10) : 1000000;
+        if (argc > 4 || n_elements < 2)
+        {
+            fprintf(stderr, "Usage: %s bench [ELEMENTS [OPERATIONS]]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        for (struct list *l = g_lists; l < g_lists + n_lists; l++)
+        {
+            list_init(l);
+        }
+        bench(n_elements, n_ops);
+        for (struct list *l = g_lists; l < g_lists + n_lists; l++)
+        {
+            list_free(l);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    unsigned n_threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 16;
+    unsigned long iters = argc > 2 ? strtoul(argv[2], NULL, 10) : 100000;
+    if (argc > 3 || !n_threads)
+    {
+        fprintf(stderr, "Usage: %s [THREADS [ITERATIONS-PER-THREAD]]\n"
+                        "       %s bench [ELEMENTS [OPERATIONS]]\n",
+                argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
     printf("Running as pid %d\n", getpid());
 
     struct list *l;
@@ -176,19 +496,34 @@ main(void)
         list_init(l);
     }
 
-    pthread_t threads[2];
-    unsigned n, n_threads = sizeof(threads) / sizeof(threads[0]);
+    struct tester_args *args = calloc(n_threads, sizeof *args);
+    assert(args);
+    unsigned n;
+    double start = now();
     for (n = 0; n < n_threads; ++n)
     {
-        r = pthread_create(&threads[n], NULL, tester, NULL);
+        args[n].index = n;
+        args[n].seed = n + 1;
+        args[n].iters = iters;
+        r = pthread_create(&args[n].thread, NULL, tester, &args[n]);
         assert(!r);
     }
 
+    unsigned long ops[3] = { 0, 0, 0 };
     for (n = 0; n < n_threads; ++n)
     {
-        r = pthread_join(threads[n], NULL);
+        r = pthread_join(args[n].thread, NULL);
         assert(!r);
+        ops[0] += args[n].ops[0];
+        ops[1] += args[n].ops[1];
+        ops[2] += args[n].ops[2];
     }
+    double elapsed = now() - start;
+    free(args);
+
+    unsigned long total = (unsigned long)n_threads * iters;
+    printf("threads=%u ops=%lu time=%.3fs ops/sec=%.0f (add=%lu remove=%lu move=%lu)\n",
+           n_threads, total, elapsed, total / elapsed, ops[0], ops[1], ops[2]);
 
     for (l = g_lists; l < g_lists + n_lists; l++)
     {
@@ -0,0 +1,247 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/* Randomized stress test and benchmark of the uint64_t-keyed map in hashmap.h.
+ *
+ * "hashmap [SEED]" applies random inserts, erases and lookups to maps with 8,
+ * 16 and 32-byte values and checks every result against std::unordered_map.
+ * The keys include 0 and UINT64_MAX, which a table with a reserved empty key
+ * could not hold.
+ *
+ * "hashmap --bench [KEYS]" times inserting KEYS random keys (default
+ * 1000000), looking them all up, looking up as many absent keys and erasing
+ * them all, in HashMap and in std::unordered_map. */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include "hashmap.h"
+#include "prng.h"
+
+template <size_t Bytes>
+struct Value
+{
+    uint64_t word[Bytes / 8];
+
+    static Value make(uint64_t key, uint64_t version)
+    {
+        Value value;
+        for (size_t i = 0; i < Bytes / 8; ++i)
+        {
+            value.word[i] = key ^ (version + i);
+        }
+        return value;
+    }
+
+    bool operator==(const Value &other) const
+    {
+        return memcmp(word, other.word, sizeof word) == 0;
+    }
+};
+
+/* Run <operations> random operations on keys drawn from <n_keys> distinct
+ * keys, checking HashMap against std::unordered_map. */
+template <size_t Bytes>
+static void
+stress(unsigned long operations, uint32_t n_keys)
+{
+    typedef Value<Bytes> V;
+    HashMap<V> map;
+    std::unordered_map<uint64_t, V> expected;
+    for (unsigned long n = 0; n < operations; ++n)
+    {
+        /* Random 64-bit keys, including the extremes. */
+        uint64_t r = prng_bounded(n_keys);
+        uint64_t key = r == 0 ? 0 : r == 1 ? UINT64_MAX : prng_at(0, r);
+        auto it = expected.find(key);
+        switch (prng_bounded(3))
+        {
+        case 0:
+        {
+            V value = V::make(key, n);
+            bool added = map.insert(key, value);
+            assert(added == (it == expected.end()));
+            expected[key] = value;
+            break;
+        }
+        case 1:
+        {
+            bool erased = map.erase(key);
+            assert(erased == (it != expected.end()));
+            if (it != expected.end())
+            {
+                expected.erase(it);
+            }
+            break;
+        }
+        default:
+        {
+            const V *value = map.find(key);
+            assert((value != NULL) == (it != expected.end()));
+            assert(value == NULL || *value == it->second);
+        }
+        }
+        assert(map.size() == expected.size());
+
+        if (n % 4096 == 0)
+        {
+            size_t seen = 0;
+            map.for_each([&](uint64_t k, const V &v) {
+                auto e = expected.find(k);
+                assert(e != expected.end() && e->second == v);
+                ++seen;
+            });
+            assert(seen == expected.size());
+        }
+    }
+    std::cout << "hashmap: " << operations << " operations with " << Bytes << "-byte values: OK" << std::endl;
+}
+
+/* Keeps lookup results alive so they are not optimised away. */
+static volatile uint64_t g_sink;
+
+static double
+seconds_since(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+/* Time each phase on <map> through the adapters <insert>, <find> and <erase>,
+ * and print ns per operation. */
+template <typename Map, typename Insert, typename Find, typename Erase>
+static void
+bench_map(const char *name, size_t bytes, Map &map, const std::vector<uint64_t> &keys,
+          const std::vector<uint64_t> &absent, Insert insert, Find find, Erase erase)
+{
+    std::vector<uint64_t> shuffled(keys);
+    for (size_t i = shuffled.size(); i > 1; --i)
+    {
+        std::swap(shuffled[i - 1], shuffled[prng_bounded(i)]);
+    }
+    double n = keys.size();
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t key : keys)
+    {
+        insert(map, key);
+    }
+    double insert_s = seconds_since(start);
+
+    uint64_t sum = 0;
+    start = std::chrono::steady_clock::now();
+    for (uint64_t key : shuffled)
+    {
+        sum += find(map, key);
+    }
+    double hit_s = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    for (uint64_t key : absent)
+    {
+        sum += find(map, key);
+    }
+    double miss_s = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    for (uint64_t key : shuffled)
+    {
+        erase(map, key);
+    }
+    double erase_s = seconds_since(start);
+    g_sink = g_sink + sum;
+
+    std::cout << std::left << std::setw(20) << name << std::right << std::setw(6) << bytes << std::fixed
+              << std::setprecision(1) << std::setw(9) << insert_s * 1e9 / n << std::setw(9) << hit_s * 1e9 / n
+              << std::setw(9) << miss_s * 1e9 / n << std::setw(9) << erase_s * 1e9 / n << std::endl;
+}
+
+template <size_t Bytes>
+static void
+bench(const std::vector<uint64_t> &keys, const std::vector<uint64_t> &absent)
+{
+    typedef Value<Bytes> V;
+    {
+        HashMap<V> map;
+        bench_map(
+            "HashMap", Bytes, map, keys, absent,
+            [](HashMap<V> &m, uint64_t key) { m.insert(key, V::make(key, 0)); },
+            [](HashMap<V> &m, uint64_t key) -> uint64_t {
+                const V *value = m.find(key);
+                return value ? value->word[0] : 0;
+            },
+            [](HashMap<V> &m, uint64_t key) { m.erase(key); });
+    }
+    {
+        std::unordered_map<uint64_t, V> map;
+        bench_map(
+            "std::unordered_map", Bytes, map, keys, absent,
+            [](std::unordered_map<uint64_t, V> &m, uint64_t key) { m[key] = V::make(key, 0); },
+            [](std::unordered_map<uint64_t, V> &m, uint64_t key) -> uint64_t {
+                auto it = m.find(key);
+                return it != m.end() ? it->second.word[0] : 0;
+            },
+            [](std::unordered_map<uint64_t, V> &m, uint64_t key) { m.erase(key); });
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc > 1 && !strcmp(argv[1], "--bench"))
+    {
+        long n = argc > 2 ? strtol(argv[2], NULL, 10) : 1000000;
+        if (argc > 3 || n <= 0)
+        {
+            std::cerr << "Usage: " << argv[0] << " --bench [KEYS]\n";
+            return EXIT_FAILURE;
+        }
+        std::vector<uint64_t> keys(n), absent(n);
+        for (long i = 0; i < n; ++i)
+        {
+            keys[i] = prng_at(1, i);
+            absent[i] = prng_at(2, i);
+        }
+        std::cout << "map                  value   insert      hit     miss    erase (ns/op)" << std::endl;
+        bench<8>(keys, absent);
+        bench<16>(keys, absent);
+        bench<32>(keys, absent);
+        return EXIT_SUCCESS;
+    }
+
+    unsigned seed;
+    if (argc == 2)
+    {
+        seed = strtoul(argv[1], NULL, 10);
+    }
+    else
+    {
+        int fd = open("/dev/urandom", O_RDONLY);
+        assert(fd >= 0);
+        ssize_t r = read(fd, &seed, sizeof seed);
+        assert(r == sizeof seed);
+        close(fd);
+    }
+    std::cout << "hashmap: seed " << seed << std::endl;
+    prng_seed(seed);
+
+    /* Few keys, so that keys are often present; then many, so that the
+     * table grows through several rehashes. */
+    stress<8>(1000000, 100);
+    stress<16>(1000000, 100);
+    stress<32>(1000000, 100);
+    stress<8>(1000000, 50000);
+    stress<32>(1000000, 50000);
+    return EXIT_SUCCESS;
+}
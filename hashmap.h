@@ -0,0 +1,251 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/* Open addressing hash map from uint64_t keys to small inline values.
+ *
+ * Unlike the set in hashtable.c, no key value is reserved: whether a slot is
+ * empty, deleted or full is kept in a separate array of control bytes, one
+ * per slot, which for a full slot also holds 7 bits of the key's hash. The
+ * slots are probed in groups of 16 whose control bytes are compared with the
+ * wanted hash bits at once (with SSE2 where available), so a lookup usually
+ * reads one 16-byte group of control bytes and a single key. Keys and values
+ * are in two further arrays, so a lookup that misses never touches the values
+ * and one that hits touches exactly one.
+ *
+ * The groups are probed quadratically and a lookup stops at the first group
+ * with an empty slot. Erasing marks the slot deleted, and deleted slots count
+ * towards the 7/8 load factor at which the table is rehashed, growing it if
+ * more than half the load is live.
+ *
+ * Values should be trivially copyable and a few words at most, such as the 8
+ * to 32-byte values of hashmap.cpp; larger values are better held by pointer.
+ * C++11. */
+
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <type_traits>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+template <typename V>
+class HashMap
+{
+    static_assert(std::is_trivially_copyable<V>::value, "HashMap values are copied as bytes");
+
+public:
+    explicit HashMap(size_t capacity = 0)
+    {
+        size_t slots = group_size;
+        while (slots * 7 / 8 < capacity)
+        {
+            slots *= 2;
+        }
+        reset(slots);
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    /* Return the value of <key>, or NULL if it is absent. The pointer is
+     * valid until the next insert(). */
+    V *find(uint64_t key)
+    {
+        size_t i = locate(key, hash(key));
+        return i == npos ? NULL : &values[i];
+    }
+
+    const V *find(uint64_t key) const
+    {
+        return const_cast<HashMap *>(this)->find(key);
+    }
+
+    bool contains(uint64_t key) const
+    {
+        return find(key) != NULL;
+    }
+
+    /* Set the value of <key>. Returns true if the key was added, false if it
+     * was present and its value replaced. */
+    bool insert(uint64_t key, const V &value)
+    {
+        uint64_t h = hash(key);
+        size_t i = locate(key, h);
+        if (i != npos)
+        {
+            values[i] = value;
+            return false;
+        }
+        if ((count + deleted + 1) * 8 > slots() * 7)
+        {
+            rehash(count * 2 >= slots() * 7 / 8 ? slots() * 2 : slots());
+        }
+        i = free_slot(h);
+        deleted -= ctrl[i] == ctrl_deleted;
+        ctrl[i] = tag(h);
+        keys[i] = key;
+        values[i] = value;
+        ++count;
+        return true;
+    }
+
+    /* Remove <key>. Returns true if it was present. */
+    bool erase(uint64_t key)
+    {
+        size_t i = locate(key, hash(key));
+        if (i == npos)
+        {
+            return false;
+        }
+        ctrl[i] = ctrl_deleted;
+        --count;
+        ++deleted;
+        return true;
+    }
+
+    /* Call f(key, value) for every entry, in no particular order. */
+    template <typename F>
+    void for_each(F f) const
+    {
+        for (size_t i = 0; i < ctrl.size(); ++i)
+        {
+            if (ctrl[i] >= 0)
+            {
+                f(keys[i], values[i]);
+            }
+        }
+    }
+
+private:
+    static const size_t group_size = 16;
+    static const size_t npos = ~(size_t)0;
+    static const int8_t ctrl_empty = -128;
+    static const int8_t ctrl_deleted = -2;
+
+    /* Mix all the key's bits into the low bits that pick a group and the top
+     * bits that make the tag; the finalizer of MurmurHash3. */
+    static uint64_t hash(uint64_t key)
+    {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdull;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ull;
+        return key ^ (key >> 33);
+    }
+
+    static int8_t tag(uint64_t h)
+    {
+        return (int8_t)(h >> 57);
+    }
+
+    size_t slots() const
+    {
+        return ctrl.size();
+    }
+
+    /* Bit i is set if control byte i of the group at <g> equals <c>. */
+    static uint32_t match(const int8_t *g, int8_t c)
+    {
+#ifdef __SSE2__
+        __m128i bytes = _mm_loadu_si128((const __m128i *)g);
+        return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)));
+#else
+        uint32_t bits = 0;
+        for (size_t i = 0; i < group_size; ++i)
+        {
+            bits |= (uint32_t)(g[i] == c) << i;
+        }
+        return bits;
+#endif
+    }
+
+    /* Return the slot holding <key>, whose hash is <h>, or npos. */
+    size_t locate(uint64_t key, uint64_t h) const
+    {
+        size_t mask = slots() / group_size - 1;
+        size_t g = h & mask;
+        for (size_t step = 1;; ++step)
+        {
+            const int8_t *group = &ctrl[g * group_size];
+            for (uint32_t bits = match(group, tag(h)); bits; bits &= bits - 1)
+            {
+                size_t i = g * group_size + __builtin_ctz(bits);
+                if (keys[i] == key)
+                {
+                    return i;
+                }
+            }
+            if (match(group, ctrl_empty) || step > mask)
+            {
+                return npos;
+            }
+            g = (g + step) & mask; /* Triangular steps visit every group. */
+        }
+    }
+
+    /* Return the first empty or deleted slot on the probe path of hash <h>.
+     * There is one, since the load factor is below 1. */
+    size_t free_slot(uint64_t h) const
+    {
+        size_t mask = slots() / group_size - 1;
+        size_t g = h & mask;
+        for (size_t step = 1;; ++step)
+        {
+            const int8_t *group = &ctrl[g * group_size];
+            uint32_t bits = match(group, ctrl_empty) | match(group, ctrl_deleted);
+            if (bits)
+            {
+                return g * group_size + __builtin_ctz(bits);
+            }
+            g = (g + step) & mask;
+        }
+    }
+
+    void reset(size_t n)
+    {
+        ctrl.assign(n, int8_t(ctrl_empty));
+        keys.assign(n, 0);
+        values.assign(n, V());
+        count = 0;
+        deleted = 0;
+    }
+
+    void rehash(size_t n)
+    {
+        std::vector<int8_t> old_ctrl;
+        std::vector<uint64_t> old_keys;
+        std::vector<V> old_values;
+        old_ctrl.swap(ctrl);
+        old_keys.swap(keys);
+        old_values.swap(values);
+        reset(n);
+        for (size_t i = 0; i < old_ctrl.size(); ++i)
+        {
+            if (old_ctrl[i] >= 0)
+            {
+                uint64_t h = hash(old_keys[i]);
+                size_t j = free_slot(h);
+                ctrl[j] = tag(h);
+                keys[j] = old_keys[i];
+                values[j] = old_values[i];
+                ++count;
+            }
+        }
+    }
+
+    std::vector<int8_t> ctrl; /* Per slot: ctrl_empty, ctrl_deleted or the tag. */
+    std::vector<uint64_t> keys;
+    std::vector<V> values;
+    size_t count;   /* Full slots. */
+    size_t deleted; /* Deleted slots. */
+};
+
+#endif
@@ -0,0 +1,117 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/* Log-linear latency histograms in the style of HdrHistogram.
+ *
+ * Values below 2^(HISTOGRAM_SUB_BITS + 1) each have their own bucket. Above
+ * that, every power of two is split into 2^HISTOGRAM_SUB_BITS equal buckets,
+ * so a bucket is never wider than 1/32 of the values in it and percentiles
+ * are within about 3% over the whole 64-bit range, in a fixed 15 KB.
+ * Recording is a few instructions and no allocation, so give each thread its
+ * own histogram and merge them with histogram_merge() at the end.
+ *
+ * Usable from both C and C++. */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+struct histogram
+{
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t counts[HISTOGRAM_BUCKETS];
+};
+
+static inline void
+histogram_init(struct histogram *h)
+{
+    memset(h, 0, sizeof *h);
+    h->min = UINT64_MAX;
+}
+
+/* The bucket of <value>: its top HISTOGRAM_SUB_BITS + 1 significant bits,
+ * plus HISTOGRAM_SUB_BITS buckets per bit shifted out. */
+static inline unsigned
+histogram_bucket(uint64_t value)
+{
+    unsigned bits = 64 - __builtin_clzll(value | 1);
+    unsigned shift = bits > HISTOGRAM_SUB_BITS + 1 ? bits - (HISTOGRAM_SUB_BITS + 1) : 0;
+    return (shift << HISTOGRAM_SUB_BITS) + (unsigned)(value >> shift);
+}
+
+/* The highest value that falls in <bucket>. */
+static inline uint64_t
+histogram_bucket_max(unsigned bucket)
+{
+    unsigned shift = bucket < (2u << HISTOGRAM_SUB_BITS) ? 0 : (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t top = bucket - (shift << HISTOGRAM_SUB_BITS);
+    return ((top + 1) << shift) - 1;
+}
+
+static inline void
+histogram_record(struct histogram *h, uint64_t value)
+{
+    ++h->counts[histogram_bucket(value)];
+    ++h->count;
+    if (value < h->min)
+    {
+        h->min = value;
+    }
+    if (value > h->max)
+    {
+        h->max = value;
+    }
+}
+
+/* Add the values of <src> to <dst>. */
+static inline void
+histogram_merge(struct histogram *dst, const struct histogram *src)
+{
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->count += src->count;
+    if (src->min < dst->min)
+    {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max)
+    {
+        dst->max = src->max;
+    }
+}
+
+/* Return the value below which <percent>% of the values fall, rounded up to
+ * the top of its bucket but never above the largest value recorded, or 0 if
+ * the histogram is empty. */
+static inline uint64_t
+histogram_percentile(const struct histogram *h, double percent)
+{
+    if (h->count == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percent / 100.0 * h->count + 0.5);
+    rank = rank < 1 ? 1 : rank > h->count ? h->count : rank;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    {
+        seen += h->counts[i];
+        if (seen >= rank)
+        {
+            uint64_t value = histogram_bucket_max(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+#endif
@@ -0,0 +1,240 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/* Randomized stress test and benchmark of the adaptive set in hybrid-set.h.
+ *
+ * "hybrid-set [SEED]" adds and removes random keys in two sets, checking
+ * every result against std::unordered_set, and regularly checks their union,
+ * intersection and intersection size. It does so with keys drawn from the
+ * dense range 0..9999 of the hashtable stress test, from 20000 random keys in
+ * the first 2 chunks, and from 20000 random keys over the whole 32-bit range,
+ * first mostly adding, so that chunks become bitmaps, and then mostly
+ * removing, so that they become arrays again.
+ *
+ * "hybrid-set --bench" times the bulk operations on random sets of a range
+ * of densities, against the same operations on std::unordered_set. */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <unordered_set>
+
+#include "hybrid-set.h"
+#include "prng.h"
+
+typedef std::unordered_set<uint32_t> Oracle;
+
+static void
+check_equal(const HybridSet &set, const Oracle &expected)
+{
+    assert(set.size() == expected.size());
+    size_t seen = 0;
+    set.for_each([&](uint32_t key) {
+        assert(expected.count(key));
+        ++seen;
+    });
+    assert(seen == expected.size());
+}
+
+static void
+check_bulk(const HybridSet &a, const HybridSet &b, const Oracle &expected_a, const Oracle &expected_b)
+{
+    Oracle expected_union(expected_a);
+    expected_union.insert(expected_b.begin(), expected_b.end());
+    Oracle expected_intersection;
+    for (uint32_t key : expected_a)
+    {
+        if (expected_b.count(key))
+        {
+            expected_intersection.insert(key);
+        }
+    }
+    check_equal(HybridSet::unite(a, b), expected_union);
+    check_equal(HybridSet::intersect(a, b), expected_intersection);
+    assert(HybridSet::intersection_size(a, b) == expected_intersection.size());
+}
+
+enum keys
+{
+    KEYS_DENSE,
+    KEYS_CLUSTERED,
+    KEYS_WIDE,
+};
+
+static const char *const key_names[] = { "dense", "clustered", "wide" };
+
+static uint32_t
+random_key(enum keys keys)
+{
+    switch (keys)
+    {
+    case KEYS_DENSE:
+        return prng_bounded(10000);
+    case KEYS_CLUSTERED:
+        return (uint32_t)(prng_at(0, prng_bounded(20000)) >> 47);
+    default:
+        return (uint32_t)(prng_at(0, prng_bounded(20000)) >> 32);
+    }
+}
+
+/* Run <operations> random operations, each adding a key with probability
+ * <add_percent>% and otherwise removing one. Returns how many of the sets'
+ * chunks were bitmaps at the end. */
+static size_t
+stress(HybridSet *sets, Oracle *expected, unsigned long operations, unsigned add_percent, enum keys keys)
+{
+    for (unsigned long n = 0; n < operations; ++n)
+    {
+        unsigned s = prng_bounded(2);
+        uint32_t key = random_key(keys);
+        bool present = expected[s].count(key) != 0;
+        assert(sets[s].contains(key) == present);
+        if (prng_bounded(100) < add_percent)
+        {
+            bool added = sets[s].insert(key);
+            assert(added == !present);
+            expected[s].insert(key);
+        }
+        else
+        {
+            bool removed = sets[s].erase(key);
+            assert(removed == present);
+            expected[s].erase(key);
+        }
+        assert(sets[s].size() == expected[s].size());
+
+        if (n % 2048 == 0)
+        {
+            check_equal(sets[0], expected[0]);
+            check_equal(sets[1], expected[1]);
+            check_bulk(sets[0], sets[1], expected[0], expected[1]);
+        }
+    }
+    check_bulk(sets[0], sets[1], expected[0], expected[1]);
+    return sets[0].bitmap_count() + sets[1].bitmap_count();
+}
+
+/* Keeps results alive so they are not optimised away. */
+static volatile size_t g_sink;
+
+template <typename Operation>
+static double
+time_ns(Operation operation)
+{
+    auto start = std::chrono::steady_clock::now();
+    const int repeats = 5;
+    for (int i = 0; i < repeats; ++i)
+    {
+        g_sink = g_sink + operation();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() * 1e9 / repeats;
+}
+
+/* Time the bulk operations on two random sets, each holding 1 in <sparsity>
+ * of the keys in [0, range). */
+static void
+bench(uint32_t range, uint32_t sparsity)
+{
+    HybridSet a, b;
+    Oracle oa, ob;
+    for (uint32_t i = 0; i < range / sparsity; ++i)
+    {
+        uint32_t x = prng_bounded(range), y = prng_bounded(range);
+        a.insert(x);
+        b.insert(y);
+        oa.insert(x);
+        ob.insert(y);
+    }
+
+    double hybrid_union = time_ns([&]() { return HybridSet::unite(a, b).size(); });
+    double hybrid_intersect = time_ns([&]() { return HybridSet::intersect(a, b).size(); });
+    double hybrid_count = time_ns([&]() { return HybridSet::intersection_size(a, b); });
+    double oracle_union = time_ns([&]() {
+        Oracle u(oa);
+        u.insert(ob.begin(), ob.end());
+        return u.size();
+    });
+    double oracle_intersect = time_ns([&]() {
+        Oracle i;
+        for (uint32_t key : oa)
+        {
+            if (ob.count(key))
+            {
+                i.insert(key);
+            }
+        }
+        return i.size();
+    });
+    double oracle_count = time_ns([&]() {
+        size_t n = 0;
+        for (uint32_t key : oa)
+        {
+            n += ob.count(key);
+        }
+        return n;
+    });
+
+    std::cout << "1/" << std::left << std::setw(8) << sparsity << std::right << std::setw(9) << a.size()
+              << std::setw(6) << a.bitmap_count() << "/" << std::left << std::setw(6) << a.chunk_count() << std::right
+              << std::fixed << std::setprecision(0) << std::setw(12) << hybrid_union / 1000 << std::setw(10)
+              << oracle_union / 1000 << std::setw(12) << hybrid_intersect / 1000 << std::setw(10)
+              << oracle_intersect / 1000 << std::setw(12) << hybrid_count / 1000 << std::setw(10)
+              << oracle_count / 1000 << std::endl;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc > 1 && !strcmp(argv[1], "--bench"))
+    {
+        if (argc > 2)
+        {
+            std::cerr << "Usage: " << argv[0] << " --bench\n";
+            return EXIT_FAILURE;
+        }
+        const uint32_t range = 1 << 24;
+        std::cout << "Two random sets of keys in [0, 2^24); times in us, hybrid set vs std::unordered_set\n"
+                  << "density        keys  bitmap/chunks    union           intersect      intersection size"
+                  << std::endl;
+        for (uint32_t sparsity = 2; sparsity <= 65536; sparsity *= 8)
+        {
+            bench(range, sparsity);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    unsigned seed;
+    if (argc == 2)
+    {
+        seed = strtoul(argv[1], NULL, 10);
+    }
+    else
+    {
+        int fd = open("/dev/urandom", O_RDONLY);
+        assert(fd >= 0);
+        ssize_t r = read(fd, &seed, sizeof seed);
+        assert(r == sizeof seed);
+        close(fd);
+    }
+    std::cout << "hybrid-set: seed " << seed << std::endl;
+    prng_seed(seed);
+
+    for (int keys = KEYS_DENSE; keys <= KEYS_WIDE; ++keys)
+    {
+        HybridSet sets[2];
+        Oracle expected[2];
+        size_t grown = stress(sets, expected, 60000, 80, (enum keys)keys);
+        size_t shrunk = stress(sets, expected, 150000, 2, (enum keys)keys);
+        std::cout << "hybrid-set: " << key_names[keys] << " keys OK; bitmap chunks " << grown << " after adding, "
+                  << shrunk << " after removing" << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,508 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/* Set of uint32_t that adapts its representation to the density of its keys.
+ *
+ * Like a roaring bitmap, the key range is cut into chunks of 2^16 keys by the
+ * keys' top 16 bits, and each chunk present holds the bottom 16 bits in one
+ * of two containers:
+ *
+ *   array   A sorted array of uint16_t, for chunks with up to
+ *           HybridSet::to_bitmap keys, where it is no larger than a bitmap.
+ *           Lookups are binary searches and the bulk operations are merges.
+ *   bitmap  1024 words with one bit per key: 8 KB whatever the count, but
+ *           every operation is a bit test and the bulk operations are
+ *           word-wise loops that the compiler vectorizes.
+ *
+ * An array chunk that grows past to_bitmap keys becomes a bitmap, and a
+ * bitmap that shrinks below to_array goes back, the gap between them
+ * keeping a chunk from flipping to and fro. unite(), intersect() and
+ * intersection_size() work chunk by chunk on whichever pair of containers
+ * they meet; their bitmap loops count bits with the POPCNT instruction where
+ * the CPU has it.
+ *
+ * C++11; build with optimisation for the bitmap loops to be vectorized. */
+
+#ifndef HYBRID_SET_H
+#define HYBRID_SET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HYBRID_SET_X86 1
+#endif
+
+/* Bit counts of a[0..n) and of a[i] & b[i] over i in [0, n), with and
+ * without POPCNT. */
+#define HYBRID_SET_POPCOUNT_FNS(suffix, attributes)                                                           \
+    static attributes size_t hybrid_popcount_##suffix(const uint64_t *a, size_t n)                             \
+    {                                                                                                          \
+        size_t count = 0;                                                                                      \
+        for (size_t i = 0; i < n; ++i)                                                                         \
+        {                                                                                                      \
+            count += __builtin_popcountll(a[i]);                                                               \
+        }                                                                                                      \
+        return count;                                                                                          \
+    }                                                                                                          \
+    static attributes size_t hybrid_popcount_and_##suffix(const uint64_t *a, const uint64_t *b, size_t n)      \
+    {                                                                                                          \
+        size_t count = 0;                                                                                      \
+        for (size_t i = 0; i < n; ++i)                                                                         \
+        {                                                                                                      \
+            count += __builtin_popcountll(a[i] & b[i]);                                                        \
+        }                                                                                                      \
+        return count;                                                                                          \
+    }
+
+HYBRID_SET_POPCOUNT_FNS(generic, )
+#ifdef HYBRID_SET_X86
+HYBRID_SET_POPCOUNT_FNS(popcnt, __attribute__((target("popcnt"))))
+#endif
+
+static inline bool
+hybrid_set_has_popcnt()
+{
+#ifdef HYBRID_SET_X86
+    static const bool has = __builtin_cpu_supports("popcnt");
+    return has;
+#else
+    return false;
+#endif
+}
+
+static inline size_t
+hybrid_popcount(const uint64_t *a, size_t n)
+{
+#ifdef HYBRID_SET_X86
+    if (hybrid_set_has_popcnt())
+    {
+        return hybrid_popcount_popcnt(a, n);
+    }
+#endif
+    return hybrid_popcount_generic(a, n);
+}
+
+static inline size_t
+hybrid_popcount_and(const uint64_t *a, const uint64_t *b, size_t n)
+{
+#ifdef HYBRID_SET_X86
+    if (hybrid_set_has_popcnt())
+    {
+        return hybrid_popcount_and_popcnt(a, b, n);
+    }
+#endif
+    return hybrid_popcount_and_generic(a, b, n);
+}
+
+class HybridSet
+{
+public:
+    /* An array chunk with more keys than this becomes a bitmap: at 4096
+     * keys of 2 bytes the array is as large as the bitmap. */
+    static const size_t to_bitmap = 4096;
+
+    /* A bitmap chunk with fewer keys than this becomes an array. */
+    static const size_t to_array = 2048;
+
+    HybridSet() : total(0)
+    {
+    }
+
+    size_t size() const
+    {
+        return total;
+    }
+
+    /* Chunks present, and how many of them are bitmaps. */
+    size_t chunk_count() const
+    {
+        return chunks.size();
+    }
+
+    size_t bitmap_count() const
+    {
+        size_t n = 0;
+        for (const Chunk &chunk : chunks)
+        {
+            n += chunk.is_bitmap();
+        }
+        return n;
+    }
+
+    bool contains(uint32_t key) const
+    {
+        auto it = find_chunk(key >> 16);
+        return it != chunks.end() && it->high == key >> 16 && it->contains(key & 0xffff);
+    }
+
+    /* Add <key>. Returns true if it was absent. */
+    bool insert(uint32_t key)
+    {
+        auto it = find_chunk(key >> 16);
+        if (it == chunks.end() || it->high != key >> 16)
+        {
+            it = chunks.insert(it, Chunk(key >> 16));
+        }
+        if (!it->insert(key & 0xffff))
+        {
+            return false;
+        }
+        ++total;
+        return true;
+    }
+
+    /* Remove <key>. Returns true if it was present. */
+    bool erase(uint32_t key)
+    {
+        auto it = find_chunk(key >> 16);
+        if (it == chunks.end() || it->high != key >> 16 || !it->erase(key & 0xffff))
+        {
+            return false;
+        }
+        --total;
+        if (it->count == 0)
+        {
+            chunks.erase(it);
+        }
+        return true;
+    }
+
+    /* Call f(key) for every key in ascending order. */
+    template <typename F>
+    void for_each(F f) const
+    {
+        for (const Chunk &chunk : chunks)
+        {
+            chunk.for_each([&](uint32_t low) { f(chunk.high << 16 | low); });
+        }
+    }
+
+    /* Return the union of <a> and <b>. */
+    static HybridSet unite(const HybridSet &a, const HybridSet &b)
+    {
+        HybridSet result;
+        auto i = a.chunks.begin(), j = b.chunks.begin();
+        while (i != a.chunks.end() || j != b.chunks.end())
+        {
+            if (j == b.chunks.end() || (i != a.chunks.end() && i->high < j->high))
+            {
+                result.add_chunk(*i++);
+            }
+            else if (i == a.chunks.end() || j->high < i->high)
+            {
+                result.add_chunk(*j++);
+            }
+            else
+            {
+                result.add_chunk(Chunk::unite(*i++, *j++));
+            }
+        }
+        return result;
+    }
+
+    /* Return the intersection of <a> and <b>. */
+    static HybridSet intersect(const HybridSet &a, const HybridSet &b)
+    {
+        HybridSet result;
+        for_common_chunks(a, b, [&](const Chunk &x, const Chunk &y) {
+            Chunk chunk = Chunk::intersect(x, y);
+            if (chunk.count)
+            {
+                result.add_chunk(std::move(chunk));
+            }
+        });
+        return result;
+    }
+
+    /* Return the size of the intersection of <a> and <b> without building
+     * it. */
+    static size_t intersection_size(const HybridSet &a, const HybridSet &b)
+    {
+        size_t n = 0;
+        for_common_chunks(a, b, [&](const Chunk &x, const Chunk &y) { n += Chunk::intersection_size(x, y); });
+        return n;
+    }
+
+private:
+    static const size_t bitmap_words = (1 << 16) / 64;
+
+    /* The keys whose top 16 bits are <high>, in a bitmap if <bits> is not
+     * empty and otherwise in <array>. */
+    struct Chunk
+    {
+        explicit Chunk(uint32_t high) : high(high), count(0)
+        {
+        }
+
+        uint32_t high;
+        size_t count;
+        std::vector<uint64_t> bits;
+        std::vector<uint16_t> array; /* Sorted. */
+
+        bool is_bitmap() const
+        {
+            return !bits.empty();
+        }
+
+        bool contains(uint32_t low) const
+        {
+            return is_bitmap() ? bits[low / 64] >> (low % 64) & 1
+                               : std::binary_search(array.begin(), array.end(), (uint16_t)low);
+        }
+
+        bool insert(uint32_t low)
+        {
+            if (is_bitmap())
+            {
+                uint64_t bit = (uint64_t)1 << (low % 64);
+                if (bits[low / 64] & bit)
+                {
+                    return false;
+                }
+                bits[low / 64] |= bit;
+            }
+            else
+            {
+                auto it = std::lower_bound(array.begin(), array.end(), (uint16_t)low);
+                if (it != array.end() && *it == low)
+                {
+                    return false;
+                }
+                array.insert(it, (uint16_t)low);
+            }
+            ++count;
+            fit();
+            return true;
+        }
+
+        bool erase(uint32_t low)
+        {
+            if (is_bitmap())
+            {
+                uint64_t bit = (uint64_t)1 << (low % 64);
+                if (!(bits[low / 64] & bit))
+                {
+                    return false;
+                }
+                bits[low / 64] &= ~bit;
+            }
+            else
+            {
+                auto it = std::lower_bound(array.begin(), array.end(), (uint16_t)low);
+                if (it == array.end() || *it != low)
+                {
+                    return false;
+                }
+                array.erase(it);
+            }
+            --count;
+            fit();
+            return true;
+        }
+
+        /* Call f(low) for every key in ascending order. */
+        template <typename F>
+        void for_each(F f) const
+        {
+            if (!is_bitmap())
+            {
+                for (uint16_t low : array)
+                {
+                    f((uint32_t)low);
+                }
+                return;
+            }
+            for (size_t w = 0; w < bitmap_words; ++w)
+            {
+                for (uint64_t word = bits[w]; word; word &= word - 1)
+                {
+                    f((uint32_t)(w * 64 + __builtin_ctzll(word)));
+                }
+            }
+        }
+
+        /* Switch container if the count has crossed a threshold. */
+        void fit()
+        {
+            if (!is_bitmap() && count > to_bitmap)
+            {
+                bits.assign(bitmap_words, 0);
+                for (uint16_t low : array)
+                {
+                    bits[low / 64] |= (uint64_t)1 << (low % 64);
+                }
+                std::vector<uint16_t>().swap(array);
+            }
+            else if (is_bitmap() && count < to_array)
+            {
+                std::vector<uint16_t> keys;
+                keys.reserve(count);
+                for_each([&](uint32_t low) { keys.push_back((uint16_t)low); });
+                array.swap(keys);
+                std::vector<uint64_t>().swap(bits);
+            }
+        }
+
+        static Chunk unite(const Chunk &x, const Chunk &y)
+        {
+            Chunk result(x.high);
+            if (x.is_bitmap() && y.is_bitmap())
+            {
+                result.bits.resize(bitmap_words);
+                for (size_t w = 0; w < bitmap_words; ++w)
+                {
+                    result.bits[w] = x.bits[w] | y.bits[w];
+                }
+                result.count = hybrid_popcount(result.bits.data(), bitmap_words);
+                return result;
+            }
+            if (!x.is_bitmap() && !y.is_bitmap())
+            {
+                result.array.reserve(x.count + y.count);
+                std::set_union(x.array.begin(), x.array.end(), y.array.begin(), y.array.end(),
+                               std::back_inserter(result.array));
+                result.count = result.array.size();
+                result.fit();
+                return result;
+            }
+            /* Set the array's bits in a copy of the bitmap. */
+            const Chunk &array = x.is_bitmap() ? y : x;
+            result = x.is_bitmap() ? x : y;
+            for (uint16_t low : array.array)
+            {
+                uint64_t bit = (uint64_t)1 << (low % 64);
+                result.count += !(result.bits[low / 64] & bit);
+                result.bits[low / 64] |= bit;
+            }
+            return result;
+        }
+
+        static Chunk intersect(const Chunk &x, const Chunk &y)
+        {
+            Chunk result(x.high);
+            if (x.is_bitmap() && y.is_bitmap())
+            {
+                result.bits.resize(bitmap_words);
+                for (size_t w = 0; w < bitmap_words; ++w)
+                {
+                    result.bits[w] = x.bits[w] & y.bits[w];
+                }
+                result.count = hybrid_popcount(result.bits.data(), bitmap_words);
+                result.fit();
+                return result;
+            }
+            if (!x.is_bitmap() && !y.is_bitmap())
+            {
+                result.array.reserve(std::min(x.count, y.count));
+                std::set_intersection(x.array.begin(), x.array.end(), y.array.begin(), y.array.end(),
+                                      std::back_inserter(result.array));
+            }
+            else
+            {
+                /* Keep the keys of the array that are set in the bitmap. */
+                const Chunk &array = x.is_bitmap() ? y : x;
+                const Chunk &bitmap = x.is_bitmap() ? x : y;
+                result.array.reserve(array.count);
+                for (uint16_t low : array.array)
+                {
+                    if (bitmap.bits[low / 64] >> (low % 64) & 1)
+                    {
+                        result.array.push_back(low);
+                    }
+                }
+            }
+            result.count = result.array.size();
+            return result;
+        }
+
+        static size_t intersection_size(const Chunk &x, const Chunk &y)
+        {
+            if (x.is_bitmap() && y.is_bitmap())
+            {
+                return hybrid_popcount_and(x.bits.data(), y.bits.data(), bitmap_words);
+            }
+            size_t n = 0;
+            if (!x.is_bitmap() && !y.is_bitmap())
+            {
+                auto i = x.array.begin(), j = y.array.begin();
+                while (i != x.array.end() && j != y.array.end())
+                {
+                    if (*i < *j)
+                    {
+                        ++i;
+                    }
+                    else if (*j < *i)
+                    {
+                        ++j;
+                    }
+                    else
+                    {
+                        ++n;
+                        ++i;
+                        ++j;
+                    }
+                }
+                return n;
+            }
+            const Chunk &array = x.is_bitmap() ? y : x;
+            const Chunk &bitmap = x.is_bitmap() ? x : y;
+            for (uint16_t low : array.array)
+            {
+                n += bitmap.bits[low / 64] >> (low % 64) & 1;
+            }
+            return n;
+        }
+    };
+
+    std::vector<Chunk>::const_iterator find_chunk(uint32_t high) const
+    {
+        return std::lower_bound(chunks.begin(), chunks.end(), high,
+                                [](const Chunk &chunk, uint32_t h) { return chunk.high < h; });
+    }
+
+    std::vector<Chunk>::iterator find_chunk(uint32_t high)
+    {
+        return std::lower_bound(chunks.begin(), chunks.end(), high,
+                                [](const Chunk &chunk, uint32_t h) { return chunk.high < h; });
+    }
+
+    /* Append <chunk>, whose keys are all above those of the set. */
+    void add_chunk(Chunk chunk)
+    {
+        total += chunk.count;
+        chunks.push_back(std::move(chunk));
+    }
+
+    /* Call f(x, y) for each pair of chunks of <a> and <b> with the same top
+     * bits. */
+    template <typename F>
+    static void for_common_chunks(const HybridSet &a, const HybridSet &b, F f)
+    {
+        auto i = a.chunks.begin(), j = b.chunks.begin();
+        while (i != a.chunks.end() && j != b.chunks.end())
+        {
+            if (i->high < j->high)
+            {
+                ++i;
+            }
+            else if (j->high < i->high)
+            {
+                ++j;
+            }
+            else
+            {
+                f(*i++, *j++);
+            }
+        }
+    }
+
+    std::vector<Chunk> chunks; /* Sorted by high; none is empty. */
+    size_t total;
+};
+
+#endif
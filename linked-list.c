@@ -2,151 +2,540 @@
  * Refer to LICENSE.txt in this directory. */
 
 /**
- * \brief The worst linked list in the world
+ * \brief A work-stealing runtime for passing blocks of data between threads
  *
- * An example of a thread-unsafe linked list being used to pass
- * blocks of data between threads. Because the threads spend most
- * of their time doing computation (vs manipulating the linked list)
- * this example only fails rarely when run natively.
+ * Each worker thread owns a Chase-Lev deque. Producers push new tasks onto
+ * the bottom of their own deque and pop from it LIFO; workers which run out
+ * of local work steal FIFO from the top of another worker's deque. Idle
+ * workers spin with exponential backoff and then park on a futex, so an
+ * empty runtime does not burn a core.
+ *
+ * The program runs the same workload with 1..N workers and reports tasks/sec
+ * and the number of successful steals for each worker count.
+ *
+ * THREAD_PLACEMENT pins worker i to the ith CPU of a placement policy; see
+ * topology.h. Each worker allocates its own deque and tasks after pinning,
+ * so that they are on its node.
  */
 
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
 #include <time.h>
+#include <unistd.h>
+
+#include "topology.h"
 
 /**
- * \brief Trivial singly linked list structure
+ * \brief A block of data passed between threads
  */
-struct list
+struct task
 {
-    struct list *next;
     void *data;
 };
 
-typedef struct list list_t;
-
-static list_t list_head;
+typedef struct task task_t;
 
 static int iterations = 0;
 
 /**
- * \brief Buggy function to push to head of a list
+ * \brief Consume CPU cycles / run up the bbcount
  *
- * This function is subject to a race where `list_head.next`
- * can be updated between when it is read and when it is updated.
+ * Every task costs one call of this function to produce and one to consume,
+ * so `iterations` controls the size of a task.
  */
 static void
-s_push(list_t *item)
+s_compute_junk(void)
 {
-    /* Pairs with assignment to list_head.next */
-    list_t *tmp = __atomic_load_n(&list_head.next, __ATOMIC_ACQUIRE);
-    /* Thread switch here is bad */
-    item->next = tmp;
-    /* Thread switch here is bad */
-    __atomic_store_n(&list_head.next, item, __ATOMIC_RELEASE);
+    long p = 0;
+    unsigned long q = 0;
+    const int i = iterations;
+    for (; p < i; ++p)
+    {
+        __atomic_fetch_add(&q, p, __ATOMIC_RELAXED);
+    }
 }
 
 /**
- * \brief Buggy function to pop from the head of a list
+ * \brief Circular array backing a deque
  *
- * Similar to the pop function, the `list_head.next` may be updated
- * after `item` has been read.
+ * Arrays are only ever replaced by larger ones. A thief may still be reading
+ * from an old array, so replaced arrays are kept on a retired list until the
+ * deque is destroyed.
  */
-static void *
-s_pop(void)
+struct ring
+{
+    long mask;
+    struct ring *retired;
+    task_t *slot[];
+};
+
+/**
+ * \brief Chase-Lev work-stealing deque
+ *
+ * Only the owning thread calls s_deque_push() and s_deque_take(); any thread
+ * may call s_deque_steal(). `top` and `bottom` live on separate cache lines
+ * as they are written by different threads.
+ */
+struct deque
+{
+    long top __attribute__((aligned(64)));
+    long bottom __attribute__((aligned(64)));
+    struct ring *ring;
+};
+
+/* Returned by s_deque_steal() when it loses a race with another thread. */
+#define STEAL_ABORT ((task_t *)-1)
+
+/* A producer only runs its own tasks once this many are queued (or its quota
+ * is used up), so that there is something left on the deque to steal. */
+#define PRODUCE_BATCH 256
+
+static struct ring *
+s_ring_new(long size)
+{
+    struct ring *ring = malloc(sizeof *ring + size * sizeof ring->slot[0]);
+    if (!ring)
+    {
+        fprintf(stderr, "Out of memory allocating deque of %ld slots\n", size);
+        abort();
+    }
+    ring->mask = size - 1;
+    ring->retired = NULL;
+    return ring;
+}
+
+static void
+s_deque_init(struct deque *dq)
+{
+    dq->top = 0;
+    dq->bottom = 0;
+    dq->ring = s_ring_new(256);
+}
+
+static void
+s_deque_destroy(struct deque *dq)
+{
+    struct ring *ring = dq->ring;
+    while (ring)
+    {
+        struct ring *next = ring->retired;
+        free(ring);
+        ring = next;
+    }
+}
+
+/**
+ * \brief Double the size of the deque's array, copying live entries
+ */
+static struct ring *
+s_deque_grow(struct deque *dq, struct ring *old, long top, long bottom)
+{
+    struct ring *ring = s_ring_new(2 * (old->mask + 1));
+    for (long i = top; i < bottom; ++i)
+    {
+        ring->slot[i & ring->mask] = __atomic_load_n(&old->slot[i & old->mask], __ATOMIC_RELAXED);
+    }
+    ring->retired = old;
+    /* Pairs with the acquire load of dq->ring in s_deque_steal(). */
+    __atomic_store_n(&dq->ring, ring, __ATOMIC_RELEASE);
+    return ring;
+}
+
+/**
+ * \brief Push a task onto the bottom of the owner's deque
+ */
+static void
+s_deque_push(struct deque *dq, task_t *task)
+{
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    struct ring *ring = __atomic_load_n(&dq->ring, __ATOMIC_RELAXED);
+    if (b - t > ring->mask)
+    {
+        ring = s_deque_grow(dq, ring, t, b);
+    }
+    __atomic_store_n(&ring->slot[b & ring->mask], task, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief Pop a task from the bottom of the owner's deque, or NULL if empty
+ */
+static task_t *
+s_deque_take(struct deque *dq)
 {
-    /* Pairs with the assignment to list_head.next */
-    list_t *item = __atomic_load_n(&list_head.next, __ATOMIC_ACQUIRE);
-    /* Thread switch here is bad */
-    if (!item)
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) - 1;
+    struct ring *ring = __atomic_load_n(&dq->ring, __ATOMIC_RELAXED);
+    __atomic_store_n(&dq->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+
+    if (t > b)
     {
+        /* Deque was already empty. */
+        __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
         return NULL;
     }
-    /* Thread switch here is bad */
-    __atomic_store_n(&list_head.next, item->next, __ATOMIC_RELEASE);
-    return item;
+
+    task_t *task = __atomic_load_n(&ring->slot[b & ring->mask], __ATOMIC_RELAXED);
+    if (t == b)
+    {
+        /* Last element: race against thieves for it. */
+        if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            task = NULL;
+        }
+        __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return task;
 }
 
 /**
- * \brief Consume CPU cycles / run up the bbcount
+ * \brief Number of tasks on the owner's deque, as seen by the owner
+ */
+static long
+s_deque_depth(struct deque *dq)
+{
+    return __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) -
+           __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * \brief Steal a task from the top of another thread's deque
  *
- * We use a busy function to simulate an application where threads mostly
- * do work independently and only rarely synchronise. If the compute time
- * is variable enough (and in practice it often is) then only one thread at
- * a time runs the synchronisation routine, meaning it can have race conditions
- * which go unnoticed (or are very hard to reproduce).
+ * Returns NULL if the deque is empty or STEAL_ABORT if another thread won
+ * the race for the top element.
+ */
+static task_t *
+s_deque_steal(struct deque *dq)
+{
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+    {
+        return NULL;
+    }
+    struct ring *ring = __atomic_load_n(&dq->ring, __ATOMIC_ACQUIRE);
+    task_t *task = __atomic_load_n(&ring->slot[t & ring->mask], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+        return STEAL_ABORT;
+    }
+    return task;
+}
+
+/**
+ * \brief Per-thread state of the runtime
  */
+struct worker
+{
+    struct deque deque;
+    pthread_t thread;
+    unsigned id;
+    unsigned seed;        /* Victim selection. */
+    unsigned long quota;  /* Tasks still to be produced by this worker. */
+    unsigned long steals; /* Successful steals. */
+    unsigned long parks;  /* Times this worker slept on the futex. */
+} __attribute__((aligned(64)));
+
+static struct worker *g_workers;
+static unsigned g_nworkers;
+
+/* Holds the workers back until every deque has been allocated. */
+static pthread_barrier_t g_start;
+
+/* Tasks completed so far and in total; the run ends when they match. */
+static unsigned long g_completed;
+static unsigned long g_total;
+
+/* Idle workers sleep on g_park_seq, which is bumped whenever new work or
+ * termination is published. g_sleepers lets producers skip the wake-up
+ * syscall when nobody is parked. */
+static int g_park_seq;
+static int g_sleepers;
+
 static void
-s_compute_junk(void)
+s_cpu_relax(void)
 {
-    long p = 0;
-    unsigned long q = 0;
-    const int i = iterations;
-    for (; p < i; ++p)
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static void
+s_futex_wait(int *addr, int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void
+s_futex_wake(int *addr, int n)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/**
+ * \brief Publish new work (or termination) to parked workers
+ */
+static void
+s_notify(int n)
+{
+    __atomic_fetch_add(&g_park_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&g_sleepers, __ATOMIC_SEQ_CST))
     {
-        __atomic_fetch_add(&q, p, __ATOMIC_RELAXED);
+        s_futex_wake(&g_park_seq, n);
     }
 }
 
+static bool
+s_done(void)
+{
+    return __atomic_load_n(&g_completed, __ATOMIC_ACQUIRE) == g_total;
+}
+
 /**
- * \brief Push items onto list between lots of computation
+ * \brief Try to steal one task from any other worker
+ *
+ * Victims are visited starting at a random worker so that thieves spread out
+ * rather than all hammering worker 0.
  */
-static void *
-s_producer(void *arg __attribute__((unused)))
+static task_t *
+s_try_steal(struct worker *self)
 {
-    while (true)
+    if (g_nworkers < 2)
+    {
+        return NULL;
+    }
+    unsigned start = rand_r(&self->seed) % g_nworkers;
+    for (unsigned i = 0; i < g_nworkers; ++i)
     {
-        /* Allocate a block of data and submit it to the list */
-        list_t *item = malloc(sizeof *item);
-        s_push(item);
-        for (int i = 0; i < 10; ++i)
+        struct worker *victim = &g_workers[(start + i) % g_nworkers];
+        if (victim == self)
         {
-            s_compute_junk();
+            continue;
+        }
+        task_t *task;
+        do
+        {
+            task = s_deque_steal(&victim->deque);
+        } while (task == STEAL_ABORT);
+        if (task)
+        {
+            ++self->steals;
+            return task;
         }
     }
     return NULL;
 }
 
 /**
- * \brief Pop items from list between doing lots of computation
+ * \brief Wait for work to appear: spin, then yield, then sleep on the futex
+ */
+static task_t *
+s_idle(struct worker *self)
+{
+    for (unsigned round = 0;; ++round)
+    {
+        int seq = __atomic_load_n(&g_park_seq, __ATOMIC_SEQ_CST);
+        task_t *task = s_try_steal(self);
+        if (task || s_done())
+        {
+            return task;
+        }
+
+        if (round < 10)
+        {
+            for (unsigned spin = 0; spin < (1u << round); ++spin)
+            {
+                s_cpu_relax();
+            }
+        }
+        else if (round < 20)
+        {
+            sched_yield();
+        }
+        else
+        {
+            /* Advertise that we are about to sleep, then look once more so
+             * that a push which raced with us cannot be missed. */
+            __atomic_fetch_add(&g_sleepers, 1, __ATOMIC_SEQ_CST);
+            task = s_try_steal(self);
+            if (!task && !s_done())
+            {
+                ++self->parks;
+                s_futex_wait(&g_park_seq, seq);
+            }
+            __atomic_fetch_sub(&g_sleepers, 1, __ATOMIC_SEQ_CST);
+            if (task)
+            {
+                return task;
+            }
+            round = 0;
+        }
+    }
+}
+
+/**
+ * \brief Consume a task
+ *
+ * A real application would do some work on the data it got, we just compute
+ * and free it.
+ */
+static void
+s_run(task_t *task)
+{
+    s_compute_junk();
+    free(task);
+    if (__atomic_add_fetch(&g_completed, 1, __ATOMIC_ACQ_REL) == g_total)
+    {
+        s_notify(g_nworkers);
+    }
+}
+
+/**
+ * \brief Worker main loop: produce our quota, run local work, steal when idle
  */
 static void *
-s_consumer(void *arg __attribute__((unused)))
+s_worker(void *arg)
 {
-    while (true)
+    struct worker *self = arg;
+    topology_pin_self(self->id);
+    s_deque_init(&self->deque);
+    pthread_barrier_wait(&g_start);
+    while (!s_done())
     {
-        list_t *item = s_pop();
-        if (!item)
+        if (self->quota)
         {
-            /* We've consumed all we can, spin */
+            /* Allocate a block of data and submit it to our own deque. */
+            task_t *task = malloc(sizeof *task);
+            if (!task)
+            {
+                fprintf(stderr, "Out of memory allocating %zu bytes\n", sizeof *task);
+                abort();
+            }
+            task->data = NULL;
             s_compute_junk();
+            s_deque_push(&self->deque, task);
+            --self->quota;
+            s_notify(1);
         }
-        else
+
+        if (self->quota && s_deque_depth(&self->deque) < PRODUCE_BATCH)
         {
-            /* A real application would do some work on the data it
-             * got from the list, we just free it.
-             */
-            free(item);
+            continue;
+        }
+        task_t *task = s_deque_take(&self->deque);
+        if (!task && !self->quota)
+        {
+            task = s_idle(self);
+        }
+        if (task)
+        {
+            s_run(task);
         }
     }
     return NULL;
 }
 
+static double
+s_now(void)
+{
+    struct timespec ts;
+    int e = clock_gettime(CLOCK_MONOTONIC, &ts);
+    assert(e == 0);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * \brief Run `ntasks` tasks on `nworkers` workers and report throughput
+ *
+ * Only the first half of the workers produce tasks, so the rest of them
+ * have to steal to stay busy.
+ */
+static void
+s_run_workers(unsigned nworkers, unsigned long ntasks)
+{
+    g_nworkers = nworkers;
+    g_total = ntasks;
+    g_completed = 0;
+    g_workers = aligned_alloc(64, nworkers * sizeof *g_workers);
+    assert(g_workers);
+
+    unsigned nproducers = (nworkers + 1) / 2;
+    for (unsigned i = 0; i < nworkers; ++i)
+    {
+        struct worker *w = &g_workers[i];
+        w->id = i;
+        w->seed = i + 1;
+        w->quota = i < nproducers ? ntasks / nproducers : 0;
+        w->steals = 0;
+        w->parks = 0;
+    }
+    g_workers[0].quota += ntasks % nproducers;
+    int e = pthread_barrier_init(&g_start, NULL, nworkers);
+    assert(e == 0);
+    (void)e;
+
+    double start = s_now();
+    for (unsigned i = 0; i < nworkers; ++i)
+    {
+        int r = pthread_create(&g_workers[i].thread, NULL, s_worker, &g_workers[i]);
+        assert(r == 0);
+    }
+    unsigned long steals = 0, parks = 0;
+    for (unsigned i = 0; i < nworkers; ++i)
+    {
+        int r = pthread_join(g_workers[i].thread, NULL);
+        assert(r == 0);
+        steals += g_workers[i].steals;
+        parks += g_workers[i].parks;
+        s_deque_destroy(&g_workers[i].deque);
+    }
+    double elapsed = s_now() - start;
+    pthread_barrier_destroy(&g_start);
+
+    printf("workers=%-3u tasks=%lu time=%.3fs tasks/sec=%.0f steals=%lu parks=%lu\n",
+           nworkers, ntasks, elapsed, ntasks / elapsed, steals, parks);
+    free(g_workers);
+}
+
 int
 main(int argc, char **argv)
 {
-    if (argc != 2)
+    if (argc < 2 || argc > 4)
     {
         /* On a typical thinkpad 10000 is a good default value */
-        fprintf(stderr, "use: %s iterations (10000 is a good value to try)\n", argv[0]);
+        fprintf(stderr, "use: %s iterations [max-workers [tasks]] (10000 is a good value to try)\n",
+                argv[0]);
         return 1;
     }
     iterations = atoi(argv[1]);
-    pthread_t t_producer, t_consumer;
-    pthread_create(&t_producer, NULL, s_producer, NULL);
-    pthread_create(&t_consumer, NULL, s_consumer, NULL);
-    pthread_join(t_producer, NULL);
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned max_workers = argc > 2 ? (unsigned)atoi(argv[2]) : (unsigned)(ncpus > 0 ? ncpus : 1);
+    unsigned long ntasks = argc > 3 ? strtoul(argv[3], NULL, 10) : 100000;
+    if (max_workers < 1 || ntasks < 1)
+    {
+        fprintf(stderr, "max-workers and tasks must be at least 1\n");
+        return 1;
+    }
+
+    for (unsigned n = 1; n <= max_workers; ++n)
+    {
+        s_run_workers(n, ntasks);
+    }
     return 0;
 }
@@ -0,0 +1,682 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/**
+ * Lock-contention profiler for the pthread-based examples.
+ *
+ * Build liblockprof.so and preload it into any of the threaded examples:
+ *
+ *     LD_PRELOAD=./liblockprof.so ./deadlock
+ *
+ * pthread_mutex_lock(), pthread_mutex_trylock(), pthread_mutex_unlock(),
+ * pthread_cond_wait() and pthread_cond_timedwait() are interposed. For every
+ * (mutex, call site) pair the profiler records the number of acquisitions,
+ * how many of them were contended, and log2 histograms of the time spent
+ * waiting for the mutex and the time it was held. Condition variable waits
+ * are recorded per (condition variable, call site). At exit a report ranked
+ * by total wait time is written to stderr, or to the file named by
+ * LOCKPROF_OUTPUT. LOCKPROF_TOP sets the number of rows (default 20).
+ *
+ * A call site is the innermost N_FRAMES return addresses outside the
+ * profiler, so that locks taken through a wrapper such as deadlock.c's
+ * list_lock() are told apart by the wrapper's callers. Each is printed,
+ * innermost first, as module+offset, which can be fed to
+ * `addr2line -f -e MODULE OFFSET`. Unwinding the stack on every lock would
+ * swamp the times being measured, so each thread only does so for one call
+ * in SITE_SAMPLE from a given return address and reuses that site for the
+ * others. Counts for a wrapper with several callers are therefore split
+ * between them by sampling.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Histogram bucket i counts durations in [2^(i-1), 2^i) ns; bucket 0 is 0ns. */
+#define N_BUCKETS 40
+
+/* Maximum number of distinct (object, call site) pairs that can be tracked. */
+#define N_ENTRIES 8192
+
+/* Maximum number of mutexes a single thread can hold at once and still have
+ * their hold time measured. */
+#define N_HELD 64
+
+/* Number of return addresses that identify a call site. */
+#define N_FRAMES 3
+
+/* A thread unwinds the stack for one call in SITE_SAMPLE from each return
+ * address; the per-thread cache of the last site seen from each return
+ * address has SITE_CACHE slots. */
+#define SITE_SAMPLE 16
+#define SITE_CACHE 64
+
+enum entry_kind
+{
+    KIND_MUTEX,
+    KIND_COND,
+};
+
+enum entry_state
+{
+    ENTRY_EMPTY,
+    ENTRY_BUSY,
+    ENTRY_READY,
+};
+
+struct histogram
+{
+    uint64_t count[N_BUCKETS];
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+/* Innermost return addresses outside the profiler; unused ones are NULL. */
+struct site
+{
+    const void *frame[N_FRAMES];
+};
+
+/* The site last unwound from a return address, and how many calls from
+ * there have used it since. */
+struct cached_site
+{
+    const void *caller;
+    unsigned uses;
+    struct site site;
+};
+
+/* Statistics for one (object, call site) pair. */
+struct entry
+{
+    int state;
+    enum entry_kind kind;
+    const void *object;
+    struct site site;
+    uint64_t acquires;
+    uint64_t contended;
+    struct histogram wait;
+    struct histogram hold;
+};
+
+static struct entry g_entries[N_ENTRIES];
+static unsigned g_overflow;
+
+/* A mutex held by the current thread, for measuring hold time. */
+struct held
+{
+    const pthread_mutex_t *mutex;
+    uint64_t since_ns;
+    struct entry *entry;
+};
+
+static __thread struct held tls_held[N_HELD];
+static __thread unsigned tls_n_held;
+
+/* Set while the current thread is in backtrace(), which may itself lock. */
+static __thread bool tls_in_backtrace;
+
+static __thread struct cached_site tls_sites[SITE_CACHE];
+
+/* The executable segment of this library, whose frames are left out of
+ * call sites. Empty until lockprof_init() has run. */
+static uintptr_t g_self_start, g_self_end;
+
+static int (*real_mutex_lock)(pthread_mutex_t *);
+static int (*real_mutex_trylock)(pthread_mutex_t *);
+static int (*real_mutex_unlock)(pthread_mutex_t *);
+static int (*real_cond_wait)(pthread_cond_t *, pthread_mutex_t *);
+static int (*real_cond_timedwait)(pthread_cond_t *, pthread_mutex_t *, const struct timespec *);
+
+/* Look up the real definition of a pthread function. The condition variable
+ * functions have several symbol versions in glibc and plain dlsym() may
+ * return the compatibility one, so ask for the current version first. */
+static void *
+resolve(const char *name, const char *version)
+{
+    void *f = version ? dlvsym(RTLD_NEXT, name, version) : NULL;
+    if (!f)
+    {
+        f = dlsym(RTLD_NEXT, name);
+    }
+    if (!f)
+    {
+        fprintf(stderr, "lockprof: cannot resolve %s\n", name);
+        abort();
+    }
+    return f;
+}
+
+static void
+resolve_all(void)
+{
+    real_mutex_lock = resolve("pthread_mutex_lock", NULL);
+    real_mutex_trylock = resolve("pthread_mutex_trylock", NULL);
+    real_mutex_unlock = resolve("pthread_mutex_unlock", NULL);
+    real_cond_wait = resolve("pthread_cond_wait", "GLIBC_2.3.2");
+    real_cond_timedwait = resolve("pthread_cond_timedwait", "GLIBC_2.3.2");
+}
+
+/* dl_iterate_phdr() callback: find the executable segment containing
+ * <arg>. */
+static int
+find_self(struct dl_phdr_info *info, size_t size, void *arg)
+{
+    (void)size;
+    uintptr_t self = (uintptr_t)arg;
+    for (unsigned i = 0; i < info->dlpi_phnum; ++i)
+    {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        uintptr_t start = info->dlpi_addr + ph->p_vaddr;
+        if (ph->p_type == PT_LOAD && self >= start && self < start + ph->p_memsz)
+        {
+            g_self_start = start;
+            g_self_end = start + ph->p_memsz;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void __attribute__((constructor))
+lockprof_init(void)
+{
+    if (!real_mutex_lock)
+    {
+        resolve_all();
+    }
+    dl_iterate_phdr(find_self, (void *)lockprof_init);
+    /* The first backtrace() loads the unwinder, so do it now rather than
+     * under some lock of the program's. */
+    void *frame;
+    tls_in_backtrace = true;
+    backtrace(&frame, 1);
+    tls_in_backtrace = false;
+}
+
+/* Unwind the call site of the current interposed function, which was
+ * called from <caller>. The frames of the profiler are skipped, and so is a
+ * frame with the same return address as the one before it, as in a
+ * recursive call. */
+static void
+site_unwind(struct site *site, const void *caller)
+{
+    memset(site, 0, sizeof *site);
+    void *frames[N_FRAMES + 4]; /* Room for site_unwind(), site_get() and the interposer. */
+    tls_in_backtrace = true;
+    int n = backtrace(frames, sizeof frames / sizeof frames[0]);
+    tls_in_backtrace = false;
+    unsigned kept = 0;
+    for (int i = 0; i < n && kept < N_FRAMES; ++i)
+    {
+        uintptr_t pc = (uintptr_t)frames[i];
+        if ((pc >= g_self_start && pc < g_self_end) || (kept && frames[i] == site->frame[kept - 1]))
+        {
+            continue;
+        }
+        site->frame[kept++] = frames[i];
+    }
+    if (!kept)
+    {
+        site->frame[0] = caller;
+    }
+}
+
+/* Fill in the call site of the current interposed function, which was
+ * called from <caller>: unwound afresh for the first call from <caller> and
+ * every SITE_SAMPLE-th after it, otherwise the site last unwound from there.
+ * Until the profiler is initialised, and for locks taken by backtrace()
+ * itself, the site is just <caller>. */
+static void
+site_get(struct site *site, const void *caller)
+{
+    if (tls_in_backtrace || !g_self_end)
+    {
+        memset(site, 0, sizeof *site);
+        site->frame[0] = caller;
+        return;
+    }
+    struct cached_site *c = &tls_sites[((uintptr_t)caller >> 2) % SITE_CACHE];
+    if (c->caller != caller || ++c->uses == SITE_SAMPLE)
+    {
+        site_unwind(&c->site, caller);
+        c->caller = caller;
+        c->uses = 0;
+    }
+    *site = c->site;
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned
+bucket(uint64_t ns)
+{
+    unsigned b = ns ? 64 - __builtin_clzll(ns) : 0;
+    return b < N_BUCKETS ? b : N_BUCKETS - 1;
+}
+
+static void
+histogram_add(struct histogram *h, uint64_t ns)
+{
+    __atomic_fetch_add(&h->count[bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total_ns, ns, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&h->max_ns, &max, ns, true,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+/* Return the upper bound in ns of the bucket containing the pth percentile,
+ * or the longest duration recorded if that is less. */
+static uint64_t
+histogram_percentile(const struct histogram *h, double p)
+{
+    uint64_t total = 0;
+    for (unsigned i = 0; i < N_BUCKETS; ++i)
+    {
+        total += h->count[i];
+    }
+    uint64_t target = (uint64_t)(total * p / 100.0);
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < N_BUCKETS; ++i)
+    {
+        seen += h->count[i];
+        if (seen > target)
+        {
+            uint64_t bound = i ? (uint64_t)1 << i : 0;
+            return bound < h->max_ns ? bound : h->max_ns;
+        }
+    }
+    return h->max_ns;
+}
+
+/* Find or create the entry for (object, site, kind). Lock-free: slots are
+ * claimed with a CAS on their state and never released. Returns NULL if the
+ * table is full. */
+static struct entry *
+entry_get(const void *object, const struct site *site, enum entry_kind kind)
+{
+    uintptr_t h = ((uintptr_t)object >> 4) * 0x9e3779b97f4a7c15ull ^ kind;
+    for (unsigned i = 0; i < N_FRAMES; ++i)
+    {
+        h = (h ^ (uintptr_t)site->frame[i]) * 0xc2b2ae3d27d4eb4full;
+    }
+    h ^= h >> 29;
+    for (unsigned probe = 0; probe < N_ENTRIES; ++probe)
+    {
+        struct entry *e = &g_entries[(h + probe) % N_ENTRIES];
+        int state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+        if (state == ENTRY_EMPTY)
+        {
+            if (__atomic_compare_exchange_n(&e->state, &state, ENTRY_BUSY, false,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            {
+                e->object = object;
+                e->site = *site;
+                e->kind = kind;
+                __atomic_store_n(&e->state, ENTRY_READY, __ATOMIC_RELEASE);
+                return e;
+            }
+        }
+        while (state == ENTRY_BUSY)
+        {
+            state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+        }
+        if (e->object == object && e->kind == kind && !memcmp(&e->site, site, sizeof *site))
+        {
+            return e;
+        }
+    }
+    __atomic_fetch_add(&g_overflow, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/* Record that the current thread now holds <mutex>. */
+static void
+held_push(const pthread_mutex_t *mutex, struct entry *e, uint64_t since_ns)
+{
+    if (tls_n_held < N_HELD)
+    {
+        tls_held[tls_n_held].mutex = mutex;
+        tls_held[tls_n_held].since_ns = since_ns;
+        tls_held[tls_n_held].entry = e;
+    }
+    ++tls_n_held;
+}
+
+/* Record that the current thread released <mutex> and add the hold time to
+ * the entry of the call site that acquired it. */
+static void
+held_pop(const pthread_mutex_t *mutex, uint64_t now)
+{
+    unsigned n = tls_n_held < N_HELD ? tls_n_held : N_HELD;
+    for (unsigned i = n; i-- > 0;)
+    {
+        if (tls_held[i].mutex == mutex)
+        {
+            if (tls_held[i].entry)
+            {
+                histogram_add(&tls_held[i].entry->hold, now - tls_held[i].since_ns);
+            }
+            memmove(&tls_held[i], &tls_held[i + 1], (n - i - 1) * sizeof tls_held[0]);
+            --tls_n_held;
+            return;
+        }
+    }
+    /* Beyond N_HELD, so never stored; a mutex acquired before we were
+     * loaded was never counted at all. */
+    if (tls_n_held > N_HELD)
+    {
+        --tls_n_held;
+    }
+}
+
+/* Common path for pthread_mutex_lock() and the reacquisition at the end of
+ * a condition variable wait. */
+static int
+mutex_lock(pthread_mutex_t *mutex, const struct site *site)
+{
+    struct entry *e = entry_get(mutex, site, KIND_MUTEX);
+    int r = real_mutex_trylock(mutex);
+    uint64_t start = now_ns();
+    uint64_t acquired = start;
+    if (r != 0)
+    {
+        r = real_mutex_lock(mutex);
+        acquired = now_ns();
+        if (e)
+        {
+            __atomic_fetch_add(&e->contended, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (r == 0)
+    {
+        if (e)
+        {
+            __atomic_fetch_add(&e->acquires, 1, __ATOMIC_RELAXED);
+            histogram_add(&e->wait, acquired - start);
+        }
+        held_push(mutex, e, acquired);
+    }
+    return r;
+}
+
+int
+pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    if (!real_mutex_lock)
+    {
+        resolve_all();
+    }
+    struct site site;
+    site_get(&site, __builtin_return_address(0));
+    return mutex_lock(mutex, &site);
+}
+
+int
+pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+    if (!real_mutex_trylock)
+    {
+        resolve_all();
+    }
+    int r = real_mutex_trylock(mutex);
+    if (r == 0)
+    {
+        struct site site;
+        site_get(&site, __builtin_return_address(0));
+        struct entry *e = entry_get(mutex, &site, KIND_MUTEX);
+        if (e)
+        {
+            __atomic_fetch_add(&e->acquires, 1, __ATOMIC_RELAXED);
+            histogram_add(&e->wait, 0);
+        }
+        held_push(mutex, e, now_ns());
+    }
+    return r;
+}
+
+int
+pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+    if (!real_mutex_unlock)
+    {
+        resolve_all();
+    }
+    held_pop(mutex, now_ns());
+    return real_mutex_unlock(mutex);
+}
+
+/* Record a condition variable wait that started at <start> and hand the
+ * reacquired mutex back to the hold-time tracking. The reacquisition counts
+ * as an acquire of the mutex at the wait's call site, so that the time the
+ * mutex is then held is reported; the time it took is part of the
+ * condition variable's wait. */
+static void
+cond_waited(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct site *site, uint64_t start)
+{
+    uint64_t end = now_ns();
+    struct entry *e = entry_get(cond, site, KIND_COND);
+    if (e)
+    {
+        __atomic_fetch_add(&e->acquires, 1, __ATOMIC_RELAXED);
+        histogram_add(&e->wait, end - start);
+    }
+    struct entry *m = entry_get(mutex, site, KIND_MUTEX);
+    if (m)
+    {
+        __atomic_fetch_add(&m->acquires, 1, __ATOMIC_RELAXED);
+    }
+    held_push(mutex, m, end);
+}
+
+int
+pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    if (!real_cond_wait)
+    {
+        resolve_all();
+    }
+    uint64_t start = now_ns();
+    held_pop(mutex, start);
+    int r = real_cond_wait(cond, mutex);
+    struct site site;
+    site_get(&site, __builtin_return_address(0));
+    cond_waited(cond, mutex, &site, start);
+    return r;
+}
+
+int
+pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime)
+{
+    if (!real_cond_timedwait)
+    {
+        resolve_all();
+    }
+    uint64_t start = now_ns();
+    held_pop(mutex, start);
+    int r = real_cond_timedwait(cond, mutex, abstime);
+    struct site site;
+    site_get(&site, __builtin_return_address(0));
+    cond_waited(cond, mutex, &site, start);
+    return r;
+}
+
+/* Format a duration in ns with a human-friendly unit. */
+static const char *
+format_ns(char *buf, size_t size, uint64_t ns)
+{
+    if (ns < 10000)
+    {
+        snprintf(buf, size, "%lluns", (unsigned long long)ns);
+    }
+    else if (ns < 10000000)
+    {
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    }
+    else if (ns < 10000000000ull)
+    {
+        snprintf(buf, size, "%.1fms", ns / 1e6);
+    }
+    else
+    {
+        snprintf(buf, size, "%.1fs", ns / 1e9);
+    }
+    return buf;
+}
+
+/* Format a return address as function+offset if it has a dynamic symbol,
+ * otherwise as module+offset. */
+static const char *
+format_frame(char *buf, size_t size, const void *site)
+{
+    Dl_info info;
+    if (dladdr(site, &info) && info.dli_fname)
+    {
+        const char *module = strrchr(info.dli_fname, '/');
+        module = module ? module + 1 : info.dli_fname;
+        if (info.dli_sname)
+        {
+            snprintf(buf, size, "%s+0x%tx (%s)", info.dli_sname,
+                     (const char *)site - (const char *)info.dli_saddr, module);
+        }
+        else
+        {
+            snprintf(buf, size, "%s+0x%tx", module,
+                     (const char *)site - (const char *)info.dli_fbase);
+        }
+    }
+    else
+    {
+        snprintf(buf, size, "%p", site);
+    }
+    return buf;
+}
+
+/* Format the frames of <site>, innermost first, separated by " < ". */
+static const char *
+format_site(char *buf, size_t size, const struct site *site)
+{
+    size_t len = 0;
+    buf[0] = 0;
+    for (unsigned i = 0; i < N_FRAMES && site->frame[i] && len < size; ++i)
+    {
+        char frame[256];
+        len += snprintf(buf + len, size - len, "%s%s", i ? " < " : "",
+                        format_frame(frame, sizeof frame, site->frame[i]));
+    }
+    return buf;
+}
+
+/* Print the non-empty buckets of <h>, if it has any. */
+static void
+print_histogram(FILE *out, const char *name, const struct histogram *h)
+{
+    bool empty = true;
+    for (unsigned i = 0; i < N_BUCKETS; ++i)
+    {
+        empty = empty && !h->count[i];
+    }
+    if (empty)
+    {
+        return;
+    }
+    fprintf(out, "        %s:", name);
+    for (unsigned i = 0; i < N_BUCKETS; ++i)
+    {
+        if (h->count[i])
+        {
+            char b[32];
+            fprintf(out, " <%s:%llu", format_ns(b, sizeof b, i ? (uint64_t)1 << i : 1),
+                    (unsigned long long)h->count[i]);
+        }
+    }
+    fputc('\n', out);
+}
+
+static int
+compare_wait(const void *a, const void *b)
+{
+    const struct entry *ea = *(const struct entry *const *)a;
+    const struct entry *eb = *(const struct entry *const *)b;
+    if (ea->wait.total_ns != eb->wait.total_ns)
+    {
+        return ea->wait.total_ns < eb->wait.total_ns ? 1 : -1;
+    }
+    return ea->acquires < eb->acquires ? 1 : ea->acquires > eb->acquires ? -1 : 0;
+}
+
+static void __attribute__((destructor))
+lockprof_report(void)
+{
+    static struct entry *sorted[N_ENTRIES];
+    unsigned n = 0;
+    for (unsigned i = 0; i < N_ENTRIES; ++i)
+    {
+        if (__atomic_load_n(&g_entries[i].state, __ATOMIC_ACQUIRE) == ENTRY_READY
+            && g_entries[i].acquires)
+        {
+            sorted[n++] = &g_entries[i];
+        }
+    }
+    qsort(sorted, n, sizeof sorted[0], compare_wait);
+
+    const char *path = getenv("LOCKPROF_OUTPUT");
+    FILE *out = path ? fopen(path, "w") : stderr;
+    if (!out)
+    {
+        perror(path);
+        return;
+    }
+    const char *top_env = getenv("LOCKPROF_TOP");
+    unsigned top = top_env ? strtoul(top_env, NULL, 10) : 20;
+
+    fprintf(out, "lockprof: %u call sites, ranked by total wait time\n", n);
+    fprintf(out, "%4s %-5s %-18s %10s %10s %6s %10s %10s %10s %10s %10s  %s\n",
+            "rank", "kind", "object", "acquires", "contended", "cont%", "wait", "wait-p99",
+            "wait-max", "hold", "hold-p99", "call site");
+    for (unsigned i = 0; i < n && i < top; ++i)
+    {
+        const struct entry *e = sorted[i];
+        char w[32], wp[32], wm[32], h[32], hp[32], site[N_FRAMES * 256];
+        fprintf(out, "%4u %-5s %-18p %10llu %10llu %5.1f%% %10s %10s %10s %10s %10s  %s\n",
+                i + 1, e->kind == KIND_MUTEX ? "mutex" : "cond", e->object,
+                (unsigned long long)e->acquires, (unsigned long long)e->contended,
+                100.0 * e->contended / e->acquires,
+                format_ns(w, sizeof w, e->wait.total_ns),
+                format_ns(wp, sizeof wp, histogram_percentile(&e->wait, 99)),
+                format_ns(wm, sizeof wm, e->wait.max_ns),
+                format_ns(h, sizeof h, e->hold.total_ns),
+                format_ns(hp, sizeof hp, histogram_percentile(&e->hold, 99)),
+                format_site(site, sizeof site, &e->site));
+        print_histogram(out, "wait", &e->wait);
+        if (e->kind == KIND_MUTEX)
+        {
+            print_histogram(out, "hold", &e->hold);
+        }
+    }
+    if (g_overflow)
+    {
+        fprintf(out, "lockprof: %u acquisitions not recorded (table full)\n", g_overflow);
+    }
+    if (out != stderr)
+    {
+        fclose(out);
+    }
+}
@@ -0,0 +1,259 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/* Buffered asynchronous logger.
+ *
+ * log_message() formats a timestamped line into a ring buffer owned by the
+ * calling thread and returns; a background flusher thread drains all the
+ * rings into a large buffer and writes it out with a single write() call.
+ * Each ring has one producer (its thread) and one consumer (the flusher), so
+ * callers never take a lock. The "[HH:MM:SS" part of the timestamp is
+ * formatted once per second per thread and reused, and the clock can be
+ * switched to CLOCK_REALTIME_COARSE to avoid reading the TSC.
+ *
+ * Lines from one thread appear in the order they were logged; lines from
+ * different threads are interleaved whole. If a ring is full the caller
+ * waits for the flusher, so no message is dropped.
+ *
+ * Call log_init() before logging and log_shutdown() to write out everything
+ * that is still buffered and stop the flusher. */
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef CLOCK_REALTIME_COARSE
+#define CLOCK_REALTIME_COARSE 5
+#endif
+
+/* Bytes buffered per logging thread. */
+#define LOG_RING_SIZE (1 << 16)
+
+/* Longest line, including the timestamp; longer messages are truncated. */
+#define LOG_LINE_MAX 512
+
+/* Bytes collected by the flusher before each write(). */
+#define LOG_OUTPUT_SIZE (1 << 20)
+
+struct log_ring
+{
+    uint64_t head __attribute__((aligned(64))); /* Written by the logging thread. */
+    uint64_t tail __attribute__((aligned(64))); /* Written by the flusher. */
+    struct log_ring *next;                      /* All rings, for the flusher. */
+    time_t stamp_sec;                           /* Second of the cached stamp. */
+    char stamp[sizeof "[HH:MM:SS"];
+    char buf[LOG_RING_SIZE];
+};
+
+static struct
+{
+    int fd;
+    clockid_t clock;
+    bool stop;
+    pthread_t flusher;
+    struct log_ring *rings;
+    char output[LOG_OUTPUT_SIZE];
+} log_state;
+
+static __thread struct log_ring *log_tls_ring;
+
+/* Return the calling thread's ring, creating and registering it on first use. */
+static struct log_ring *
+log_ring_get(void)
+{
+    struct log_ring *ring = log_tls_ring;
+    if (__builtin_expect(!ring, 0))
+    {
+        ring = calloc(1, sizeof *ring);
+        assert(ring);
+        ring->stamp_sec = -1;
+        ring->next = __atomic_load_n(&log_state.rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&log_state.rings, &ring->next, ring, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+        }
+        log_tls_ring = ring;
+    }
+    return ring;
+}
+
+/* Write all of buf to fd, retrying partial writes. */
+static void
+log_write_all(int fd, const char *buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t r = write(fd, buf, len);
+        if (r <= 0)
+        {
+            return;
+        }
+        buf += r;
+        len -= r;
+    }
+}
+
+/* Drain every ring once. Returns the number of bytes written. */
+static size_t
+log_drain(void)
+{
+    size_t written = 0;
+    for (struct log_ring *ring = __atomic_load_n(&log_state.rings, __ATOMIC_ACQUIRE); ring;
+         ring = ring->next)
+    {
+        uint64_t tail = ring->tail;
+        /* Pairs with the release store of head in log_message(). */
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (tail != head)
+        {
+            size_t len = head - tail;
+            size_t offset = tail % LOG_RING_SIZE;
+            if (len > LOG_RING_SIZE - offset)
+            {
+                len = LOG_RING_SIZE - offset;
+            }
+            if (len > LOG_OUTPUT_SIZE - written)
+            {
+                log_write_all(log_state.fd, log_state.output, written);
+                written = 0;
+            }
+            memcpy(log_state.output + written, ring->buf + offset, len);
+            written += len;
+            tail += len;
+        }
+        /* The bytes are copied out, so the producer may reuse the space. */
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    log_write_all(log_state.fd, log_state.output, written);
+    return written;
+}
+
+static void *
+log_flusher(void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        bool stop = __atomic_load_n(&log_state.stop, __ATOMIC_ACQUIRE);
+        if (!log_drain())
+        {
+            if (stop)
+            {
+                return NULL;
+            }
+            struct timespec idle = { .tv_sec = 0, .tv_nsec = 1000000 };
+            nanosleep(&idle, NULL);
+        }
+    }
+}
+
+/* Start logging to <fd>. With <coarse_clock>, timestamps come from
+ * CLOCK_REALTIME_COARSE, which is cheaper but only as precise as the
+ * kernel tick. */
+static void
+log_init(int fd, bool coarse_clock)
+{
+    log_state.fd = fd;
+    log_state.clock = coarse_clock ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME;
+    struct timespec ts;
+    if (clock_gettime(log_state.clock, &ts) != 0)
+    {
+        log_state.clock = CLOCK_REALTIME;
+    }
+    log_state.stop = false;
+    int r = pthread_create(&log_state.flusher, NULL, log_flusher, NULL);
+    assert(r == 0);
+    (void)r;
+}
+
+/* Wait until everything logged so far by any thread has been written. */
+static void
+log_flush(void)
+{
+    for (struct log_ring *ring = __atomic_load_n(&log_state.rings, __ATOMIC_ACQUIRE); ring;
+         ring = ring->next)
+    {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) < head)
+        {
+            sched_yield();
+        }
+    }
+}
+
+/* Write out everything still buffered and stop the flusher thread. Threads
+ * must have stopped logging. */
+static void
+log_shutdown(void)
+{
+    __atomic_store_n(&log_state.stop, true, __ATOMIC_RELEASE);
+    int r = pthread_join(log_state.flusher, NULL);
+    assert(r == 0);
+    (void)r;
+    struct log_ring *ring = log_state.rings;
+    while (ring)
+    {
+        struct log_ring *next = ring->next;
+        free(ring);
+        ring = next;
+    }
+    log_state.rings = NULL;
+    log_tls_ring = NULL;
+}
+
+/* Append a timestamped, formatted line to the calling thread's ring. */
+static void __attribute__((format(printf, 1, 2)))
+log_message(const char *format, ...)
+{
+    struct log_ring *ring = log_ring_get();
+    struct timespec ts;
+    int e = clock_gettime(log_state.clock, &ts);
+    assert(e == 0);
+    (void)e;
+    if (ts.tv_sec != ring->stamp_sec)
+    {
+        struct tm tm;
+        gmtime_r(&ts.tv_sec, &tm);
+        size_t len = strftime(ring->stamp, sizeof ring->stamp, "[%H:%M:%S", &tm);
+        assert(len > 0 && len < sizeof ring->stamp);
+        (void)len;
+        ring->stamp_sec = ts.tv_sec;
+    }
+
+    char line[LOG_LINE_MAX];
+    int len = snprintf(line, sizeof line, "%s.%06ld] ", ring->stamp, (long)ts.tv_nsec / 1000);
+    va_list ap;
+    va_start(ap, format);
+    len += vsnprintf(line + len, sizeof line - len, format, ap);
+    va_end(ap);
+    if (len > (int)sizeof line - 2)
+    {
+        len = sizeof line - 2;
+    }
+    line[len++] = '\n';
+
+    uint64_t head = ring->head;
+    while (head + len - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > LOG_RING_SIZE)
+    {
+        /* Ring full: wait for the flusher. */
+        sched_yield();
+    }
+    size_t offset = head % LOG_RING_SIZE;
+    size_t first = (size_t)len < LOG_RING_SIZE - offset ? (size_t)len : LOG_RING_SIZE - offset;
+    memcpy(ring->buf + offset, line, first);
+    memcpy(ring->buf, line + first, len - first);
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,293 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/* Threaded stress test of the single-flight memo cache in memo-cache.h.
+ *
+ * "memo-cache [THREADS [ROUNDS]]" runs THREADS threads (default 8) against
+ * a cache of slow square roots, each taking 200us, in four phases:
+ *
+ *   stampede  In each of ROUNDS rounds (default 200), all threads look up the
+ *             same new number at once.
+ *   random    Each thread looks up ROUNDS * 10 random numbers in 0..255 with
+ *             room for 100 in the cache, as in cache-cpp.cpp.
+ *   errors    As stampede, but every computation throws; all threads must
+ *             get the exception, and the next lookup must compute again.
+ *             The 99 values cached beforehand must all survive the
+ *             failures, which take no room in the cache.
+ *   timeouts  As stampede, but each computation takes 100ms and the other
+ *             threads wait only 5ms for it.
+ *
+ * The first two phases also run on a cache that, like CacheSqroot, checks
+ * for the number, computes it on a miss and then inserts it, so that
+ * concurrent misses all compute; the computations saved are the difference.
+ * Every value returned is checked against sqrt(). */
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "memo-cache.h"
+#include "prng.h"
+
+/* The slow computation being cached. Negative numbers are an error. */
+static std::chrono::microseconds g_compute_time(200);
+
+static int
+slow_sqrt(int number)
+{
+    std::this_thread::sleep_for(g_compute_time);
+    if (number < 0)
+    {
+        throw std::domain_error("square root of a negative number");
+    }
+    return static_cast<int>(sqrt(number));
+}
+
+/* Check, compute on a miss, insert: every thread that misses computes. */
+class NaiveCache
+{
+public:
+    explicit NaiveCache(size_t capacity) : computations(0), capacity(capacity)
+    {
+    }
+
+    int get(int number)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = data.find(number);
+            if (it != data.end())
+            {
+                return it->second;
+            }
+        }
+        int sqroot = slow_sqrt(number);
+        std::lock_guard<std::mutex> guard(lock);
+        ++computations;
+        if (data.emplace(number, sqroot).second)
+        {
+            order.push_back(number);
+            if (order.size() > capacity)
+            {
+                data.erase(order.front());
+                order.pop_front();
+            }
+        }
+        return sqroot;
+    }
+
+    uint64_t computations;
+
+private:
+    size_t capacity;
+    std::mutex lock;
+    std::map<int, int> data;
+    std::deque<int> order;
+};
+
+/* Lets a set of threads start each round together. */
+class Barrier
+{
+public:
+    explicit Barrier(unsigned n) : n(n), waiting(0), generation(0)
+    {
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        unsigned my_generation = generation;
+        if (++waiting == n)
+        {
+            waiting = 0;
+            ++generation;
+            condition.notify_all();
+            return;
+        }
+        condition.wait(guard, [&]() { return generation != my_generation; });
+    }
+
+private:
+    unsigned n;
+    unsigned waiting;
+    unsigned generation;
+    std::mutex lock;
+    std::condition_variable condition;
+};
+
+/* Run body(thread, round) for every round on each of <nthreads> threads,
+ * starting each round together. */
+template <typename Body>
+static void
+run_rounds(unsigned nthreads, unsigned rounds, Body body)
+{
+    Barrier barrier(nthreads);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < nthreads; ++t)
+    {
+        threads.emplace_back([&, t]() {
+            for (unsigned round = 0; round < rounds; ++round)
+            {
+                barrier.wait();
+                body(t, round);
+            }
+        });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+}
+
+typedef MemoCache<int, int> Cache;
+
+static const std::chrono::milliseconds g_patience(1000);
+
+static void
+print_saved(const char *phase, uint64_t lookups, uint64_t naive, const Cache &cache)
+{
+    Cache::Stats stats = cache.stats();
+    std::cout << phase << ": " << lookups << " lookups; naive cache computed " << naive << ", single flight "
+              << stats.computations << " (" << naive - stats.computations << " saved; " << stats.hits << " hits, "
+              << stats.coalesced << " waited for another thread)" << std::endl;
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned nthreads = argc > 1 ? strtoul(argv[1], NULL, 10) : 8;
+    unsigned rounds = argc > 2 ? strtoul(argv[2], NULL, 10) : 200;
+    if (argc > 3 || nthreads == 0 || rounds == 0)
+    {
+        std::cerr << "Usage: " << argv[0] << " [THREADS [ROUNDS]]\n";
+        return EXIT_FAILURE;
+    }
+
+    /* Stampede: everyone misses on the same number at once. */
+    {
+        NaiveCache naive(100);
+        Cache cache(100);
+        run_rounds(nthreads, rounds, [&](unsigned, unsigned round) {
+            int number = static_cast<int>(round) + 1000;
+            int correct = static_cast<int>(sqrt(number));
+            int a = naive.get(number);
+            assert(a == correct);
+            int b = cache.get(number, slow_sqrt, g_patience);
+            assert(b == correct);
+            (void)a;
+            (void)b;
+            (void)correct;
+        });
+        assert(cache.stats().computations == rounds);
+        print_saved("stampede", (uint64_t)nthreads * rounds, naive.computations, cache);
+    }
+
+    /* Random numbers in 0..255 with room for 100 of them. */
+    {
+        NaiveCache naive(100);
+        Cache cache(100);
+        unsigned lookups = rounds * 10;
+        run_rounds(nthreads, 1, [&](unsigned t, unsigned) {
+            prng_seed(t + 1);
+            for (unsigned i = 0; i < lookups; ++i)
+            {
+                int number = static_cast<int>(prng_bounded(256));
+                int a = naive.get(number);
+                int b = cache.get(number, slow_sqrt, g_patience);
+                assert(a == static_cast<int>(sqrt(number)) && b == a);
+                (void)a;
+                (void)b;
+            }
+        });
+        print_saved("random", (uint64_t)nthreads * lookups, naive.computations, cache);
+    }
+
+    /* Errors: every waiter sees the exception, and it is not cached. */
+    {
+        Cache cache(100);
+        const int n_cached = 99; /* Leaves room for the failing lookup. */
+        for (int number = 0; number < n_cached; ++number)
+        {
+            cache.get(number, slow_sqrt, g_patience);
+        }
+        std::atomic<uint64_t> failures(0);
+        run_rounds(nthreads, rounds, [&](unsigned, unsigned round) {
+            try
+            {
+                cache.get(-1 - static_cast<int>(round), slow_sqrt, g_patience);
+                assert(!"expected an exception");
+            }
+            catch (const std::domain_error &)
+            {
+                ++failures;
+            }
+        });
+        /* A thread that arrives after a failure has been dropped computes
+         * again, so there may be more errors than rounds. */
+        uint64_t errors = cache.stats().errors;
+        assert(failures == (uint64_t)nthreads * rounds);
+        assert(errors >= rounds);
+        try
+        {
+            cache.get(-1, slow_sqrt, g_patience);
+            assert(!"expected an exception");
+        }
+        catch (const std::domain_error &)
+        {
+        }
+        assert(cache.stats().errors == errors + 1);
+        uint64_t computations = cache.stats().computations;
+        for (int number = 0; number < n_cached; ++number)
+        {
+            int sqroot = cache.get(number, slow_sqrt, g_patience);
+            assert(sqroot == static_cast<int>(sqrt(number)));
+            (void)sqroot;
+        }
+        assert(cache.stats().computations == computations);
+        std::cout << "errors: " << failures << " lookups all got the exception from " << errors
+                  << " computations; the " << n_cached << " values cached before are all still there" << std::endl;
+    }
+
+    /* Timeouts: waiters give up, and later lookups get the value. */
+    {
+        Cache cache(100);
+        g_compute_time = std::chrono::milliseconds(100);
+        unsigned timeout_rounds = rounds < 10 ? rounds : 10;
+        std::atomic<uint64_t> timeouts(0);
+        run_rounds(nthreads, timeout_rounds, [&](unsigned, unsigned round) {
+            try
+            {
+                int sqroot = cache.get(static_cast<int>(round), slow_sqrt, std::chrono::milliseconds(5));
+                assert(sqroot == static_cast<int>(sqrt(round)));
+                (void)sqroot;
+            }
+            catch (const Cache::Timeout &)
+            {
+                ++timeouts;
+            }
+        });
+        for (unsigned round = 0; round < timeout_rounds; ++round)
+        {
+            int sqroot = cache.get(static_cast<int>(round), slow_sqrt, std::chrono::milliseconds(0));
+            assert(sqroot == static_cast<int>(sqrt(round)));
+            (void)sqroot;
+        }
+        assert(cache.stats().computations == timeout_rounds);
+        assert(timeouts == cache.stats().timeouts);
+        std::cout << "timeouts: " << timeouts << " of " << (uint64_t)nthreads * timeout_rounds
+                  << " lookups gave up waiting; " << timeout_rounds << " computations" << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,191 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/* Concurrent memo cache that computes each missing value once.
+ *
+ * MemoCache<K, V>::get(key, compute, timeout) returns the cached value of
+ * <key>, or calls compute(key) to fill it. When several threads miss on the
+ * same key at once, only the first calls compute(): it installs a pending
+ * entry, a std::shared_future, before it starts, and the others wait on that
+ * entry instead of computing the value again ("single flight"). A waiter
+ * gives up after <timeout> and throws MemoCache::Timeout, while the
+ * computation carries on for later callers. If compute() throws, every
+ * caller waiting on it gets the same exception and the entry is dropped, so
+ * the next call computes afresh rather than caching the failure.
+ *
+ * The cache holds at most <capacity> entries, dropping the oldest first like
+ * CacheSqroot in cache-cpp.cpp; waiters keep their own reference to a
+ * dropped pending entry. C++11. */
+
+#ifndef MEMO_CACHE_H
+#define MEMO_CACHE_H
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+
+template <typename K, typename V>
+class MemoCache
+{
+public:
+    class Timeout : public std::runtime_error
+    {
+    public:
+        Timeout() : std::runtime_error("timed out waiting for another thread's computation")
+        {
+        }
+    };
+
+    struct Stats
+    {
+        uint64_t hits;         /* Found a finished value. */
+        uint64_t computations; /* Called compute(). */
+        uint64_t coalesced;    /* Waited for another thread's compute(). */
+        uint64_t timeouts;     /* Gave up waiting. */
+        uint64_t errors;       /* compute() threw. */
+    };
+
+    explicit MemoCache(size_t capacity) : capacity(capacity), next_id(0)
+    {
+    }
+
+    template <typename Compute>
+    V get(const K &key, Compute compute, std::chrono::milliseconds timeout)
+    {
+        std::shared_future<V> future;
+        std::unique_ptr<std::promise<V>> promise;
+        uint64_t id = 0;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = entries.find(key);
+            if (it == entries.end())
+            {
+                /* Miss: install a pending entry and compute it below. */
+                id = next_id++;
+                promise.reset(new std::promise<V>());
+                entries.emplace(key, Entry{ promise->get_future().share(), id });
+                order.emplace_back(key, id);
+                evict();
+            }
+            else
+            {
+                future = it->second.future;
+            }
+        }
+
+        if (future.valid())
+        {
+            if (future.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+            {
+                ++counts.hits;
+            }
+            else
+            {
+                ++counts.coalesced;
+                if (future.wait_for(timeout) != std::future_status::ready)
+                {
+                    ++counts.timeouts;
+                    throw Timeout();
+                }
+            }
+            return future.get(); /* Rethrows the computation's exception. */
+        }
+
+        ++counts.computations;
+        try
+        {
+            V value = compute(key);
+            promise->set_value(value);
+            return value;
+        }
+        catch (...)
+        {
+            ++counts.errors;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                auto it = entries.find(key);
+                if (it != entries.end() && it->second.id == id)
+                {
+                    entries.erase(it);
+                }
+            }
+            promise->set_exception(std::current_exception());
+            throw;
+        }
+    }
+
+    Stats stats() const
+    {
+        return Stats{ counts.hits, counts.computations, counts.coalesced, counts.timeouts, counts.errors };
+    }
+
+private:
+    /* An entry, and the id that tells it apart from earlier entries for the
+     * same key that failed or were evicted. */
+    struct Entry
+    {
+        std::shared_future<V> future;
+        uint64_t id;
+    };
+
+    /* Whether <record> in order is for the entry now in entries, rather
+     * than for one that failed and was dropped. The caller holds lock. */
+    bool live(const std::pair<K, uint64_t> &record) const
+    {
+        auto it = entries.find(record.first);
+        return it != entries.end() && it->second.id == record.second;
+    }
+
+    /* Drop the oldest entries beyond the capacity, skipping the stale
+     * records of failed computations so that they do not count against it.
+     * The caller holds lock. */
+    void evict()
+    {
+        while (entries.size() > capacity)
+        {
+            if (live(order.front()))
+            {
+                entries.erase(order.front().first);
+            }
+            order.pop_front();
+        }
+        while (!order.empty() && !live(order.front()))
+        {
+            order.pop_front();
+        }
+        /* Stale records behind a long-lived entry are not reached above, so
+         * sweep them out once they outnumber the live ones. */
+        if (order.size() > 2 * entries.size() + 16)
+        {
+            order.erase(std::remove_if(order.begin(), order.end(),
+                                       [this](const std::pair<K, uint64_t> &record) { return !live(record); }),
+                        order.end());
+        }
+    }
+
+    std::mutex lock;
+    std::unordered_map<K, Entry> entries;
+    std::deque<std::pair<K, uint64_t>> order; /* Keys and ids, oldest first. */
+    size_t capacity;
+    uint64_t next_id;
+    struct
+    {
+        std::atomic<uint64_t> hits{ 0 };
+        std::atomic<uint64_t> computations{ 0 };
+        std::atomic<uint64_t> coalesced{ 0 };
+        std::atomic<uint64_t> timeouts{ 0 };
+        std::atomic<uint64_t> errors{ 0 };
+    } counts;
+};
+
+#endif
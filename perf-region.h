@@ -0,0 +1,331 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/* Hardware performance counters for named regions of code.
+ *
+ * perf_region_begin("name") and perf_region_end("name") bracket a region;
+ * regions may nest. Each thread opens its own group of perf_event_open()
+ * counters on first use, counting user-space cycles, instructions,
+ * last-level cache misses, branch misses and dTLB load misses, and keeps
+ * per-region totals of calls, wall time and counts. perf_region_report()
+ * prints the totals of every thread.
+ *
+ * Profiling is off unless the PERF_REGIONS environment variable is set to
+ * something other than 0; when off, begin and end only test a flag. If the
+ * counters cannot be opened, for instance in a container without access to
+ * the PMU or with kernel.perf_event_paranoid above 2, or a single event is
+ * not supported, the report shows "-" for the missing counts and regions are
+ * still timed. Reading the counters is a system call, so keep regions well
+ * above a microsecond or treat the time as an upper bound.
+ *
+ * Usable from both C and C++; C programs must define _GNU_SOURCE. */
+
+#ifndef PERF_REGION_H
+#define PERF_REGION_H
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Distinct regions per thread; further regions are ignored. */
+#define PERF_REGION_MAX 32
+
+/* Deepest nesting of regions. */
+#define PERF_REGION_DEPTH 16
+
+enum
+{
+    PERF_REGION_CYCLES,
+    PERF_REGION_INSTRUCTIONS,
+    PERF_REGION_LLC_MISSES,
+    PERF_REGION_BRANCH_MISSES,
+    PERF_REGION_DTLB_MISSES,
+    PERF_REGION_EVENTS
+};
+
+static const struct
+{
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} perf_region_events[PERF_REGION_EVENTS] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "LLC-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "dTLB-misses", PERF_TYPE_HW_CACHE,
+      PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+};
+
+struct perf_region_stats
+{
+    const char *name;
+    uint64_t calls;
+    double seconds;
+    uint64_t counts[PERF_REGION_EVENTS];
+};
+
+/* An open region: where its totals go and the readings at its start. */
+struct perf_region_frame
+{
+    struct perf_region_stats *stats;
+    double start;
+    uint64_t counts[PERF_REGION_EVENTS];
+};
+
+struct perf_region_thread
+{
+    struct perf_region_thread *next; /* All threads, for the report. */
+    long tid;
+    int group_fd;                    /* Group leader, or -1 without counters. */
+    int slot[PERF_REGION_EVENTS];    /* Position in a group read, or -1. */
+    int n_events;
+    size_t n_regions;
+    struct perf_region_stats regions[PERF_REGION_MAX];
+    size_t depth;
+    struct perf_region_frame stack[PERF_REGION_DEPTH];
+};
+
+static struct
+{
+    int enabled; /* -1 until PERF_REGIONS has been read. */
+    int error;   /* errno from the first failure to open the counters. */
+    struct perf_region_thread *threads;
+} perf_region_state = { -1, 0, NULL };
+
+static __thread struct perf_region_thread *perf_region_tls;
+
+static double
+perf_region_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int
+perf_region_open(int index, int group_fd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = perf_region_events[index].type;
+    attr.config = perf_region_events[index].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+/* Return the calling thread's state, creating and registering it on first
+ * use, or NULL if profiling is off. The counters stay open until the
+ * process exits. */
+static struct perf_region_thread *
+perf_region_self(void)
+{
+    struct perf_region_thread *thread = perf_region_tls;
+    if (__builtin_expect(thread != NULL, 1))
+    {
+        return thread;
+    }
+    int enabled = __atomic_load_n(&perf_region_state.enabled, __ATOMIC_RELAXED);
+    if (enabled < 0)
+    {
+        const char *env = getenv("PERF_REGIONS");
+        enabled = env && *env && strcmp(env, "0") != 0;
+        __atomic_store_n(&perf_region_state.enabled, enabled, __ATOMIC_RELAXED);
+    }
+    if (!enabled)
+    {
+        return NULL;
+    }
+
+    thread = (struct perf_region_thread *)calloc(1, sizeof *thread);
+    assert(thread);
+    thread->tid = syscall(SYS_gettid);
+    thread->group_fd = -1;
+    for (int i = 0; i < PERF_REGION_EVENTS; ++i)
+    {
+        int fd = perf_region_open(i, thread->group_fd);
+        if (fd < 0)
+        {
+            int expected = 0;
+            __atomic_compare_exchange_n(&perf_region_state.error, &expected, errno, false, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED);
+            thread->slot[i] = -1;
+            continue;
+        }
+        if (thread->group_fd < 0)
+        {
+            thread->group_fd = fd;
+        }
+        thread->slot[i] = thread->n_events++;
+    }
+
+    thread->next = __atomic_load_n(&perf_region_state.threads, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&perf_region_state.threads, &thread->next, thread, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+    }
+    perf_region_tls = thread;
+    return thread;
+}
+
+/* Read the thread's counters into <counts>, scaled up if the kernel had to
+ * multiplex them with other events. Unavailable counters read as 0. */
+static void
+perf_region_read(const struct perf_region_thread *thread, uint64_t *counts)
+{
+    uint64_t buf[3 + PERF_REGION_EVENTS];
+    memset(counts, 0, PERF_REGION_EVENTS * sizeof counts[0]);
+    if (thread->group_fd < 0 || read(thread->group_fd, buf, sizeof buf) < (ssize_t)(3 * sizeof buf[0]))
+    {
+        return;
+    }
+    double scale = buf[2] && buf[2] < buf[1] ? (double)buf[1] / buf[2] : 1.0;
+    for (int i = 0; i < PERF_REGION_EVENTS; ++i)
+    {
+        if (thread->slot[i] >= 0)
+        {
+            counts[i] = (uint64_t)(buf[3 + thread->slot[i]] * scale);
+        }
+    }
+}
+
+static struct perf_region_stats *
+perf_region_find(struct perf_region_thread *thread, const char *name)
+{
+    for (size_t i = 0; i < thread->n_regions; ++i)
+    {
+        if (thread->regions[i].name == name || strcmp(thread->regions[i].name, name) == 0)
+        {
+            return &thread->regions[i];
+        }
+    }
+    if (thread->n_regions == PERF_REGION_MAX)
+    {
+        return NULL;
+    }
+    struct perf_region_stats *stats = &thread->regions[thread->n_regions++];
+    stats->name = name;
+    return stats;
+}
+
+/* Start region <name> on the calling thread. <name> must stay valid until
+ * the last report. */
+static inline void
+perf_region_begin(const char *name)
+{
+    if (__builtin_expect(__atomic_load_n(&perf_region_state.enabled, __ATOMIC_RELAXED) == 0, 1))
+    {
+        return;
+    }
+    struct perf_region_thread *thread = perf_region_self();
+    if (thread == NULL)
+    {
+        return;
+    }
+    assert(thread->depth < PERF_REGION_DEPTH);
+    struct perf_region_frame *frame = &thread->stack[thread->depth++];
+    frame->stats = perf_region_find(thread, name);
+    frame->start = perf_region_now();
+    perf_region_read(thread, frame->counts);
+}
+
+/* End region <name>, which must be the innermost open region of the calling
+ * thread, and add its counts to the region's totals. */
+static inline void
+perf_region_end(const char *name)
+{
+    if (__builtin_expect(__atomic_load_n(&perf_region_state.enabled, __ATOMIC_RELAXED) == 0, 1))
+    {
+        return;
+    }
+    struct perf_region_thread *thread = perf_region_self();
+    if (thread == NULL)
+    {
+        return;
+    }
+    uint64_t counts[PERF_REGION_EVENTS];
+    perf_region_read(thread, counts);
+    double end = perf_region_now();
+    assert(thread->depth > 0);
+    struct perf_region_frame *frame = &thread->stack[--thread->depth];
+    (void)name;
+    if (frame->stats == NULL)
+    {
+        return;
+    }
+    assert(strcmp(frame->stats->name, name) == 0);
+    frame->stats->calls += 1;
+    frame->stats->seconds += end - frame->start;
+    for (int i = 0; i < PERF_REGION_EVENTS; ++i)
+    {
+        frame->stats->counts[i] += counts[i] - frame->counts[i];
+    }
+}
+
+/* Print every thread's region totals to <out>. Threads should not be inside
+ * regions meanwhile, or their latest counts may be partly missing. */
+static void
+perf_region_report(FILE *out)
+{
+    if (__atomic_load_n(&perf_region_state.enabled, __ATOMIC_RELAXED) <= 0)
+    {
+        return;
+    }
+    int error = __atomic_load_n(&perf_region_state.error, __ATOMIC_RELAXED);
+    if (error)
+    {
+        fprintf(out, "perf regions: some counters are unavailable (%s); they are shown as -\n", strerror(error));
+    }
+    fprintf(out, "%-8s %-20s %10s %10s", "thread", "region", "calls", "seconds");
+    for (int i = 0; i < PERF_REGION_EVENTS; ++i)
+    {
+        fprintf(out, " %14s", perf_region_events[i].name);
+    }
+    fprintf(out, " %6s\n", "IPC");
+    for (const struct perf_region_thread *thread = __atomic_load_n(&perf_region_state.threads, __ATOMIC_ACQUIRE);
+         thread; thread = thread->next)
+    {
+        for (size_t r = 0; r < thread->n_regions; ++r)
+        {
+            const struct perf_region_stats *stats = &thread->regions[r];
+            fprintf(out, "%-8ld %-20s %10" PRIu64 " %10.6f", thread->tid, stats->name, stats->calls,
+                    stats->seconds);
+            for (int i = 0; i < PERF_REGION_EVENTS; ++i)
+            {
+                if (thread->slot[i] >= 0)
+                {
+                    fprintf(out, " %14" PRIu64, stats->counts[i]);
+                }
+                else
+                {
+                    fprintf(out, " %14s", "-");
+                }
+            }
+            if (thread->slot[PERF_REGION_CYCLES] >= 0 && thread->slot[PERF_REGION_INSTRUCTIONS] >= 0
+                && stats->counts[PERF_REGION_CYCLES])
+            {
+                fprintf(out, " %6.2f\n",
+                        (double)stats->counts[PERF_REGION_INSTRUCTIONS] / stats->counts[PERF_REGION_CYCLES]);
+            }
+            else
+            {
+                fprintf(out, " %6s\n", "-");
+            }
+        }
+    }
+    fflush(out);
+}
+
+#endif
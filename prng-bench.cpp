@@ -0,0 +1,106 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/* Benchmark of the thread-local PRNG in prng.h against rand() and a shared
+ * std::mt19937, generating bounded integers from 1..N threads. */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "prng.h"
+
+static const uint32_t range = 1000;
+
+/* Keeps results alive so the generator calls are not optimised away. */
+static std::atomic<uint64_t> g_sink(0);
+
+/*
+ * Call <generate>, which produces <per_call> numbers, <count> times from each of
+ * <nthreads> threads and print the throughput.
+ */
+template <typename Generate>
+static void
+bench_generator(const char *name, unsigned nthreads, long count, Generate generate, long per_call = 1)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < nthreads; ++t)
+    {
+        threads.emplace_back([count, &generate]() {
+            uint64_t sum = 0;
+            for (long i = 0; i < count; ++i)
+            {
+                sum += generate();
+            }
+            g_sink += sum;
+        });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    double total = static_cast<double>(nthreads) * count * per_call;
+    std::cout << name << ": threads=" << nthreads
+              << " ns/number=" << elapsed.count() * 1e9 / total * nthreads
+              << " numbers/sec=" << static_cast<long>(total / elapsed.count()) << "\n";
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned max_threads = argc > 1 ? strtoul(argv[1], NULL, 10) : std::thread::hardware_concurrency();
+    long count = argc > 2 ? strtol(argv[2], NULL, 10) : 10000000;
+    if (argc > 3 || !max_threads || count <= 0)
+    {
+        std::cerr << "Usage: " << argv[0] << " [MAX_THREADS [NUMBERS_PER_THREAD]]\n";
+        return EXIT_FAILURE;
+    }
+
+    for (unsigned nthreads = 1; nthreads <= max_threads; ++nthreads)
+    {
+        bench_generator("rand()            ", nthreads, count, []() {
+            return static_cast<uint32_t>(rand()) % range;
+        });
+
+        /* A shared generator needs a lock to be used from several threads. */
+        std::mt19937 mt;
+        std::uniform_int_distribution<uint32_t> distribution(0, range - 1);
+        std::mutex mt_mutex;
+        bench_generator("shared mt19937    ", nthreads, count, [&]() {
+            const std::lock_guard<std::mutex> lock(mt_mutex);
+            return distribution(mt);
+        });
+
+        bench_generator("thread_local mt   ", nthreads, count, []() {
+            static thread_local std::mt19937 local_mt;
+            static thread_local std::uniform_int_distribution<uint32_t> local_dist(0, range - 1);
+            return local_dist(local_mt);
+        });
+
+        bench_generator("prng_bounded()    ", nthreads, count, []() {
+            return prng_bounded(range);
+        });
+
+        /* Bulk API: amortise the call over a block of numbers. */
+        bench_generator("prng_fill_bounded ", nthreads, count / 256, []() {
+            uint32_t block[256];
+            prng_fill_bounded(block, 256, range);
+            uint64_t sum = 0;
+            for (uint32_t x : block)
+            {
+                sum += x;
+            }
+            return sum;
+        }, 256);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,135 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/* Fast thread-local pseudo-random number generator for the stress tests.
+ *
+ * Each thread has its own xoshiro256** generator, so unlike rand(), random()
+ * or a shared std::mt19937 there is no lock and no data race. A thread that
+ * does not call prng_seed() is seeded deterministically from the order in
+ * which threads first use the generator, so single-threaded programs get a
+ * reproducible sequence by default.
+ *
+ * Usable from both C and C++. */
+
+#ifndef PRNG_H
+#define PRNG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct prng_state
+{
+    uint64_t s[4];
+    int seeded;
+};
+
+static __thread struct prng_state prng_tls;
+
+/* Counts threads that seeded themselves implicitly. */
+static uint64_t prng_implicit_seeds;
+
+static inline uint64_t
+prng_splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+/* Return element <index> of the random stream <key>. This is the counter-based
+ * form of splitmix64 (the result is the (index + 1)th output of
+ * prng_splitmix64() started from <key>), so any part of a stream can be
+ * generated independently, in any order and on any thread. */
+static inline uint64_t
+prng_at(uint64_t key, uint64_t index)
+{
+    uint64_t x = key + index * 0x9e3779b97f4a7c15ull;
+    return prng_splitmix64(&x);
+}
+
+/* Seed the calling thread's generator. */
+static inline void
+prng_seed(uint64_t seed)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        prng_tls.s[i] = prng_splitmix64(&seed);
+    }
+    prng_tls.seeded = 1;
+}
+
+static inline uint64_t
+prng_rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+/* Return 64 uniformly distributed random bits. */
+static inline uint64_t
+prng_next(void)
+{
+    uint64_t *s = prng_tls.s;
+    if (__builtin_expect(!prng_tls.seeded, 0))
+    {
+        prng_seed(__atomic_fetch_add(&prng_implicit_seeds, 1, __ATOMIC_RELAXED));
+    }
+    uint64_t result = prng_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = prng_rotl(s[3], 45);
+    return result;
+}
+
+/* Return an unbiased random integer in [0, range), which must be non-zero.
+ * Uses Lemire's multiply-and-reject method, which needs a division only in
+ * the rare case that the first candidate falls in the biased region. */
+static inline uint32_t
+prng_bounded(uint32_t range)
+{
+    uint64_t m = (prng_next() >> 32) * range;
+    uint32_t low = (uint32_t)m;
+    if (__builtin_expect(low < range, 0))
+    {
+        uint32_t threshold = -range % range;
+        while (low < threshold)
+        {
+            m = (prng_next() >> 32) * range;
+            low = (uint32_t)m;
+        }
+    }
+    return (uint32_t)(m >> 32);
+}
+
+/* Return a random double in [0, 1). */
+static inline double
+prng_double(void)
+{
+    return (prng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Fill <out> with <n> words of random bits. */
+static inline void
+prng_fill(uint64_t *out, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        out[i] = prng_next();
+    }
+}
+
+/* Fill <out> with <n> unbiased random integers in [0, range). */
+static inline void
+prng_fill_bounded(uint32_t *out, size_t n, uint32_t range)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        out[i] = prng_bounded(range);
+    }
+}
+
+#endif
@@ -1,15 +1,26 @@
 /* This is free and unencumbered software released into the public domain.
  * Refer to LICENSE.txt in this directory. */
 
-/* Program demonstrating a race condition caused by unsafe concurrent memory access. */
+/* Program demonstrating a race condition caused by unsafe concurrent memory access.
+ *
+ * Run as `race bench [MAX_THREADS [INCREMENTS]]` to instead compare safe ways of
+ * counting from many threads: a mutex-protected int, a std::atomic fetch_add,
+ * and a ShardedCounter, reporting increments/sec for 1..MAX_THREADS threads. */
 
 #include <assert.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
 #include <mutex>
-#include <random>
 #include <thread>
+#include <vector>
+
+#include "prng.h"
+#include "sharded-counter.h"
 
 /*
  * Returns a random integer in the range [0, max]
@@ -17,11 +28,7 @@
 static int
 random_int(int max)
 {
-    static std::random_device rd;
-    static std::mt19937 generator(rd());
-    static std::uniform_int_distribution<int> distribution(0, max);
-
-    return distribution(generator);
+    return static_cast<int>(prng_bounded(max + 1));
 }
 
 static int g_value = 0;
@@ -64,9 +71,85 @@ threadfn2()
     }
 }
 
+/*
+ * Increment a counter <increments> times from each of <nthreads> threads using
+ * <increment>, check the total with <read>, and print increments/sec.
+ */
+template <typename Increment, typename Read>
+static void
+bench_mode(const char *name, unsigned nthreads, long increments, Increment increment, Read read)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < nthreads; ++t)
+    {
+        threads.emplace_back([increments, &increment]() {
+            for (long i = 0; i < increments; ++i)
+            {
+                increment();
+            }
+        });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    long total = read();
+    assert(total == nthreads * increments);
+    (void)total;
+    std::cout << name << ": threads=" << nthreads
+              << " increments/sec=" << static_cast<long>(nthreads * increments / elapsed.count())
+              << "\n";
+}
+
+static int
+bench(unsigned max_threads, long increments)
+{
+    for (unsigned nthreads = 1; nthreads <= max_threads; ++nthreads)
+    {
+        long value = 0;
+        std::mutex mutex;
+        bench_mode(
+            "mutex  ", nthreads, increments,
+            [&value, &mutex]() {
+                const std::lock_guard<std::mutex> lock(mutex);
+                ++value;
+            },
+            [&value]() { return value; });
+
+        std::atomic<long> atomic_value(0);
+        bench_mode(
+            "atomic ", nthreads, increments,
+            [&atomic_value]() { atomic_value.fetch_add(1); },
+            [&atomic_value]() { return atomic_value.load(); });
+
+        ShardedCounter sharded;
+        bench_mode(
+            "sharded", nthreads, increments,
+            [&sharded]() { sharded.add(1); },
+            [&sharded]() { return sharded.read(); });
+    }
+    return EXIT_SUCCESS;
+}
+
 int
-main()
+main(int argc, char **argv)
 {
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+    {
+        unsigned max_threads = argc > 2 ? strtoul(argv[2], NULL, 10)
+                                        : ShardedCounter::default_shards();
+        long increments = argc > 3 ? strtol(argv[3], NULL, 10) : 1000000;
+        if (argc > 4 || !max_threads || increments <= 0)
+        {
+            std::cerr << "Usage: " << argv[0] << " [bench [MAX_THREADS [INCREMENTS]]]\n";
+            return EXIT_FAILURE;
+        }
+        return bench(max_threads, increments);
+    }
+
     std::thread t1(threadfn1);
     std::thread t2(threadfn1);
     std::thread t3(threadfn2);
@@ -0,0 +1,77 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/* Counter for many concurrent writers and occasional readers (C++ only). */
+
+#ifndef SHARDED_COUNTER_H
+#define SHARDED_COUNTER_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <thread>
+
+/*
+ * Counter split into per-thread slots, each on its own cache line, so that
+ * concurrent add() calls from different threads do not share a line. add() is a
+ * relaxed atomic increment of the calling thread's slot; read() sums all the
+ * slots. read() is not a snapshot: increments racing with it may or may not be
+ * counted, but once all writers have been joined it is exact.
+ *
+ * Threads are assigned slots round-robin, so with more threads than shards
+ * some threads share a slot; that is still correct, just slower.
+ */
+class ShardedCounter
+{
+public:
+    explicit ShardedCounter(size_t shards = default_shards())
+        : n_shards(shards ? shards : 1), slots(new Slot[n_shards])
+    {
+    }
+
+    void add(long delta)
+    {
+        slots[thread_index() % n_shards].value.fetch_add(delta, std::memory_order_relaxed);
+    }
+
+    long read() const
+    {
+        long sum = 0;
+        for (size_t i = 0; i < n_shards; ++i)
+        {
+            sum += slots[i].value.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    static size_t default_shards()
+    {
+        unsigned n = std::thread::hardware_concurrency();
+        return n ? n : 1;
+    }
+
+private:
+    static const size_t cache_line = 64;
+
+    /* Padded rather than aligned: operator new[] only guarantees alignment for
+     * over-aligned types from C++17. Every slot's value sits at the same offset
+     * within a cache-line-sized stride, so no two values share a line. */
+    struct Slot
+    {
+        Slot() : value(0) {}
+        std::atomic<long> value;
+        char pad[cache_line - sizeof(std::atomic<long>)];
+    };
+
+    static size_t thread_index()
+    {
+        static std::atomic<size_t> next_index(0);
+        static thread_local size_t index = next_index.fetch_add(1, std::memory_order_relaxed);
+        return index;
+    }
+
+    const size_t n_shards;
+    std::unique_ptr<Slot[]> slots;
+};
+
+#endif
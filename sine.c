@@ -1,21 +1,46 @@
 /* This is free and unencumbered software released into the public domain.
  * Refer to LICENSE.txt in this directory. */
 
-/* Randomized stress test of sin(x). */
+/* sin(x) for floats, as a scalar sine() and a vectorized sine_batch(), with
+ * tests and benchmarks for both.
+ *
+ *     sine ITERATIONS SEED       check sine() against sinf() on random
+ *                                inputs, logging each result
+ *     sine --exhaustive          check sine() or sine_batch() against
+ *     sine --batch-exhaustive    sinf() on all 2^32 inputs and print an
+ *                                ulp-error histogram
+ *     sine --reduce-bench        time the argument reduction
+ *     sine --log-bench           time the logger against stdio
+ *
+ * SINE_BATCH_ISA selects the sine_batch() implementation and SINE_LOG_COARSE
+ * a coarse clock for log timestamps. */
 
 #include <assert.h>
+#include <fcntl.h>
+#include <float.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
+#include <unistd.h>
 
-/* Write timestamp and formatted message to stdout. */
+#include "logger.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SINE_BATCH_X86 1
+#endif
+
+/* Write timestamp and formatted message to stdout with stdio. This was the
+ * logger before logger.h and is kept as the baseline for --log-bench. */
 static void __attribute__((format(printf, 1, 2)))
-log_message(const char *format, ...)
+log_message_stdio(const char *format, ...)
 {
     struct timeval tv;
     ssize_t e = gettimeofday(&tv, NULL);
@@ -32,18 +57,143 @@ log_message(const char *format, ...)
     putchar('\n');
 }
 
+/* Argument reduction: reduce_pio2(x, &r) returns n mod 4 and sets r such that
+ * x = n * pi/2 + r with |r| <= pi/4 (to within rounding).
+ *
+ * Below REDUCE_FAST_BOUND this is Cody-Waite: n is the nearest integer to
+ * x * 2/pi, and r = x - n * pi/2 is computed with pi/2 split into a 33-bit head
+ * (so that n * head is exact for |n| < 2^20), a 33-bit middle part and a tail.
+ *
+ * Above it, reduce_large() is Payne-Hanek: with x = M * 2^E for an integer M,
+ * only the bits of 2/pi from about position E onwards affect x * 2/pi mod 4,
+ * so a 128-bit window of them is multiplied by M in integer arithmetic. This
+ * is exact enough for every float up to FLT_MAX (see K. C. Ng (1993),
+ * "Argument reduction for huge arguments"), but an order of magnitude slower,
+ * so common small inputs never take it. */
+#define REDUCE_FAST_BOUND 0x1p20
+
+static const double two_over_pi = 6.36619772367581382433e-01;
+static const double pio2 = 1.57079632679489655800e+00;
+static const double pio2_1 = 1.57079632673412561417e+00;  /* First 33 bits of pi/2. */
+static const double pio2_2 = 6.07710050630396597660e-11;  /* Next 33 bits of pi/2. */
+static const double pio2_2t = 2.02226624879595063154e-21; /* pi/2 - (pio2_1 + pio2_2). */
+
+/* Adding and subtracting this rounds |v| < 2^51 to the nearest integer, and
+ * leaves the low bits of that integer in the low mantissa bits of the sum. */
+static const double round_magic = 0x1.8p52;
+
+/* The first 384 bits of the binary expansion of 2/pi. */
+static const uint32_t two_over_pi_bits[] = {
+    0xa2f9836e, 0x4e441529, 0xfc2757d1, 0xf534ddc0, 0xdb629599, 0x3c439041,
+    0xfe5163ab, 0xdebbc561, 0xb7246e3a, 0x424dd2e0, 0x06492eea, 0x09d1921c,
+};
+
+__extension__ typedef unsigned __int128 uint128_t;
+__extension__ typedef __int128 int128_t;
+
+/* Cody-Waite reduction for |x| < REDUCE_FAST_BOUND. */
+static unsigned
+reduce_fast(double x, double *r)
+{
+    double m = x * two_over_pi + round_magic;
+    double n = m - round_magic;
+    union
+    {
+        double d;
+        uint64_t u;
+    } bits = { .d = m };
+    *r = ((x - n * pio2_1) - n * pio2_2) - n * pio2_2t;
+    return bits.u & 3;
+}
+
+/* Return the 32 bits of 2/pi after the binary point starting at bit p
+ * (0-based), where bits before the binary point (p < 0) are zero. */
+static uint32_t
+two_over_pi_bits32(int p)
+{
+    if (p <= -32)
+    {
+        return 0;
+    }
+    if (p < 0)
+    {
+        return two_over_pi_bits[0] >> -p;
+    }
+    int w = p / 32, s = p % 32;
+    assert(w + 1 < (int)(sizeof two_over_pi_bits / sizeof two_over_pi_bits[0]));
+    return s ? (two_over_pi_bits[w] << s) | (two_over_pi_bits[w + 1] >> (32 - s))
+             : two_over_pi_bits[w];
+}
+
+/* Payne-Hanek reduction for finite |x| >= REDUCE_FAST_BOUND. */
+static unsigned
+reduce_large(float x, double *r)
+{
+    union
+    {
+        float f;
+        uint32_t u;
+    } bits = { .f = x };
+    uint64_t m = (bits.u & 0x7fffff) | 0x800000;
+    int e = (int)((bits.u >> 23) & 0xff) - 150; /* |x| = m * 2^e */
+
+    /* Bits of 2/pi before p contribute multiples of 4 to |x| * 2/pi and can
+     * be dropped; the next 128 bits give m * window = |x| * 2/pi * 2^124. */
+    int p = e - 4;
+    uint128_t window = (uint128_t)two_over_pi_bits32(p) << 96
+                       | (uint128_t)two_over_pi_bits32(p + 32) << 64
+                       | (uint128_t)two_over_pi_bits32(p + 64) << 32
+                       | two_over_pi_bits32(p + 96);
+    uint128_t product = (m * window) & (((uint128_t)1 << 126) - 1); /* mod 4 */
+
+    /* Split into the nearest integer n and a fraction in [-1/2, 1/2). */
+    unsigned n = (unsigned)((product + ((uint128_t)1 << 123)) >> 124);
+    int128_t fraction = (int128_t)(product - ((uint128_t)n << 124));
+
+    /* Normalise so that the conversion to double keeps 64 significant bits. */
+    uint128_t magnitude = fraction < 0 ? -(uint128_t)fraction : (uint128_t)fraction;
+    double f = 0.0;
+    if (magnitude)
+    {
+        uint64_t hi = (uint64_t)(magnitude >> 64);
+        int shift = hi ? __builtin_clzll(hi) : 64 + __builtin_clzll((uint64_t)magnitude);
+        f = ldexp((double)(uint64_t)((magnitude << shift) >> 64), 64 - 124 - shift);
+    }
+    if (fraction < 0)
+    {
+        f = -f;
+    }
+    *r = f * pio2;
+    if (x < 0)
+    {
+        *r = -*r;
+        n = -n;
+    }
+    return n & 3;
+}
+
+/* Reduce finite x to r in about [-pi/4, pi/4]; return the quadrant mod 4. */
+static unsigned
+reduce_pio2(float x, double *r)
+{
+    if (fabsf(x) < REDUCE_FAST_BOUND)
+    {
+        return reduce_fast(x, r);
+    }
+    return reduce_large(x, r);
+}
+
 /* Compute sin(x) using a Taylor series. */
 static float
 sine(float x)
 {
-    /* This is not the right way to do argument reduction! See K. C. Ng (1993),
-     * "Argument reduction for huge arguments". */
-    double halfpi = 1.5707963267948966;
-    double n = round(x / halfpi);
-    double r = x - n * halfpi;
-    int m = (int)fmod(n, 4.0f);
-    if (m < 0) m += 4;
-    assert(0 <= m && m < 4);
+    if (!isfinite(x))
+    {
+        return x - x; /* NaN for infinities and NaNs, like sinf(). */
+    }
+
+    double r;
+    unsigned m = reduce_pio2(x, &r);
 
     /* Taylor series */
     double t = 1.0;
@@ -71,6 +221,305 @@ sine(float x)
     return (float)a;
 }
 
+/* Batch sine: sine_batch(x, y, n) sets y[i] = sin(x[i]) to within 1 ulp of
+ * sinf() for every float input.
+ *
+ * Arguments are widened to double and reduced as in reduce_fast(). sin(r) or
+ * cos(r), chosen and negated according to the quadrant, is then evaluated with
+ * fixed-degree minimax polynomials on [-pi/4, pi/4] (FreeBSD's __kernel_sindf
+ * and __kernel_cosdf), so every input costs the same and there are no
+ * data-dependent loops. Inputs too large for the fast reduction, and
+ * infinities and NaNs, are handled by a scalar fallback using reduce_large().
+ *
+ * SSE2, AVX2 and AVX-512 versions are selected at runtime; the environment
+ * variable SINE_BATCH_ISA (scalar, sse2, avx2 or avx512) overrides the choice
+ * for testing. */
+
+/* |sin(x)/x - s(x)| < 2**-37.5 on [-pi/4, pi/4]. */
+static const double sin_s1 = -0x15555554cbac77.0p-55;
+static const double sin_s2 = 0x111110896efbb2.0p-59;
+static const double sin_s3 = -0x1a00f9e2cae774.0p-65;
+static const double sin_s4 = 0x16cd878c3b46a7.0p-71;
+
+/* |cos(x) - c(x)| < 2**-34.1 on [-pi/4, pi/4]. */
+static const double cos_c0 = -0x1ffffffd0c5e81.0p-54;
+static const double cos_c1 = 0x155553e1053a42.0p-57;
+static const double cos_c2 = -0x16c087e80f1e27.0p-62;
+static const double cos_c3 = 0x199342e0ee5069.0p-68;
+
+/* Evaluate sin(r + q * pi/2) for |r| <= pi/4 with the minimax polynomials. */
+static float
+sine_kernel(double r, unsigned q)
+{
+    double z = r * r;
+    double w = z * z;
+    double y;
+    if (q & 1)
+    {
+        y = ((1.0 + z * cos_c0) + w * cos_c1) + (w * z) * (cos_c2 + z * cos_c3);
+    }
+    else
+    {
+        double s = z * r;
+        y = (r + s * (sin_s1 + z * sin_s2)) + s * w * (sin_s3 + z * sin_s4);
+    }
+    return (float)(q & 2 ? -y : y);
+}
+
+/* Compute sin(x) for large, infinite or NaN x. */
+static float
+sine_batch_fallback(float x)
+{
+    if (!isfinite(x))
+    {
+        return x - x;
+    }
+    double r;
+    unsigned q = reduce_large(x, &r);
+    return sine_kernel(r, q);
+}
+
+/* Scalar version of the vector algorithm, for the remainder of a batch and
+ * for machines without SIMD support. */
+static float
+sine_batch1(float x)
+{
+    if (!(fabsf(x) < REDUCE_FAST_BOUND))
+    {
+        return sine_batch_fallback(x);
+    }
+    double r;
+    unsigned q = reduce_fast(x, &r);
+    return sine_kernel(r, q);
+}
+
+static void
+sine_batch_scalar(const float *x, float *y, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        y[i] = sine_batch1(x[i]);
+    }
+}
+
+#ifdef SINE_BATCH_X86
+
+/* Lanes [0, lanes) of y need the fallback if bit i of <big> is set. */
+static void
+sine_batch_fixup(const float *x, float *y, unsigned big, unsigned lanes)
+{
+    for (unsigned i = 0; i < lanes; ++i)
+    {
+        if (big & (1u << i))
+        {
+            y[i] = sine_batch_fallback(x[i]);
+        }
+    }
+}
+
+__attribute__((target("sse2"))) static void
+sine_batch_sse2(const float *x, float *y, size_t n)
+{
+    const __m128d abs_mask = _mm_castsi128_pd(_mm_set1_epi64x(INT64_MAX));
+    const __m128d sign_mask = _mm_castsi128_pd(_mm_set1_epi64x(INT64_MIN));
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128d xd = _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)(x + i))));
+        /* NaNs compare not-less-than, so they take the fallback too. */
+        __m128d big = _mm_cmpnlt_pd(_mm_and_pd(xd, abs_mask), _mm_set1_pd(REDUCE_FAST_BOUND));
+
+        __m128d m = _mm_add_pd(_mm_mul_pd(xd, _mm_set1_pd(two_over_pi)), _mm_set1_pd(round_magic));
+        __m128d k = _mm_sub_pd(m, _mm_set1_pd(round_magic));
+        __m128i q = _mm_castpd_si128(m);
+
+        __m128d r = _mm_sub_pd(xd, _mm_mul_pd(k, _mm_set1_pd(pio2_1)));
+        r = _mm_sub_pd(r, _mm_mul_pd(k, _mm_set1_pd(pio2_2)));
+        r = _mm_sub_pd(r, _mm_mul_pd(k, _mm_set1_pd(pio2_2t)));
+        __m128d z = _mm_mul_pd(r, r);
+        __m128d w = _mm_mul_pd(z, z);
+
+        __m128d c = _mm_add_pd(_mm_set1_pd(1.0), _mm_mul_pd(z, _mm_set1_pd(cos_c0)));
+        c = _mm_add_pd(c, _mm_mul_pd(w, _mm_set1_pd(cos_c1)));
+        c = _mm_add_pd(c, _mm_mul_pd(_mm_mul_pd(w, z),
+                                     _mm_add_pd(_mm_set1_pd(cos_c2),
+                                                _mm_mul_pd(z, _mm_set1_pd(cos_c3)))));
+
+        __m128d s = _mm_mul_pd(z, r);
+        __m128d sn = _mm_add_pd(r, _mm_mul_pd(s, _mm_add_pd(_mm_set1_pd(sin_s1),
+                                                           _mm_mul_pd(z, _mm_set1_pd(sin_s2)))));
+        sn = _mm_add_pd(sn, _mm_mul_pd(_mm_mul_pd(s, w),
+                                       _mm_add_pd(_mm_set1_pd(sin_s3),
+                                                  _mm_mul_pd(z, _mm_set1_pd(sin_s4)))));
+
+        /* Bit 0 of q selects cos, bit 1 negates. */
+        __m128i odd = _mm_shuffle_epi32(_mm_srai_epi32(_mm_slli_epi64(q, 63), 31),
+                                        _MM_SHUFFLE(3, 3, 1, 1));
+        __m128d sel = _mm_castsi128_pd(odd);
+        __m128d res = _mm_or_pd(_mm_and_pd(sel, c), _mm_andnot_pd(sel, sn));
+        res = _mm_xor_pd(res, _mm_and_pd(_mm_castsi128_pd(_mm_slli_epi64(q, 62)), sign_mask));
+
+        _mm_storel_epi64((__m128i *)(y + i), _mm_castps_si128(_mm_cvtpd_ps(res)));
+        unsigned bigmask = _mm_movemask_pd(big);
+        if (bigmask)
+        {
+            sine_batch_fixup(x + i, y + i, bigmask, 2);
+        }
+    }
+    sine_batch_scalar(x + i, y + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+sine_batch_avx2(const float *x, float *y, size_t n)
+{
+    const __m256d abs_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(INT64_MAX));
+    const __m256d sign_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(INT64_MIN));
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256d xd = _mm256_cvtps_pd(_mm_loadu_ps(x + i));
+        __m256d big = _mm256_cmp_pd(_mm256_and_pd(xd, abs_mask), _mm256_set1_pd(REDUCE_FAST_BOUND),
+                                    _CMP_NLT_UQ);
+
+        __m256d m = _mm256_add_pd(_mm256_mul_pd(xd, _mm256_set1_pd(two_over_pi)),
+                                  _mm256_set1_pd(round_magic));
+        __m256d k = _mm256_sub_pd(m, _mm256_set1_pd(round_magic));
+        __m256i q = _mm256_castpd_si256(m);
+
+        __m256d r = _mm256_sub_pd(xd, _mm256_mul_pd(k, _mm256_set1_pd(pio2_1)));
+        r = _mm256_sub_pd(r, _mm256_mul_pd(k, _mm256_set1_pd(pio2_2)));
+        r = _mm256_sub_pd(r, _mm256_mul_pd(k, _mm256_set1_pd(pio2_2t)));
+        __m256d z = _mm256_mul_pd(r, r);
+        __m256d w = _mm256_mul_pd(z, z);
+
+        __m256d c = _mm256_add_pd(_mm256_set1_pd(1.0), _mm256_mul_pd(z, _mm256_set1_pd(cos_c0)));
+        c = _mm256_add_pd(c, _mm256_mul_pd(w, _mm256_set1_pd(cos_c1)));
+        c = _mm256_add_pd(c, _mm256_mul_pd(_mm256_mul_pd(w, z),
+                                           _mm256_add_pd(_mm256_set1_pd(cos_c2),
+                                                         _mm256_mul_pd(z, _mm256_set1_pd(cos_c3)))));
+
+        __m256d s = _mm256_mul_pd(z, r);
+        __m256d sn = _mm256_add_pd(r, _mm256_mul_pd(s, _mm256_add_pd(_mm256_set1_pd(sin_s1),
+                                                                     _mm256_mul_pd(z, _mm256_set1_pd(sin_s2)))));
+        sn = _mm256_add_pd(sn, _mm256_mul_pd(_mm256_mul_pd(s, w),
+                                             _mm256_add_pd(_mm256_set1_pd(sin_s3),
+                                                           _mm256_mul_pd(z, _mm256_set1_pd(sin_s4)))));
+
+        __m256d sel = _mm256_castsi256_pd(_mm256_slli_epi64(q, 63));
+        __m256d res = _mm256_blendv_pd(sn, c, sel);
+        res = _mm256_xor_pd(res, _mm256_and_pd(_mm256_castsi256_pd(_mm256_slli_epi64(q, 62)),
+                                               sign_mask));
+
+        _mm_storeu_ps(y + i, _mm256_cvtpd_ps(res));
+        unsigned bigmask = _mm256_movemask_pd(big);
+        if (bigmask)
+        {
+            sine_batch_fixup(x + i, y + i, bigmask, 4);
+        }
+    }
+    sine_batch_scalar(x + i, y + i, n - i);
+}
+
+__attribute__((target("avx512f"))) static void
+sine_batch_avx512(const float *x, float *y, size_t n)
+{
+    const __m512i abs_mask = _mm512_set1_epi64(INT64_MAX);
+    const __m512i sign_mask = _mm512_set1_epi64(INT64_MIN);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m512d xd = _mm512_cvtps_pd(_mm256_loadu_ps(x + i));
+        __m512d ax = _mm512_castsi512_pd(_mm512_and_si512(_mm512_castpd_si512(xd), abs_mask));
+        __mmask8 big = _mm512_cmp_pd_mask(ax, _mm512_set1_pd(REDUCE_FAST_BOUND), _CMP_NLT_UQ);
+
+        __m512d m = _mm512_add_pd(_mm512_mul_pd(xd, _mm512_set1_pd(two_over_pi)),
+                                  _mm512_set1_pd(round_magic));
+        __m512d k = _mm512_sub_pd(m, _mm512_set1_pd(round_magic));
+        __m512i q = _mm512_castpd_si512(m);
+
+        __m512d r = _mm512_sub_pd(xd, _mm512_mul_pd(k, _mm512_set1_pd(pio2_1)));
+        r = _mm512_sub_pd(r, _mm512_mul_pd(k, _mm512_set1_pd(pio2_2)));
+        r = _mm512_sub_pd(r, _mm512_mul_pd(k, _mm512_set1_pd(pio2_2t)));
+        __m512d z = _mm512_mul_pd(r, r);
+        __m512d w = _mm512_mul_pd(z, z);
+
+        __m512d c = _mm512_add_pd(_mm512_set1_pd(1.0), _mm512_mul_pd(z, _mm512_set1_pd(cos_c0)));
+        c = _mm512_add_pd(c, _mm512_mul_pd(w, _mm512_set1_pd(cos_c1)));
+        c = _mm512_add_pd(c, _mm512_mul_pd(_mm512_mul_pd(w, z),
+                                           _mm512_add_pd(_mm512_set1_pd(cos_c2),
+                                                         _mm512_mul_pd(z, _mm512_set1_pd(cos_c3)))));
+
+        __m512d s = _mm512_mul_pd(z, r);
+        __m512d sn = _mm512_add_pd(r, _mm512_mul_pd(s, _mm512_add_pd(_mm512_set1_pd(sin_s1),
+                                                                     _mm512_mul_pd(z, _mm512_set1_pd(sin_s2)))));
+        sn = _mm512_add_pd(sn, _mm512_mul_pd(_mm512_mul_pd(s, w),
+                                             _mm512_add_pd(_mm512_set1_pd(sin_s3),
+                                                           _mm512_mul_pd(z, _mm512_set1_pd(sin_s4)))));
+
+        __mmask8 odd = _mm512_test_epi64_mask(q, _mm512_set1_epi64(1));
+        __m512i res = _mm512_castpd_si512(_mm512_mask_blend_pd(odd, sn, c));
+        res = _mm512_xor_si512(res, _mm512_and_si512(_mm512_slli_epi64(q, 62), sign_mask));
+
+        _mm256_storeu_ps(y + i, _mm512_cvtpd_ps(_mm512_castsi512_pd(res)));
+        if (big)
+        {
+            sine_batch_fixup(x + i, y + i, big, 8);
+        }
+    }
+    sine_batch_scalar(x + i, y + i, n - i);
+}
+
+#endif /* SINE_BATCH_X86 */
+
+typedef void sine_batch_fn(const float *x, float *y, size_t n);
+
+static sine_batch_fn *
+sine_batch_select(const char **name)
+{
+    const char *isa = getenv("SINE_BATCH_ISA");
+#ifdef SINE_BATCH_X86
+    __builtin_cpu_init();
+    if ((!isa || !strcmp(isa, "avx512")) && __builtin_cpu_supports("avx512f"))
+    {
+        *name = "avx512";
+        return sine_batch_avx512;
+    }
+    if ((!isa || !strcmp(isa, "avx2")) && __builtin_cpu_supports("avx2"))
+    {
+        *name = "avx2";
+        return sine_batch_avx2;
+    }
+    if ((!isa || !strcmp(isa, "sse2")) && __builtin_cpu_supports("sse2"))
+    {
+        *name = "sse2";
+        return sine_batch_sse2;
+    }
+#else
+    (void)isa;
+#endif
+    *name = "scalar";
+    return sine_batch_scalar;
+}
+
+/* Implementation chosen for this machine on the first call. */
+static sine_batch_fn *sine_batch_impl;
+static const char *sine_batch_isa;
+
+/* Compute y[i] = sin(x[i]) for i in [0, n). */
+static void
+sine_batch(const float *x, float *y, size_t n)
+{
+    sine_batch_fn *impl = __atomic_load_n(&sine_batch_impl, __ATOMIC_ACQUIRE);
+    if (!impl)
+    {
+        const char *name;
+        impl = sine_batch_select(&name);
+        sine_batch_isa = name;
+        __atomic_store_n(&sine_batch_impl, impl, __ATOMIC_RELEASE);
+    }
+    impl(x, y, n);
+}
+
 /* Check sine() against libc sinf() and log pass/fail. */
 static void
 check(float x)
@@ -80,13 +529,436 @@ check(float x)
     log_message("%s x=%g sinf=%f sine=%f", s1 == s2 ? "pass" : "fail", x, s1, s2);
 }
 
-/* Randomized oracle test. */
+/* Map a float to an integer such that adjacent floats map to adjacent
+ * integers, so that subtracting ordinals counts ulps. */
+static int64_t
+float_ordinal(float f)
+{
+    union
+    {
+        float f;
+        int32_t i;
+    } u = { .f = f };
+    return u.i < 0 ? (int64_t)INT32_MIN - u.i : u.i;
+}
+
+/* Distance in ulps between a and b. NaN matches NaN; NaN against a number is
+ * as far apart as possible. */
+static uint64_t
+ulp_distance(float a, float b)
+{
+    if (isnan(a) || isnan(b))
+    {
+        return isnan(a) && isnan(b) ? 0 : UINT32_MAX;
+    }
+    int64_t d = float_ordinal(a) - float_ordinal(b);
+    return d < 0 ? -d : d;
+}
+
+/* Bit patterns per unit of work handed to a sweep thread. */
+#define SWEEP_CHUNK 65536
+
+/* Error histogram buckets: 0 is exact, bucket b > 0 counts errors in
+ * [2^(b-1), 2^b) ulps. */
+#define SWEEP_BUCKETS 34
+
+static unsigned
+ulp_bucket(uint64_t d)
+{
+    return d ? 64 - __builtin_clzll(d) : 0;
+}
+
+/* Function under test: set y[i] = sin(x[i]) for i in [0, n). */
+typedef void sweep_fn(const float *x, float *y, size_t n);
+
+/* Per-thread results of an exhaustive sweep. */
+struct sweep_thread
+{
+    pthread_t thread;
+    sweep_fn *fn;
+    uint64_t count[SWEEP_BUCKETS];    /* Inputs per error bucket... */
+    uint64_t max_ulp[SWEEP_BUCKETS];  /* ...the largest error in each bucket... */
+    float worst[SWEEP_BUCKETS];       /* ...and the input that produced it. */
+};
+
+/* Next chunk of the 2^32 bit patterns to be checked. */
+static uint64_t g_sweep_next;
+
+static void *
+sweep_thread(void *arg)
+{
+    struct sweep_thread *t = arg;
+    static __thread float x[SWEEP_CHUNK], y[SWEEP_CHUNK];
+    for (;;)
+    {
+        uint64_t base = __atomic_fetch_add(&g_sweep_next, SWEEP_CHUNK, __ATOMIC_RELAXED);
+        if (base >= ((uint64_t)1 << 32))
+        {
+            return NULL;
+        }
+        for (uint32_t i = 0; i < SWEEP_CHUNK; ++i)
+        {
+            uint32_t bits = (uint32_t)base + i;
+            memcpy(&x[i], &bits, sizeof bits);
+        }
+        t->fn(x, y, SWEEP_CHUNK);
+        for (uint32_t i = 0; i < SWEEP_CHUNK; ++i)
+        {
+            uint64_t d = ulp_distance(y[i], sinf(x[i]));
+            unsigned b = ulp_bucket(d);
+            ++t->count[b];
+            if (d > t->max_ulp[b] || t->count[b] == 1)
+            {
+                t->max_ulp[b] = d;
+                t->worst[b] = x[i];
+            }
+        }
+    }
+}
+
+/* Check <fn> against sinf() for every float, using <nthreads> threads, and
+ * print a histogram of the errors. Fails if any result is more than 1 ulp
+ * from sinf(). */
+static int
+sweep(const char *name, sweep_fn *fn, unsigned nthreads)
+{
+    struct sweep_thread *threads = calloc(nthreads, sizeof *threads);
+    assert(threads);
+    printf("Checking %s against sinf() for all 2^32 inputs using %u threads\n", name, nthreads);
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    g_sweep_next = 0;
+    for (unsigned i = 0; i < nthreads; ++i)
+    {
+        threads[i].fn = fn;
+        int r = pthread_create(&threads[i].thread, NULL, sweep_thread, &threads[i]);
+        assert(r == 0);
+    }
+    struct sweep_thread total = { .fn = fn };
+    for (unsigned i = 0; i < nthreads; ++i)
+    {
+        int r = pthread_join(threads[i].thread, NULL);
+        assert(r == 0);
+        for (unsigned b = 0; b < SWEEP_BUCKETS; ++b)
+        {
+            if (!threads[i].count[b])
+            {
+                continue;
+            }
+            if (!total.count[b] || threads[i].max_ulp[b] > total.max_ulp[b])
+            {
+                total.max_ulp[b] = threads[i].max_ulp[b];
+                total.worst[b] = threads[i].worst[b];
+            }
+            total.count[b] += threads[i].count[b];
+        }
+    }
+    free(threads);
+    gettimeofday(&end, NULL);
+
+    uint64_t failures = 0;
+    printf("%-18s %12s %9s  %s\n", "ulp error", "inputs", "share", "worst input (ulps)");
+    for (unsigned b = 0; b < SWEEP_BUCKETS; ++b)
+    {
+        if (!total.count[b])
+        {
+            continue;
+        }
+        char range[32];
+        if (b == 0)
+        {
+            snprintf(range, sizeof range, "exact");
+        }
+        else if (b == 1)
+        {
+            snprintf(range, sizeof range, "1");
+        }
+        else
+        {
+            snprintf(range, sizeof range, "[%llu, %llu)", 1ull << (b - 1), 1ull << b);
+        }
+        if (b > 1)
+        {
+            failures += total.count[b];
+        }
+        printf("%-18s %12llu %8.4f%%  x=%a (%llu)\n", range, (unsigned long long)total.count[b],
+               100.0 * total.count[b] / 4294967296.0, total.worst[b],
+               (unsigned long long)total.max_ulp[b]);
+    }
+    printf("%s: %llu inputs more than 1 ulp from sinf() in %.1fs\n", name,
+           (unsigned long long)failures,
+           (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) * 1e-6);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void
+sine_sweep(const float *x, float *y, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        y[i] = sine(x[i]);
+    }
+}
+
+/* Parse the optional THREADS argument of the sweep modes. */
+static unsigned
+sweep_threads(int argc, char **argv)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned nthreads = argc > 2 ? strtoul(argv[2], NULL, 10) : (ncpus > 0 ? ncpus : 1);
+    if (argc > 3 || !nthreads)
+    {
+        fprintf(stderr, "Usage: %s %s [THREADS]\n", argv[0], argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    return nthreads;
+}
+
+/* Per-thread parameters and results of log_bench_thread(). */
+struct log_bench_thread
+{
+    pthread_t thread;
+    bool async;
+    unsigned long messages;
+    uint64_t *latency_ns; /* Caller-side time of each call. */
+};
+
+static uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+log_bench_thread(void *arg)
+{
+    struct log_bench_thread *t = arg;
+    for (unsigned long i = 0; i < t->messages; ++i)
+    {
+        float x = (float)i;
+        uint64_t start = monotonic_ns();
+        if (t->async)
+        {
+            log_message("pass x=%g sinf=%f sine=%f", x, 0.5f, 0.5f);
+        }
+        else
+        {
+            log_message_stdio("pass x=%g sinf=%f sine=%f", x, 0.5f, 0.5f);
+        }
+        t->latency_ns[i] = monotonic_ns() - start;
+    }
+    return NULL;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Log <messages> lines from each of <nthreads> threads to /dev/null and
+ * report throughput and caller-side latency percentiles. */
+static void
+log_bench_run(const char *name, bool async, bool coarse, unsigned long messages, unsigned nthreads)
+{
+    struct log_bench_thread *threads = calloc(nthreads, sizeof *threads);
+    uint64_t *latency = malloc(messages * nthreads * sizeof *latency);
+    assert(threads && latency);
+
+    int fd = open("/dev/null", O_WRONLY);
+    assert(fd >= 0);
+    if (async)
+    {
+        log_init(fd, coarse);
+    }
+    else
+    {
+        /* log_message_stdio() writes to stdout. */
+        fflush(stdout);
+        int saved = dup(STDOUT_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+        fd = saved;
+    }
+
+    uint64_t start = monotonic_ns();
+    for (unsigned i = 0; i < nthreads; ++i)
+    {
+        threads[i].async = async;
+        threads[i].messages = messages;
+        threads[i].latency_ns = latency + i * messages;
+        int r = pthread_create(&threads[i].thread, NULL, log_bench_thread, &threads[i]);
+        assert(r == 0);
+    }
+    for (unsigned i = 0; i < nthreads; ++i)
+    {
+        int r = pthread_join(threads[i].thread, NULL);
+        assert(r == 0);
+    }
+    if (async)
+    {
+        log_flush();
+    }
+    else
+    {
+        fflush(stdout);
+    }
+    double elapsed = (monotonic_ns() - start) * 1e-9;
+    if (async)
+    {
+        log_shutdown();
+        close(fd);
+    }
+    else
+    {
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+    }
+
+    size_t n = messages * nthreads;
+    qsort(latency, n, sizeof *latency, compare_u64);
+    printf("%-22s threads=%u messages/sec=%.0f latency p50=%lluns p99=%lluns p999=%lluns max=%lluns\n",
+           name, nthreads, n / elapsed, (unsigned long long)latency[n / 2],
+           (unsigned long long)latency[n * 99 / 100], (unsigned long long)latency[n * 999 / 1000],
+           (unsigned long long)latency[n - 1]);
+    free(latency);
+    free(threads);
+}
+
+/* Return a random float with |x| in [lo, hi), drawn uniformly over the bit
+ * patterns so that every exponent in the range is equally likely. */
+static float
+reduce_bench_input(unsigned *seed, float lo, float hi)
+{
+    union
+    {
+        float f;
+        uint32_t u;
+    } a = { .f = lo }, b = { .f = hi }, x;
+    uint32_t r = (uint32_t)rand_r(seed) << 16 ^ (uint32_t)rand_r(seed);
+    x.u = a.u + r % (b.u - a.u);
+    if (rand_r(seed) & 1)
+    {
+        x.u |= 0x80000000;
+    }
+    return x.f;
+}
+
+/* Keeps results alive so the calls are not optimised away. */
+static volatile double reduce_bench_sink;
+
+/* Time <n> calls of each function on each input range and report ns/call. */
+static void
+reduce_bench_run(const char *range, const float *in, unsigned long n)
+{
+    uint64_t start = monotonic_ns();
+    double sum = 0;
+    for (unsigned long i = 0; i < n; ++i)
+    {
+        double r;
+        sum += reduce_pio2(in[i], &r) + r;
+    }
+    uint64_t reduce_ns = monotonic_ns() - start;
+
+    start = monotonic_ns();
+    for (unsigned long i = 0; i < n; ++i)
+    {
+        sum += sine(in[i]);
+    }
+    uint64_t sine_ns = monotonic_ns() - start;
+
+    start = monotonic_ns();
+    for (unsigned long i = 0; i < n; ++i)
+    {
+        sum += sinf(in[i]);
+    }
+    uint64_t sinf_ns = monotonic_ns() - start;
+    reduce_bench_sink = sum;
+
+    printf("%-26s reduce_pio2=%.1fns sine=%.1fns sinf=%.1fns\n", range,
+           (double)reduce_ns / n, (double)sine_ns / n, (double)sinf_ns / n);
+}
+
+/* Benchmark each tier of the argument reduction separately. */
+static int
+reduce_bench(unsigned long n)
+{
+    float *in = malloc(n * sizeof *in);
+    assert(in);
+    unsigned seed = 1;
+
+    for (unsigned long i = 0; i < n; ++i)
+    {
+        in[i] = reduce_bench_input(&seed, 0x1p-8f, 0x1p4f);
+    }
+    reduce_bench_run("fast, |x| in [2^-8, 2^4)", in, n);
+    for (unsigned long i = 0; i < n; ++i)
+    {
+        in[i] = reduce_bench_input(&seed, 0x1p4f, REDUCE_FAST_BOUND);
+    }
+    reduce_bench_run("fast, |x| in [2^4, 2^20)", in, n);
+    for (unsigned long i = 0; i < n; ++i)
+    {
+        in[i] = reduce_bench_input(&seed, REDUCE_FAST_BOUND, FLT_MAX);
+    }
+    reduce_bench_run("large, |x| >= 2^20", in, n);
+
+    free(in);
+    return EXIT_SUCCESS;
+}
+
+/* Randomized oracle test, or one of the modes listed at the top. */
 int
 main(int argc, char **argv)
 {
+    if (argc >= 2 && !strcmp(argv[1], "--log-bench"))
+    {
+        unsigned long messages = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+        unsigned nthreads = argc > 3 ? strtoul(argv[3], NULL, 10) : 1;
+        if (argc > 4 || !messages || !nthreads)
+        {
+            fprintf(stderr, "Usage: %s --log-bench [MESSAGES-PER-THREAD [THREADS]]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        log_bench_run("stdio log_message", false, false, messages, nthreads);
+        log_bench_run("async", true, false, messages, nthreads);
+        log_bench_run("async coarse clock", true, true, messages, nthreads);
+        return EXIT_SUCCESS;
+    }
+    if (argc >= 2 && !strcmp(argv[1], "--reduce-bench"))
+    {
+        unsigned long n = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+        if (argc > 3 || !n)
+        {
+            fprintf(stderr, "Usage: %s --reduce-bench [CALLS]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        return reduce_bench(n);
+    }
+    if (argc >= 2 && !strcmp(argv[1], "--exhaustive"))
+    {
+        return sweep("sine()", sine_sweep, sweep_threads(argc, argv));
+    }
+    if (argc >= 2 && !strcmp(argv[1], "--batch-exhaustive"))
+    {
+        unsigned nthreads = sweep_threads(argc, argv);
+        float probe = 0;
+        sine_batch(&probe, &probe, 1);
+        char name[32];
+        snprintf(name, sizeof name, "sine_batch() (%s)", sine_batch_isa);
+        return sweep(name, sine_batch, nthreads);
+    }
     if (argc != 3)
     {
-        fprintf(stderr, "Usage: %s ITERATIONS SEED\n", argv[0]);
+        fprintf(stderr, "Usage: %s ITERATIONS SEED\n"
+                        "       %s --exhaustive [THREADS]\n"
+                        "       %s --batch-exhaustive [THREADS]\n"
+                        "       %s --reduce-bench [CALLS]\n"
+                        "       %s --log-bench [MESSAGES-PER-THREAD [THREADS]]\n",
+                argv[0], argv[0], argv[0], argv[0], argv[0]);
         return EXIT_FAILURE;
     }
     char *end;
@@ -102,6 +974,7 @@ main(int argc, char **argv)
         fprintf(stderr, "Expected SEED but got %s\n", argv[2]);
         return EXIT_FAILURE;
     }
+    log_init(STDOUT_FILENO, getenv("SINE_LOG_COARSE") != NULL);
     srand(seed);
     for (unsigned long i = 0; i < iterations; ++i)
     {
@@ -111,5 +984,6 @@ main(int argc, char **argv)
         float x = ldexp(m, e);
         check(x);
     }
+    log_shutdown();
     return EXIT_SUCCESS;
 }
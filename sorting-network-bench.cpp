@@ -0,0 +1,136 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/* Benchmark of the sorting networks in sorting-network.h against bubble sort
+ * (as in bubble_sort.c), insertion sort and std::sort, sorting many small
+ * blocks of int64_t of each network size, full and partially filled. Every
+ * result is checked against std::sort. */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "sorting-network.h"
+
+static void
+bubble_sort(int64_t *array, size_t n)
+{
+    bool sorted;
+    do
+    {
+        sorted = true;
+        for (size_t i = 0; i + 1 < n; ++i)
+        {
+            if (array[i] > array[i + 1])
+            {
+                std::swap(array[i], array[i + 1]);
+                sorted = false;
+            }
+        }
+    } while (!sorted);
+}
+
+static void
+insertion_sort(int64_t *array, size_t n)
+{
+    sortnet_scalar(array, n);
+}
+
+static void
+std_sort(int64_t *array, size_t n)
+{
+    std::sort(array, array + n);
+}
+
+struct Block
+{
+    size_t offset;
+    size_t count;
+};
+
+/*
+ * Sort every block of <input> with <sort> and print ns/block. Returns false
+ * if any result differs from <expected>.
+ */
+template <typename Sort>
+static bool
+bench_sort(const char *name, size_t block_size, const std::vector<int64_t> &input,
+           const std::vector<Block> &blocks, const std::vector<int64_t> &expected, Sort sort)
+{
+    std::vector<int64_t> work(input);
+    auto start = std::chrono::steady_clock::now();
+    for (const Block &block : blocks)
+    {
+        sort(work.data() + block.offset, block.count);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "  " << std::left << std::setw(16) << name << std::right << std::fixed
+              << std::setprecision(1) << std::setw(8) << elapsed.count() * 1e9 / blocks.size()
+              << " ns/block" << std::endl;
+    if (work != expected)
+    {
+        std::cerr << name << ": wrong result for blocks of " << block_size << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/* Run every sort on <n_blocks> blocks of <block_size>, each holding
+ * <block_size> elements if <full>, otherwise a random count from 0 to
+ * <block_size>. */
+static bool
+bench_size(size_t block_size, size_t n_blocks, bool full, std::mt19937_64 &rng)
+{
+    std::vector<int64_t> input(block_size * n_blocks);
+    for (auto &x : input)
+    {
+        x = static_cast<int64_t>(rng());
+    }
+    std::vector<Block> blocks(n_blocks);
+    for (size_t b = 0; b < n_blocks; ++b)
+    {
+        blocks[b].offset = b * block_size;
+        blocks[b].count = full ? block_size : rng() % (block_size + 1);
+    }
+    std::vector<int64_t> expected(input);
+    for (const Block &block : blocks)
+    {
+        std::sort(expected.begin() + block.offset, expected.begin() + block.offset + block.count);
+    }
+
+    std::cout << block_size << " elements, " << (full ? "full" : "partially filled") << ":" << std::endl;
+    sortnet_fn *network = block_size == 8 ? sort8 : block_size == 16 ? sort16 : block_size == 32 ? sort32 : sort64;
+    network(input.data(), 0); /* Select the implementation before timing. */
+    std::string network_name = "sort" + std::to_string(block_size) + " (" + sortnet_isa + ")";
+    return bench_sort("bubble sort", block_size, input, blocks, expected, bubble_sort)
+           && bench_sort("insertion sort", block_size, input, blocks, expected, insertion_sort)
+           && bench_sort("std::sort", block_size, input, blocks, expected, std_sort)
+           && bench_sort(network_name.c_str(), block_size, input, blocks, expected, network);
+}
+
+int
+main(int argc, char **argv)
+{
+    long n_blocks = argc > 1 ? strtol(argv[1], NULL, 10) : 1000000;
+    if (argc > 2 || n_blocks <= 0)
+    {
+        std::cerr << "Usage: " << argv[0] << " [BLOCKS]\n";
+        return EXIT_FAILURE;
+    }
+    std::mt19937_64 rng(1);
+    for (size_t block_size = 8; block_size <= 64; block_size *= 2)
+    {
+        if (!bench_size(block_size, n_blocks, true, rng) || !bench_size(block_size, n_blocks, false, rng))
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,340 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/* Sorting networks for small arrays of int64_t.
+ *
+ * sort8(), sort16(), sort32() and sort64() sort the first <n> elements of an
+ * array of at most 8, 16, 32 or 64, in ascending order. They run a bitonic
+ * sorting network held entirely in vector registers, so every call does the
+ * same fixed sequence of min/max operations with no data-dependent branches:
+ * much faster than comparison sorts for millions of small blocks.
+ *
+ * Elements beyond <n> are neither read nor written. Inside the registers they
+ * are replaced by INT64_MAX, which sorts after everything else, so the first
+ * <n> outputs are exactly the sorted input.
+ *
+ * The implementation is chosen on first use from AVX-512F, AVX2 or a scalar
+ * insertion sort, by CPU support; set SORTNET_ISA to "avx512", "avx2" or
+ * "scalar" to force one. sortnet_isa names the choice after the first call.
+ *
+ * Usable from both C and C++. */
+
+#ifndef SORTING_NETWORK_H
+#define SORTING_NETWORK_H
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SORTNET_X86 1
+#endif
+
+typedef void sortnet_fn(int64_t *array, size_t n);
+
+/* Insertion sort, for machines without vector support. */
+static void
+sortnet_scalar(int64_t *array, size_t n)
+{
+    for (size_t i = 1; i < n; ++i)
+    {
+        int64_t x = array[i];
+        size_t j = i;
+        for (; j > 0 && array[j - 1] > x; --j)
+        {
+            array[j] = array[j - 1];
+        }
+        array[j] = x;
+    }
+}
+
+#ifdef SORTNET_X86
+
+/* The stages (k, j) of a bitonic sort of 8, 16, 32 or 64 elements, in order:
+ * in stage (k, j) each element g is compare-exchanged with element g ^ j,
+ * keeping the smaller one if g is in the lower half of the pair and the
+ * k-block containing g is ascending (g & k == 0), or if neither is. Listed
+ * out rather than looped over so that every stage is compiled with constant
+ * k and j, which turns the lane masks and permutations into constants. */
+#define SORTNET_STAGES_8(STAGE) STAGE(2, 1) STAGE(4, 2) STAGE(4, 1) STAGE(8, 4) STAGE(8, 2) STAGE(8, 1)
+#define SORTNET_STAGES_16(STAGE)                                                                   \
+    SORTNET_STAGES_8(STAGE) STAGE(16, 8) STAGE(16, 4) STAGE(16, 2) STAGE(16, 1)
+#define SORTNET_STAGES_32(STAGE)                                                                   \
+    SORTNET_STAGES_16(STAGE) STAGE(32, 16) STAGE(32, 8) STAGE(32, 4) STAGE(32, 2) STAGE(32, 1)
+#define SORTNET_STAGES_64(STAGE)                                                                   \
+    SORTNET_STAGES_32(STAGE)                                                                       \
+    STAGE(64, 32) STAGE(64, 16) STAGE(64, 8) STAGE(64, 4) STAGE(64, 2) STAGE(64, 1)
+
+/* Element g is lane g % 8 of register v[g / 8]. Lanes beyond n are loaded
+ * as INT64_MAX and not stored. */
+static inline __attribute__((always_inline, target("avx512f"))) void
+sortnet_avx512_load(__m512i *v, const int64_t *array, size_t n, unsigned n_regs)
+{
+    const __m512i pad = _mm512_set1_epi64(INT64_MAX);
+    for (unsigned r = 0; r < n_regs; ++r)
+    {
+        size_t have = n > r * 8 ? n - r * 8 : 0;
+        __mmask8 load = have >= 8 ? 0xff : (__mmask8)((1u << have) - 1);
+        v[r] = _mm512_mask_loadu_epi64(pad, load, array + r * 8);
+    }
+}
+
+static inline __attribute__((always_inline, target("avx512f"))) void
+sortnet_avx512_store(const __m512i *v, int64_t *array, size_t n, unsigned n_regs)
+{
+    for (unsigned r = 0; r < n_regs; ++r)
+    {
+        size_t have = n > r * 8 ? n - r * 8 : 0;
+        __mmask8 store = have >= 8 ? 0xff : (__mmask8)((1u << have) - 1);
+        _mm512_mask_storeu_epi64(array + r * 8, store, v[r]);
+    }
+}
+
+/* One stage. For j >= 8 the partner is the same lane of another register;
+ * below that it is another lane of the same register, reached with a
+ * permutation, and a mask picks the min or max per lane. */
+static inline __attribute__((always_inline, target("avx512f"))) void
+sortnet_avx512_stage(__m512i *v, unsigned n_regs, unsigned k, unsigned j)
+{
+    if (j >= 8)
+    {
+        unsigned stride = j / 8;
+        for (unsigned r = 0; r < n_regs; ++r)
+        {
+            if (r & stride)
+            {
+                continue;
+            }
+            __m512i lo = _mm512_min_epi64(v[r], v[r | stride]);
+            __m512i hi = _mm512_max_epi64(v[r], v[r | stride]);
+            bool up = ((r * 8) & k) == 0;
+            v[r] = up ? lo : hi;
+            v[r | stride] = up ? hi : lo;
+        }
+        return;
+    }
+    const __m512i partner = _mm512_set_epi64(7 ^ j, 6 ^ j, 5 ^ j, 4 ^ j, 3 ^ j, 2 ^ j, 1 ^ j, 0 ^ j);
+    for (unsigned r = 0; r < n_regs; ++r)
+    {
+        __mmask8 take_max = 0;
+        for (unsigned i = 0; i < 8; ++i)
+        {
+            bool up = ((r * 8 + i) & k) == 0;
+            bool low = (i & j) == 0;
+            if (up != low)
+            {
+                take_max |= (__mmask8)(1u << i);
+            }
+        }
+        __m512i other = _mm512_permutexvar_epi64(partner, v[r]);
+        __m512i lo = _mm512_min_epi64(v[r], other);
+        __m512i hi = _mm512_max_epi64(v[r], other);
+        v[r] = _mm512_mask_blend_epi64(take_max, lo, hi);
+    }
+}
+
+/* AVX2 equivalents, on registers of 4 lanes. AVX2 has no 64-bit min or max,
+ * so they are built from a signed compare and a blend. */
+static inline __attribute__((always_inline, target("avx2"))) __m256i
+sortnet_avx2_mask(size_t have)
+{
+    return _mm256_set_epi64x(have > 3 ? -1 : 0, have > 2 ? -1 : 0, have > 1 ? -1 : 0,
+                             have > 0 ? -1 : 0);
+}
+
+static inline __attribute__((always_inline, target("avx2"))) void
+sortnet_avx2_load(__m256i *v, const int64_t *array, size_t n, unsigned n_regs)
+{
+    const __m256i pad = _mm256_set1_epi64x(INT64_MAX);
+    for (unsigned r = 0; r < n_regs; ++r)
+    {
+        __m256i load = sortnet_avx2_mask(n > r * 4 ? n - r * 4 : 0);
+        __m256i x = _mm256_maskload_epi64((const long long *)(array + r * 4), load);
+        v[r] = _mm256_blendv_epi8(pad, x, load);
+    }
+}
+
+static inline __attribute__((always_inline, target("avx2"))) void
+sortnet_avx2_store(const __m256i *v, int64_t *array, size_t n, unsigned n_regs)
+{
+    for (unsigned r = 0; r < n_regs; ++r)
+    {
+        __m256i store = sortnet_avx2_mask(n > r * 4 ? n - r * 4 : 0);
+        _mm256_maskstore_epi64((long long *)(array + r * 4), store, v[r]);
+    }
+}
+
+static inline __attribute__((always_inline, target("avx2"))) void
+sortnet_avx2_stage(__m256i *v, unsigned n_regs, unsigned k, unsigned j)
+{
+    if (j >= 4)
+    {
+        unsigned stride = j / 4;
+        for (unsigned r = 0; r < n_regs; ++r)
+        {
+            if (r & stride)
+            {
+                continue;
+            }
+            __m256i gt = _mm256_cmpgt_epi64(v[r], v[r | stride]);
+            __m256i lo = _mm256_blendv_epi8(v[r], v[r | stride], gt);
+            __m256i hi = _mm256_blendv_epi8(v[r | stride], v[r], gt);
+            bool up = ((r * 4) & k) == 0;
+            v[r] = up ? lo : hi;
+            v[r | stride] = up ? hi : lo;
+        }
+        return;
+    }
+    for (unsigned r = 0; r < n_regs; ++r)
+    {
+        long long take_max[4];
+        for (unsigned i = 0; i < 4; ++i)
+        {
+            bool up = ((r * 4 + i) & k) == 0;
+            bool low = (i & j) == 0;
+            take_max[i] = up != low ? -1 : 0;
+        }
+        __m256i other = j == 1 ? _mm256_permute4x64_epi64(v[r], 0xb1)  /* 2, 3, 0, 1 */
+                               : _mm256_permute4x64_epi64(v[r], 0x4e); /* 1, 0, 3, 2 */
+        /* A lane keeping the min takes its partner's value if that is
+         * smaller; a lane keeping the max takes it unless it is smaller. */
+        __m256i take = _mm256_xor_si256(
+            _mm256_cmpgt_epi64(v[r], other),
+            _mm256_set_epi64x(take_max[3], take_max[2], take_max[1], take_max[0]));
+        v[r] = _mm256_blendv_epi8(v[r], other, take);
+    }
+}
+
+#define SORTNET_AVX512_STAGE(k, j) sortnet_avx512_stage(v, sizeof v / sizeof v[0], k, j);
+#define SORTNET_AVX2_STAGE(k, j) sortnet_avx2_stage(v, sizeof v / sizeof v[0], k, j);
+#define SORTNET_DEFINE(size)                                                                       \
+    static __attribute__((target("avx512f"))) void sortnet##size##_avx512(int64_t *array, size_t n) \
+    {                                                                                              \
+        __m512i v[size / 8];                                                                       \
+        sortnet_avx512_load(v, array, n, size / 8);                                                \
+        SORTNET_STAGES_##size(SORTNET_AVX512_STAGE)                                                \
+        sortnet_avx512_store(v, array, n, size / 8);                                               \
+    }                                                                                              \
+    static __attribute__((target("avx2"))) void sortnet##size##_avx2(int64_t *array, size_t n)     \
+    {                                                                                              \
+        __m256i v[size / 4];                                                                       \
+        sortnet_avx2_load(v, array, n, size / 4);                                                  \
+        SORTNET_STAGES_##size(SORTNET_AVX2_STAGE)                                                  \
+        sortnet_avx2_store(v, array, n, size / 4);                                                 \
+    }
+
+SORTNET_DEFINE(8)
+SORTNET_DEFINE(16)
+SORTNET_DEFINE(32)
+SORTNET_DEFINE(64)
+
+#undef SORTNET_DEFINE
+#undef SORTNET_AVX512_STAGE
+#undef SORTNET_AVX2_STAGE
+
+#endif /* SORTNET_X86 */
+
+/* Implementations for 8, 16, 32 and 64 elements, chosen by sortnet_select(). */
+static sortnet_fn *sortnet_impl[4];
+static const char *sortnet_isa;
+
+/* Return whether <isa> is usable here and, if so, fill in sortnet_impl. */
+static int
+sortnet_try(const char *isa)
+{
+    if (!strcmp(isa, "scalar"))
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            sortnet_impl[i] = sortnet_scalar;
+        }
+        sortnet_isa = "scalar";
+        return 1;
+    }
+#ifdef SORTNET_X86
+    __builtin_cpu_init();
+    if (!strcmp(isa, "avx512") && __builtin_cpu_supports("avx512f"))
+    {
+        sortnet_impl[0] = sortnet8_avx512;
+        sortnet_impl[1] = sortnet16_avx512;
+        sortnet_impl[2] = sortnet32_avx512;
+        sortnet_impl[3] = sortnet64_avx512;
+        sortnet_isa = "avx512";
+        return 1;
+    }
+    if (!strcmp(isa, "avx2") && __builtin_cpu_supports("avx2"))
+    {
+        sortnet_impl[0] = sortnet8_avx2;
+        sortnet_impl[1] = sortnet16_avx2;
+        sortnet_impl[2] = sortnet32_avx2;
+        sortnet_impl[3] = sortnet64_avx2;
+        sortnet_isa = "avx2";
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+/* Choose the implementation: SORTNET_ISA if set and supported, otherwise the
+ * widest the CPU supports. */
+static void
+sortnet_select(void)
+{
+    const char *forced = getenv("SORTNET_ISA");
+    if (forced && sortnet_try(forced))
+    {
+        return;
+    }
+    if (!sortnet_try("avx512") && !sortnet_try("avx2"))
+    {
+        sortnet_try("scalar");
+    }
+}
+
+static inline void
+sortnet_call(int which, int64_t *array, size_t n)
+{
+    if (__builtin_expect(!sortnet_impl[which], 0))
+    {
+        sortnet_select();
+    }
+    sortnet_impl[which](array, n);
+}
+
+/* Sort the first n <= 8 elements of <array>. */
+static inline void
+sort8(int64_t *array, size_t n)
+{
+    assert(n <= 8);
+    sortnet_call(0, array, n);
+}
+
+/* Sort the first n <= 16 elements of <array>. */
+static inline void
+sort16(int64_t *array, size_t n)
+{
+    assert(n <= 16);
+    sortnet_call(1, array, n);
+}
+
+/* Sort the first n <= 32 elements of <array>. */
+static inline void
+sort32(int64_t *array, size_t n)
+{
+    assert(n <= 32);
+    sortnet_call(2, array, n);
+}
+
+/* Sort the first n <= 64 elements of <array>. */
+static inline void
+sort64(int64_t *array, size_t n)
+{
+    assert(n <= 64);
+    sortnet_call(3, array, n);
+}
+
+#endif
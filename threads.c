@@ -1,38 +1,121 @@
 /* This is free and unencumbered software released into the public domain.
  * Refer to LICENSE.txt in this directory. */
 
-/* Randomized threaded stress test of a producer-consumer queue. */
+/* Randomized threaded stress test of a producer-consumer queue.
+ *
+ * "threads [--series] [SECONDS]" runs for SECONDS (default 10). The feeder
+ * stamps each item as it enqueues it and the eater measures the item's
+ * latency when it dequeues it, into a histogram of its own (see histogram.h).
+ * At the end the histograms are merged and the percentiles printed; with
+ * --series, they are also printed for each second of the run.
+ *
+ * THREAD_PLACEMENT pins the feeder and the eater to CPUs; see topology.h. With
+ * the pairs policy they share a node. Either way the items come from a pool
+ * that the eater allocates after pinning, so that they are on its node. */
+
+#define _GNU_SOURCE
 
 #include <assert.h>
 #include <errno.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "histogram.h"
+#include "prng.h"
+#include "topology.h"
+
 struct list
 {
     struct list *next;
     int val;
+    uint64_t enqueued_ns;
+};
+
+/* Latencies seen by one eater, over the whole run and for each second of it
+ * if g_series. */
+struct latency
+{
+    struct histogram total;
+    struct histogram *series;
+    size_t n_series;
 };
 
 static struct list *g_list;
+/* Pool of items allocated by the eater, and the free ones in it. The feeder
+ * falls back to malloc() before the pool exists or when it is empty. */
+#define POOL_ITEMS 4096
+static struct list *g_pool;
+static struct list *g_free;
 static unsigned g_items;
 static unsigned g_transactions;
 static bool g_done;
+static bool g_series;
+static uint64_t g_start_ns;
 
 static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t g_condition = PTHREAD_COND_INITIALIZER;
 
+static uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+latency_record(struct latency *latency, uint64_t now_ns, uint64_t latency_ns)
+{
+    histogram_record(&latency->total, latency_ns);
+    if (!g_series)
+    {
+        return;
+    }
+    size_t second = (now_ns - g_start_ns) / 1000000000;
+    if (second >= latency->n_series)
+    {
+        latency->series = realloc(latency->series, (second + 1) * sizeof *latency->series);
+        assert(latency->series);
+        for (; latency->n_series <= second; ++latency->n_series)
+        {
+            histogram_init(&latency->series[latency->n_series]);
+        }
+    }
+    histogram_record(&latency->series[second], latency_ns);
+}
+
+/* Returns the eater's struct latency. */
 static void *
 eater(void *p)
 {
     (void)p;
+    topology_pin_self(1);
+    struct list *pool = topology_alloc_local(POOL_ITEMS * sizeof *pool);
+    assert(pool);
+    struct latency *latency = calloc(1, sizeof *latency);
+    assert(latency);
+    histogram_init(&latency->total);
+
+    int e = pthread_mutex_lock(&g_mutex);
+    assert(!e);
+    for (size_t i = 0; i < POOL_ITEMS; ++i)
+    {
+        pool[i].next = g_free;
+        g_free = &pool[i];
+    }
+    g_pool = pool;
+    e = pthread_mutex_unlock(&g_mutex);
+    assert(!e);
+
     while (!g_done)
     {
-        int e;
         e = pthread_mutex_lock(&g_mutex);
         assert(!e);
 
@@ -41,7 +124,17 @@ eater(void *p)
             /* Consume an item from the list. */
             struct list *item = g_list;
             g_list = g_list->next;
-            free(item);
+            uint64_t now_ns = monotonic_ns();
+            latency_record(latency, now_ns, now_ns - item->enqueued_ns);
+            if (item >= g_pool && item < g_pool + POOL_ITEMS)
+            {
+                item->next = g_free;
+                g_free = item;
+            }
+            else
+            {
+                free(item);
+            }
             --g_items;
         }
         else
@@ -63,25 +156,35 @@ eater(void *p)
         e = pthread_mutex_unlock(&g_mutex);
         assert(!e);
     }
-    return NULL;
+    return latency;
 }
 
 static void *
 feeder(void *p)
 {
     (void)p;
+    topology_pin_self(0);
     while (!g_done)
     {
-        usleep(1 + (random() % 100 * 1000));
+        usleep(1 + prng_bounded(100) * 1000);
 
         /* Post an item onto the list. */
         int e;
         e = pthread_mutex_lock(&g_mutex);
         assert(!e);
 
-        struct list *el = malloc(sizeof(*el));
+        struct list *el = g_free;
+        if (el)
+        {
+            g_free = el->next;
+        }
+        else
+        {
+            el = malloc(sizeof(*el));
+        }
         el->next = g_list;
-        el->val = rand();
+        el->val = (int)(prng_next() >> 33);
+        el->enqueued_ns = monotonic_ns();
         g_list = el;
         ++g_items;
         ++g_transactions;
@@ -96,14 +199,29 @@ feeder(void *p)
     return NULL;
 }
 
+static void
+print_latency(const char *label, const struct histogram *h)
+{
+    printf("%s items=%llu latency p50=%.3fms p99=%.3fms p999=%.3fms max=%.3fms\n", label,
+           (unsigned long long)h->count, histogram_percentile(h, 50) * 1e-6, histogram_percentile(h, 99) * 1e-6,
+           histogram_percentile(h, 99.9) * 1e-6, h->max * 1e-6);
+}
+
 int
 main(int argc, char *argv[])
 {
     unsigned int duration_s = 10;
-    if (argc >= 2)
+    int arg = 1;
+    if (arg < argc && !strcmp(argv[arg], "--series"))
+    {
+        g_series = true;
+        ++arg;
+    }
+    if (arg < argc)
     {
-        duration_s = strtoul(argv[1], NULL, 10);
+        duration_s = strtoul(argv[arg], NULL, 10);
     }
+    g_start_ns = monotonic_ns();
 
     /* Spawn the producer and consumer, wait 10s, then wait for them to exit, then finish. */
     pthread_t p1;
@@ -118,9 +236,42 @@ main(int argc, char *argv[])
 
     g_done = true;
 
-    pthread_join(p1, NULL);
+    /* Merge the eaters' histograms; there is only the one eater. */
+    struct latency *eaters[] = { NULL };
+    pthread_join(p1, (void **)&eaters[0]);
     pthread_join(p2, NULL);
 
+    struct histogram total;
+    histogram_init(&total);
+    size_t n_series = 0;
+    for (size_t i = 0; i < sizeof eaters / sizeof eaters[0]; ++i)
+    {
+        histogram_merge(&total, &eaters[i]->total);
+        n_series = eaters[i]->n_series > n_series ? eaters[i]->n_series : n_series;
+    }
+    for (size_t second = 0; second < n_series; ++second)
+    {
+        struct histogram h;
+        histogram_init(&h);
+        for (size_t i = 0; i < sizeof eaters / sizeof eaters[0]; ++i)
+        {
+            if (second < eaters[i]->n_series)
+            {
+                histogram_merge(&h, &eaters[i]->series[second]);
+            }
+        }
+        char label[48];
+        snprintf(label, sizeof label, "main: second %zu:", second);
+        print_latency(label, &h);
+    }
+
     printf("main: finished after completing %u transactions\n", g_transactions);
+    print_latency("main:", &total);
+    for (size_t i = 0; i < sizeof eaters / sizeof eaters[0]; ++i)
+    {
+        free(eaters[i]->series);
+        free(eaters[i]);
+    }
+    topology_free_local(g_pool, POOL_ITEMS * sizeof *g_pool);
     return EXIT_SUCCESS;
 }
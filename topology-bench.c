@@ -0,0 +1,218 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/* Queue throughput under each thread placement policy of topology.h.
+ *
+ * "topology-bench [PAIRS [SECONDS]]" runs PAIRS producer/consumer pairs
+ * (default 2), each passing sequence numbers through its own single-producer,
+ * single-consumer ring, for SECONDS (default 1) under each policy in turn,
+ * and prints the items passed per second. Producer k is thread 2k and its
+ * consumer thread 2k + 1 of the policy. Each consumer pins itself and then
+ * allocates its ring, so that the ring's pages are on the consumer's node,
+ * and hands it to its producer. "none" leaves the threads unpinned.
+ *
+ * With more threads than CPUs, threads share CPUs and a full or empty ring
+ * yields the CPU, so the numbers are then mostly scheduling. */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "topology.h"
+
+#define RING_SIZE 4096 /* Items; a power of 2. */
+#define CACHE_LINE 64
+
+struct ring
+{
+    uint64_t head; /* Next item to write, written by the producer. */
+    char pad1[CACHE_LINE - sizeof(uint64_t)];
+    uint64_t tail; /* Next item to read, written by the consumer. */
+    char pad2[CACHE_LINE - sizeof(uint64_t)];
+    uint64_t items[RING_SIZE];
+};
+
+struct pair
+{
+    int producer_cpu; /* -1 to leave unpinned. */
+    int consumer_cpu;
+    struct ring *ring; /* Published by the consumer. */
+    uint64_t consumed;
+    uint64_t sum;
+    pthread_t producer;
+    pthread_t consumer;
+};
+
+static bool g_done;
+
+static void
+pin(int cpu)
+{
+    if (cpu >= 0)
+    {
+        int r = topology_pin(cpu);
+        assert(r == 0);
+    }
+}
+
+static void *
+producer(void *arg)
+{
+    struct pair *pair = arg;
+    pin(pair->producer_cpu);
+    struct ring *ring;
+    while ((ring = __atomic_load_n(&pair->ring, __ATOMIC_ACQUIRE)) == NULL)
+    {
+        sched_yield();
+    }
+    uint64_t head = 0;
+    while (!__atomic_load_n(&g_done, __ATOMIC_RELAXED))
+    {
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head - tail == RING_SIZE)
+        {
+            sched_yield();
+            continue;
+        }
+        /* Fill all the free slots before publishing them. */
+        for (uint64_t end = tail + RING_SIZE; head != end; ++head)
+        {
+            ring->items[head % RING_SIZE] = head;
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *
+consumer(void *arg)
+{
+    struct pair *pair = arg;
+    pin(pair->consumer_cpu);
+    struct ring *ring = topology_alloc_local(sizeof *ring);
+    assert(ring);
+    __atomic_store_n(&pair->ring, ring, __ATOMIC_RELEASE);
+
+    uint64_t tail = 0;
+    uint64_t sum = 0;
+    while (!__atomic_load_n(&g_done, __ATOMIC_RELAXED))
+    {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head == tail)
+        {
+            sched_yield();
+            continue;
+        }
+        for (; tail != head; ++tail)
+        {
+            sum += ring->items[tail % RING_SIZE];
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    pair->consumed = tail;
+    pair->sum = sum;
+    return NULL;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Run <n_pairs> pairs for <seconds>, placed by <order> or unpinned if it is
+ * NULL, and return the items passed per second. */
+static double
+run(const struct topology *topo, const int *order, unsigned n_pairs, unsigned seconds)
+{
+    struct pair *pairs = calloc(n_pairs, sizeof *pairs);
+    assert(pairs);
+    g_done = false;
+    for (unsigned k = 0; k < n_pairs; ++k)
+    {
+        pairs[k].producer_cpu = order ? order[2 * k % topo->n_cpus] : -1;
+        pairs[k].consumer_cpu = order ? order[(2 * k + 1) % topo->n_cpus] : -1;
+        int r = pthread_create(&pairs[k].consumer, NULL, consumer, &pairs[k]);
+        assert(r == 0);
+        r = pthread_create(&pairs[k].producer, NULL, producer, &pairs[k]);
+        assert(r == 0);
+    }
+
+    double start = now();
+    sleep(seconds);
+    __atomic_store_n(&g_done, true, __ATOMIC_RELAXED);
+    uint64_t total = 0;
+    for (unsigned k = 0; k < n_pairs; ++k)
+    {
+        pthread_join(pairs[k].producer, NULL);
+        pthread_join(pairs[k].consumer, NULL);
+        /* The items are 0, 1, 2, ..., so their sum, modulo 2^64 like the
+         * consumer's, checks that none were lost or duplicated. */
+        uint64_t n = pairs[k].consumed;
+        assert(pairs[k].sum == (n % 2 ? (n - 1) / 2 * n : n / 2 * (n - 1)));
+        total += n;
+        topology_free_local(pairs[k].ring, sizeof *pairs[k].ring);
+    }
+    double elapsed = now() - start;
+    free(pairs);
+    return total / elapsed;
+}
+
+int
+main(int argc, char *argv[])
+{
+    unsigned n_pairs = argc > 1 ? strtoul(argv[1], NULL, 10) : 2;
+    unsigned seconds = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+    if (argc > 3 || n_pairs == 0 || seconds == 0)
+    {
+        fprintf(stderr, "Usage: %s [PAIRS [SECONDS]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct topology topo;
+    if (topology_load(&topo) < 0)
+    {
+        fprintf(stderr, "No usable CPUs\n");
+        return EXIT_FAILURE;
+    }
+    printf("%d CPUs on %d nodes:\n", topo.n_cpus, topo.n_nodes);
+    for (int i = 0; i < topo.n_cpus; ++i)
+    {
+        printf("  cpu %-4d node %-3d package %-3d core %d\n", topo.cpus[i].cpu, topo.cpus[i].node,
+               topo.cpus[i].package, topo.cpus[i].core);
+    }
+    if (2 * n_pairs > (unsigned)topo.n_cpus)
+    {
+        printf("%u threads on %d CPUs: pinned threads will share CPUs\n", 2 * n_pairs, topo.n_cpus);
+    }
+
+    int *order = malloc(topo.n_cpus * sizeof *order);
+    assert(order);
+    printf("\n%-8s %14s  %s\n", "policy", "items/s", "producer>consumer CPUs");
+    for (int policy = TOPOLOGY_NONE; policy <= TOPOLOGY_PAIRS; ++policy)
+    {
+        topology_order(&topo, policy, order);
+        double rate = run(&topo, policy == TOPOLOGY_NONE ? NULL : order, n_pairs, seconds);
+        printf("%-8s %14.0f ", topology_policy_names[policy], rate);
+        for (unsigned k = 0; k < n_pairs && policy != TOPOLOGY_NONE; ++k)
+        {
+            int p = order[2 * k % topo.n_cpus], c = order[(2 * k + 1) % topo.n_cpus];
+            printf(" %d>%d%s", p, c, topology_node_of(&topo, p) == topology_node_of(&topo, c) ? "" : "*");
+        }
+        printf("\n");
+    }
+    printf("(* marks a pair split across nodes)\n");
+    free(order);
+    topology_free(&topo);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,430 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/* CPU topology and thread placement.
+ *
+ * topology_load() reads the NUMA nodes from /sys/devices/system/node and each
+ * CPU's core and package from /sys/devices/system/cpu, keeping only the CPUs
+ * that the process may run on. A kernel without NUMA support is treated as
+ * one node. topology_order() lists the CPUs in the order that a placement
+ * policy gives them to threads:
+ *
+ *   compact  Fill one node, core by core with all their hardware threads,
+ *            before the next: threads share caches and memory.
+ *   scatter  Spread threads over the nodes in turn, and over separate cores
+ *            within each node before sharing cores.
+ *   core     One thread per physical core, in node order, before using any
+ *            core's other hardware threads.
+ *   pairs    Threads 2k and 2k + 1 (a producer and its consumer) on separate
+ *            cores of one node, with the pairs spread over the nodes.
+ *
+ * topology_pin_self(index) pins the calling thread to its CPU under the
+ * policy named by the THREAD_PLACEMENT environment variable, and does
+ * nothing if that is unset or "none". topology_alloc_local() returns memory
+ * whose pages the calling thread touches first, so that Linux allocates them
+ * on that thread's node; allocate a queue from its consumer after pinning.
+ *
+ * C programs must define _GNU_SOURCE. */
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <assert.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+struct topology_cpu
+{
+    int cpu;
+    int core;    /* Core id, unique within the package. */
+    int package;
+    int node;
+};
+
+struct topology
+{
+    int n_cpus;
+    int n_nodes;
+    struct topology_cpu *cpus; /* Sorted by node, package, core and cpu. */
+};
+
+enum topology_policy
+{
+    TOPOLOGY_NONE,
+    TOPOLOGY_COMPACT,
+    TOPOLOGY_SCATTER,
+    TOPOLOGY_CORE,
+    TOPOLOGY_PAIRS,
+};
+
+static const char *const topology_policy_names[] = { "none", "compact", "scatter", "core", "pairs" };
+
+/* Return the policy called <name>, or -1. */
+static inline int
+topology_policy_parse(const char *name)
+{
+    for (int i = 0; i < (int)(sizeof topology_policy_names / sizeof topology_policy_names[0]); ++i)
+    {
+        if (!strcmp(name, topology_policy_names[i]))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Read one integer from sysfs file <path>, or return <fallback>. */
+static inline int
+topology_read_int(const char *path, int fallback)
+{
+    FILE *f = fopen(path, "r");
+    int value;
+    if (f == NULL)
+    {
+        return fallback;
+    }
+    if (fscanf(f, "%d", &value) != 1)
+    {
+        value = fallback;
+    }
+    fclose(f);
+    return value;
+}
+
+/* Add the CPUs in the list in sysfs file <path>, such as "0-3,8-11", to
+ * <set>. Returns false if the file cannot be read. */
+static inline bool
+topology_read_cpulist(const char *path, cpu_set_t *set)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return false;
+    }
+    int first, last;
+    while (fscanf(f, "%d", &first) == 1)
+    {
+        last = first;
+        int c = fgetc(f);
+        if (c == '-')
+        {
+            if (fscanf(f, "%d", &last) != 1)
+            {
+                break;
+            }
+            c = fgetc(f);
+        }
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+        {
+            CPU_SET(cpu, set);
+        }
+        if (c != ',')
+        {
+            break;
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+static inline int
+topology_compare_cpus(const void *a, const void *b)
+{
+    const struct topology_cpu *x = (const struct topology_cpu *)a, *y = (const struct topology_cpu *)b;
+    if (x->node != y->node)
+    {
+        return x->node - y->node;
+    }
+    if (x->package != y->package)
+    {
+        return x->package - y->package;
+    }
+    if (x->core != y->core)
+    {
+        return x->core - y->core;
+    }
+    return x->cpu - y->cpu;
+}
+
+/* Fill in <topo> for the CPUs that the process may run on. Returns -1 if
+ * there are none, which should not happen. */
+static inline int
+topology_load(struct topology *topo)
+{
+    cpu_set_t allowed, online;
+    char path[128];
+    CPU_ZERO(&online);
+    if (sched_getaffinity(0, sizeof allowed, &allowed) != 0)
+    {
+        return -1;
+    }
+    if (topology_read_cpulist("/sys/devices/system/cpu/online", &online))
+    {
+        CPU_AND(&allowed, &allowed, &online);
+    }
+
+    topo->n_cpus = 0;
+    topo->n_nodes = 1;
+    topo->cpus = (struct topology_cpu *)calloc(CPU_COUNT(&allowed), sizeof topo->cpus[0]);
+    assert(topo->cpus);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (!CPU_ISSET(cpu, &allowed))
+        {
+            continue;
+        }
+        struct topology_cpu *c = &topo->cpus[topo->n_cpus++];
+        c->cpu = cpu;
+        snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        c->core = topology_read_int(path, cpu);
+        snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        c->package = topology_read_int(path, 0);
+        c->node = 0;
+    }
+
+    /* Nodes are numbered from 0 but may have gaps; renumber them densely. */
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir)
+    {
+        int n_nodes = 0;
+        int node_ids[CPU_SETSIZE];
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            int id;
+            if (sscanf(entry->d_name, "node%d", &id) == 1 && n_nodes < CPU_SETSIZE)
+            {
+                node_ids[n_nodes++] = id;
+            }
+        }
+        closedir(dir);
+        int used = 0;
+        for (int id = 0; id < CPU_SETSIZE && n_nodes; ++id)
+        {
+            bool exists = false;
+            for (int i = 0; i < n_nodes; ++i)
+            {
+                exists = exists || node_ids[i] == id;
+            }
+            if (!exists)
+            {
+                continue;
+            }
+            cpu_set_t node_cpus;
+            CPU_ZERO(&node_cpus);
+            snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", id);
+            topology_read_cpulist(path, &node_cpus);
+            bool any = false;
+            for (int i = 0; i < topo->n_cpus; ++i)
+            {
+                if (CPU_ISSET(topo->cpus[i].cpu, &node_cpus))
+                {
+                    topo->cpus[i].node = used;
+                    any = true;
+                }
+            }
+            used += any;
+        }
+        topo->n_nodes = used ? used : 1;
+    }
+
+    qsort(topo->cpus, topo->n_cpus, sizeof topo->cpus[0], topology_compare_cpus);
+    return topo->n_cpus ? 0 : -1;
+}
+
+static inline void
+topology_free(struct topology *topo)
+{
+    free(topo->cpus);
+    topo->cpus = NULL;
+}
+
+/* Return true if cpus[i] is the first hardware thread of its core. cpus is
+ * sorted, so the threads of a core are adjacent. */
+static inline bool
+topology_first_of_core(const struct topology *topo, int i)
+{
+    return i == 0 || topo->cpus[i].node != topo->cpus[i - 1].node
+           || topo->cpus[i].package != topo->cpus[i - 1].package || topo->cpus[i].core != topo->cpus[i - 1].core;
+}
+
+/* Fill <order> with all of topo's CPUs, one per core first and then the
+ * remaining hardware threads, each group in node order. If <node> is not -1,
+ * only that node's CPUs are listed. Returns how many were listed. */
+static inline int
+topology_cores_first(const struct topology *topo, int node, int *order)
+{
+    int n = 0;
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        for (int i = 0; i < topo->n_cpus; ++i)
+        {
+            if ((node < 0 || topo->cpus[i].node == node) && topology_first_of_core(topo, i) == (pass == 0))
+            {
+                order[n++] = topo->cpus[i].cpu;
+            }
+        }
+    }
+    return n;
+}
+
+/* Fill <order>, which has room for topo->n_cpus entries, with the CPUs in
+ * the order in which <policy> assigns them to threads 0, 1, ...; thread i
+ * runs on order[i % topo->n_cpus]. */
+static inline void
+topology_order(const struct topology *topo, enum topology_policy policy, int *order)
+{
+    int n = topo->n_cpus;
+    if (policy == TOPOLOGY_NONE || policy == TOPOLOGY_COMPACT)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            order[i] = topo->cpus[i].cpu;
+        }
+        return;
+    }
+    if (policy == TOPOLOGY_CORE)
+    {
+        topology_cores_first(topo, -1, order);
+        return;
+    }
+
+    /* scatter and pairs take CPUs from each node's cores-first list in turn,
+     * one at a time or two at a time. */
+    int *lists = (int *)malloc(n * sizeof *lists);
+    int *begin = (int *)calloc(topo->n_nodes + 1, sizeof *begin);
+    int *next = (int *)calloc(topo->n_nodes, sizeof *next);
+    assert(lists && begin && next);
+    for (int node = 0; node < topo->n_nodes; ++node)
+    {
+        begin[node + 1] = begin[node] + topology_cores_first(topo, node, lists + begin[node]);
+    }
+    int step = policy == TOPOLOGY_PAIRS ? 2 : 1;
+    int i = 0;
+    for (int node = 0; i < n; node = (node + 1) % topo->n_nodes)
+    {
+        for (int k = 0; k < step && i < n; ++k)
+        {
+            int size = begin[node + 1] - begin[node];
+            if (size == 0)
+            {
+                break;
+            }
+            if (next[node] == size)
+            {
+                /* This node is used up; the pair's second thread wraps
+                 * around it rather than crossing to another node. */
+                if (k == 0)
+                {
+                    break;
+                }
+                next[node] = 0;
+            }
+            order[i++] = lists[begin[node] + next[node]++];
+        }
+    }
+    free(lists);
+    free(begin);
+    free(next);
+}
+
+/* Return the node of CPU <cpu>, or -1 if it is not in <topo>. */
+static inline int
+topology_node_of(const struct topology *topo, int cpu)
+{
+    for (int i = 0; i < topo->n_cpus; ++i)
+    {
+        if (topo->cpus[i].cpu == cpu)
+        {
+            return topo->cpus[i].node;
+        }
+    }
+    return -1;
+}
+
+/* Pin the calling thread to <cpu>. Returns 0 or an errno value. */
+static inline int
+topology_pin(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+}
+
+/* The topology and the CPU order of the THREAD_PLACEMENT policy, loaded on
+ * the first call to topology_pin_self(). */
+static struct
+{
+    pthread_once_t once;
+    enum topology_policy policy;
+    struct topology topo;
+    int *order;
+} topology_placement = { PTHREAD_ONCE_INIT, TOPOLOGY_NONE, { 0, 0, NULL }, NULL };
+
+static inline void
+topology_placement_init(void)
+{
+    const char *name = getenv("THREAD_PLACEMENT");
+    int policy = name && *name ? topology_policy_parse(name) : TOPOLOGY_NONE;
+    if (policy < 0)
+    {
+        fprintf(stderr, "THREAD_PLACEMENT=%s: unknown policy; use none, compact, scatter, core or pairs\n", name);
+        policy = TOPOLOGY_NONE;
+    }
+    if (policy != TOPOLOGY_NONE && topology_load(&topology_placement.topo) == 0)
+    {
+        topology_placement.order = (int *)malloc(topology_placement.topo.n_cpus * sizeof(int));
+        assert(topology_placement.order);
+        topology_order(&topology_placement.topo, (enum topology_policy)policy, topology_placement.order);
+        topology_placement.policy = (enum topology_policy)policy;
+    }
+}
+
+/* Pin the calling thread, the <index>th of the program's threads, under the
+ * THREAD_PLACEMENT policy. Returns the CPU, or -1 if placement is off. */
+static inline int
+topology_pin_self(unsigned index)
+{
+    pthread_once(&topology_placement.once, topology_placement_init);
+    if (topology_placement.policy == TOPOLOGY_NONE)
+    {
+        return -1;
+    }
+    int cpu = topology_placement.order[index % topology_placement.topo.n_cpus];
+    return topology_pin(cpu) == 0 ? cpu : -1;
+}
+
+/* Return <size> bytes of zeroed memory, page-aligned, whose pages have been
+ * touched by the calling thread so that they live on its node. Free it with
+ * topology_free_local(). Returns NULL on failure. */
+static inline void *
+topology_alloc_local(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        return NULL;
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < size; offset += page)
+    {
+        ((volatile char *)p)[offset] = 0;
+    }
+    return p;
+}
+
+static inline void
+topology_free_local(void *p, size_t size)
+{
+    munmap(p, size);
+}
+
+#endif
@@ -0,0 +1,295 @@
+/* This is free and unencumbered software released into the public domain.
+ * Refer to LICENSE.txt in this directory. */
+
+/* Compact binary traces of cache keys.
+ *
+ * A trace file is the 8-byte magic "SQTRACE1" followed by one record per
+ * key: the difference from the previous key (the first key is relative to
+ * 0), zigzag-encoded so that small negative steps stay small, as a LEB128
+ * varint of 7 bits per byte, low bits first, with the top bit set on every
+ * byte but the last. Keys in the sqrt caches are small, so most records are
+ * one or two bytes. There is no count or footer, so a trace that was cut
+ * short is still valid up to its last complete record, and the file can be
+ * read straight from an mmap().
+ *
+ * Capture: trace_capture(key) appends to the file named by the SQRT_TRACE
+ * environment variable, if it is set, buffering 64 KB at a time;
+ * trace_capture_flush() writes out the rest.
+ *
+ * Replay: trace_open() maps a file and trace_next() decodes it key by key.
+ *
+ * Usable from both C and C++. */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TRACE_MAGIC "SQTRACE1"
+#define TRACE_MAGIC_SIZE 8
+
+/* Longest record: a 64-bit value in 7-bit groups. */
+#define TRACE_RECORD_MAX 10
+
+#define TRACE_BUFFER_SIZE (1 << 16)
+
+static inline uint64_t
+trace_zigzag(int64_t delta)
+{
+    return ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+}
+
+static inline int64_t
+trace_unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/* Encode the record for <key> after <prev> into <out>, which must have room
+ * for TRACE_RECORD_MAX bytes. Returns the number of bytes written. */
+static inline size_t
+trace_encode(uint8_t *out, int64_t prev, int64_t key)
+{
+    uint64_t value = trace_zigzag((int64_t)((uint64_t)key - (uint64_t)prev));
+    size_t n = 0;
+    while (value >= 0x80)
+    {
+        out[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (uint8_t)value;
+    return n;
+}
+
+struct trace_writer
+{
+    int fd;
+    int64_t prev;
+    size_t used;
+    uint8_t buf[TRACE_BUFFER_SIZE];
+};
+
+/* Create or truncate trace file <path>. Returns NULL and sets errno on
+ * failure. */
+static inline struct trace_writer *
+trace_writer_open(const char *path)
+{
+    struct trace_writer *writer = (struct trace_writer *)malloc(sizeof *writer);
+    if (writer == NULL)
+    {
+        return NULL;
+    }
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer->fd < 0)
+    {
+        int error = errno;
+        free(writer);
+        errno = error;
+        return NULL;
+    }
+    writer->prev = 0;
+    memcpy(writer->buf, TRACE_MAGIC, TRACE_MAGIC_SIZE);
+    writer->used = TRACE_MAGIC_SIZE;
+    return writer;
+}
+
+/* Write out the buffered records. Returns false on a write error. */
+static inline bool
+trace_writer_flush(struct trace_writer *writer)
+{
+    const uint8_t *p = writer->buf;
+    size_t left = writer->used;
+    writer->used = 0;
+    while (left)
+    {
+        ssize_t r = write(writer->fd, p, left);
+        if (r < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (r <= 0)
+        {
+            return false;
+        }
+        p += r;
+        left -= r;
+    }
+    return true;
+}
+
+static inline bool
+trace_writer_add(struct trace_writer *writer, int64_t key)
+{
+    if (writer->used > TRACE_BUFFER_SIZE - TRACE_RECORD_MAX && !trace_writer_flush(writer))
+    {
+        return false;
+    }
+    writer->used += trace_encode(writer->buf + writer->used, writer->prev, key);
+    writer->prev = key;
+    return true;
+}
+
+/* Flush and close <writer>. Returns false if any write failed. */
+static inline bool
+trace_writer_close(struct trace_writer *writer)
+{
+    bool ok = trace_writer_flush(writer);
+    ok = close(writer->fd) == 0 && ok;
+    free(writer);
+    return ok;
+}
+
+/* The capture hook's state: whether SQRT_TRACE has been read yet, and the
+ * writer, which is NULL if capture is off. */
+static bool trace_capture_started;
+static struct trace_writer *trace_capture_writer;
+
+/* Append <key> to the trace named by $SQRT_TRACE, if set. Not thread-safe. */
+static inline void
+trace_capture(int64_t key)
+{
+    if (__builtin_expect(!trace_capture_started, 0))
+    {
+        const char *path = getenv("SQRT_TRACE");
+        trace_capture_started = true;
+        if (path && *path)
+        {
+            trace_capture_writer = trace_writer_open(path);
+            if (trace_capture_writer == NULL)
+            {
+                fprintf(stderr, "SQRT_TRACE=%s: %s; not capturing\n", path, strerror(errno));
+            }
+        }
+    }
+    if (trace_capture_writer && !trace_writer_add(trace_capture_writer, key))
+    {
+        fprintf(stderr, "SQRT_TRACE: %s; capture stopped\n", strerror(errno));
+        trace_writer_close(trace_capture_writer);
+        trace_capture_writer = NULL;
+    }
+}
+
+/* Write out everything captured so far, for instance before abort(). */
+static inline void
+trace_capture_flush(void)
+{
+    if (trace_capture_writer)
+    {
+        trace_writer_flush(trace_capture_writer);
+    }
+}
+
+/* A trace file mapped for reading. */
+struct trace
+{
+    const uint8_t *data; /* First record, after the magic. */
+    size_t size;         /* Bytes of records. */
+    void *map;
+    size_t map_size;
+};
+
+/* Map trace file <path>. Returns -1 and sets errno on failure, with EINVAL
+ * if the file is not a trace. */
+static inline int
+trace_open(struct trace *trace, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    if (st.st_size < TRACE_MAGIC_SIZE)
+    {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+    if (memcmp(map, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0)
+    {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+    trace->map = map;
+    trace->map_size = st.st_size;
+    trace->data = (const uint8_t *)map + TRACE_MAGIC_SIZE;
+    trace->size = st.st_size - TRACE_MAGIC_SIZE;
+    return 0;
+}
+
+static inline void
+trace_close(struct trace *trace)
+{
+    munmap(trace->map, trace->map_size);
+}
+
+/* Position in a trace. */
+struct trace_cursor
+{
+    const uint8_t *p;
+    const uint8_t *end;
+    int64_t prev;
+};
+
+static inline void
+trace_begin(const struct trace *trace, struct trace_cursor *cursor)
+{
+    cursor->p = trace->data;
+    cursor->end = trace->data + trace->size;
+    cursor->prev = 0;
+}
+
+/* Decode the next key into <*key>. Returns false at the end of the trace,
+ * including at a record that was cut short. */
+static inline bool
+trace_next(struct trace_cursor *cursor, int64_t *key)
+{
+    const uint8_t *p = cursor->p;
+    uint64_t value = 0;
+    unsigned shift = 0;
+    for (;;)
+    {
+        if (p == cursor->end || shift >= 64)
+        {
+            return false;
+        }
+        uint8_t byte = *p++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            break;
+        }
+        shift += 7;
+    }
+    cursor->p = p;
+    cursor->prev = (int64_t)((uint64_t)cursor->prev + (uint64_t)trace_unzigzag(value));
+    *key = cursor->prev;
+    return true;
+}
+
+#endif
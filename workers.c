@@ -15,16 +15,42 @@
  * 2. select() wakes up all waiting threads when the file descriptor becomes
  *    readable, resulting in a "thundering herd" where all the workers try to read
  *    from the pipe at the same time.
+ *
+ * The pool of workers sizes itself: a request that would wait longer than the
+ * target wait, judging by the requests queued and the measured service time,
+ * starts another worker, and a worker that has been idle for the idle timeout
+ * retires. WORKERS_MIN_THREADS (default 2), WORKERS_MAX_THREADS (default 8)
+ * and WORKERS_IDLE_MS (default 50) set the bounds and the timeout. Since the
+ * number of workers changes, they are stopped by a single zero-length packet
+ * that each exiting worker passes on while others remain.
+ *
+ * "workers --bench [SECONDS [MIN MAX]]" sends bursts of requests that each
+ * take a random time to serve and reports latency percentiles with a fixed
+ * pool of 2 workers and with an adaptive pool of MIN to MAX workers. The
+ * benchmark guards the pipes with mutexes, so that the bugs above do not
+ * corrupt its packets.
+ *
+ * THREAD_PLACEMENT pins the workers to CPUs; see topology.h.
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <errno.h>
+#include <math.h>
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "prng.h"
+#include "topology.h"
+
 /* Read a length-prefixed packet from fd and update *o_packet with a pointer to
  * the allocated packet. The caller must free the result.
  */
@@ -56,57 +82,474 @@ write_packet(const char *packet, ssize_t length, int fd)
  * return results on the "up" pipe. */
 static int down_pipe[2], up_pipe[2];
 
+/* Request sent by the benchmark: when it was due to be sent, and how long the
+ * worker takes to serve it. The result is the request itself. */
+struct bench_request
+{
+    uint64_t sent_ns;
+    uint64_t service_ns;
+};
+
+/* State of the worker pool, protected by pool.lock. */
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t exited;  /* Signalled when the last worker exits. */
+    size_t min_threads;
+    size_t max_threads;
+    uint64_t idle_timeout_ns;
+    uint64_t target_wait_ns;
+    bool bench;             /* Serve bench_requests and guard the pipes. */
+    bool stopping;          /* The exit packet has been sent. */
+    size_t nthreads;        /* Live workers. */
+    bool *slot_used;        /* Placement slots taken, max_threads of them. */
+    size_t idle;            /* Workers waiting for a packet. */
+    size_t queued;          /* Requests sent but not yet read by a worker. */
+    double service_ns;      /* Moving average of the time to serve a request. */
+    size_t peak_threads;
+    size_t started;
+    size_t retired;
+    pthread_mutex_t down_lock; /* Guards reads of the down pipe if bench. */
+    pthread_mutex_t up_lock;   /* Guards writes to the up pipe if bench. */
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, .down_lock = PTHREAD_MUTEX_INITIALIZER,
+           .up_lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+sleep_until_ns(uint64_t ns)
+{
+    struct timespec ts = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+}
+
+/* Wait up to timeout_ns for fd to become readable. */
+static bool
+wait_readable(int fd, uint64_t timeout_ns)
+{
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(fd, &readfds);
+    struct timeval timeout = { .tv_sec = timeout_ns / 1000000000, .tv_usec = timeout_ns % 1000000000 / 1000 };
+    int n = select(fd + 1, &readfds, NULL, NULL, &timeout);
+    assert(n >= 0 || errno == EINTR);
+    return n > 0 && FD_ISSET(fd, &readfds);
+}
+
+static void *worker_thread(void *arg);
+
+/* Start a worker in the lowest free placement slot. The caller holds
+ * pool.lock. */
+static void
+pool_start_worker(void)
+{
+    size_t slot = 0;
+    while (pool.slot_used[slot])
+    {
+        ++slot;
+    }
+    assert(slot < pool.max_threads);
+    pool.slot_used[slot] = true;
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int r = pthread_create(&thread, &attr, worker_thread, (void *)slot);
+    assert(r == 0);
+    pthread_attr_destroy(&attr);
+    ++pool.nthreads;
+    ++pool.started;
+    if (pool.nthreads > pool.peak_threads)
+    {
+        pool.peak_threads = pool.nthreads;
+    }
+}
+
+/* Start a pool of min_threads to max_threads workers. */
+static void
+pool_start(size_t min_threads, size_t max_threads, uint64_t idle_timeout_ns, bool bench)
+{
+    pthread_mutex_lock(&pool.lock);
+    assert(pool.nthreads == 0);
+    pool.min_threads = min_threads;
+    pool.max_threads = max_threads;
+    pool.idle_timeout_ns = idle_timeout_ns;
+    pool.target_wait_ns = 1000000;
+    pool.bench = bench;
+    pool.stopping = false;
+    pool.idle = pool.queued = 0;
+    pool.service_ns = 0;
+    pool.peak_threads = pool.started = pool.retired = 0;
+    pool.slot_used = calloc(max_threads, sizeof *pool.slot_used);
+    assert(pool.slot_used != NULL);
+    for (size_t i = 0; i < min_threads; ++i)
+    {
+        pool_start_worker();
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Account for a request about to be sent, and start another worker if the
+ * request would otherwise wait longer than the target: more requests are
+ * queued than there are idle workers, and the queue takes longer than the
+ * target to drain at the measured service time. */
+static void
+pool_submit(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    ++pool.queued;
+    if (pool.nthreads < pool.max_threads && !pool.stopping && pool.queued > pool.idle)
+    {
+        double wait_ns = pool.queued * pool.service_ns / pool.nthreads;
+        if (pool.service_ns == 0 || wait_ns > pool.target_wait_ns)
+        {
+            pool_start_worker();
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Called by the worker in placement slot <slot> when it has been idle for
+ * the timeout. Returns true if it should exit. */
+static bool
+pool_retire(size_t slot)
+{
+    pthread_mutex_lock(&pool.lock);
+    bool retire = !pool.stopping && pool.nthreads > pool.min_threads;
+    if (retire)
+    {
+        --pool.nthreads;
+        ++pool.retired;
+        pool.slot_used[slot] = false;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return retire;
+}
+
+/* Called by the worker in placement slot <slot> when it read the exit
+ * packet: pass it on to the next worker, if any remain, and exit. */
+static void
+pool_exit(size_t slot)
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.slot_used[slot] = false;
+    bool more = --pool.nthreads > 0;
+    if (more)
+    {
+        write_packet("", 0, down_pipe[1]);
+    }
+    else
+    {
+        pthread_cond_signal(&pool.exited);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Tell the workers to exit and wait until they have. Workers no longer
+ * start or retire once pool.stopping is set, and a worker is always alive to
+ * take the exit packet because pool.min_threads is at least 1. */
+static void
+pool_stop(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = true;
+    write_packet("", 0, down_pipe[1]);
+    while (pool.nthreads > 0)
+    {
+        pthread_cond_wait(&pool.exited, &pool.lock);
+    }
+    free(pool.slot_used);
+    pool.slot_used = NULL;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void
+pool_set_idle(bool idle)
+{
+    pthread_mutex_lock(&pool.lock);
+    if (idle)
+    {
+        ++pool.idle;
+    }
+    else
+    {
+        --pool.idle;
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
 static void *
 worker_thread(void *arg)
 {
+    /* The worker in placement slot i takes the ith CPU of the policy. A
+     * retired worker's slot is reused by the next worker started, so live
+     * workers never share a CPU while there are enough to go round. */
+    size_t slot = (size_t)arg;
+    topology_pin_self(slot);
+    /* Idle time runs from the last request this worker served, not from its
+     * last wakeup: select() wakes every idle worker for each packet, so a
+     * worker that keeps losing the race for packets would otherwise never
+     * time out. */
+    uint64_t idle_since = monotonic_ns();
     for (;;)
     {
-        /* Wait for a packet. */
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(down_pipe[0], &readfds);
-        int n = select(down_pipe[0] + 1, &readfds, NULL, NULL, NULL);
-        assert(n > 0);
-        assert(FD_ISSET(down_pipe[0], &readfds));
+        /* Wait for a packet, or retire after the idle timeout. */
+        uint64_t now = monotonic_ns();
+        if (now - idle_since >= pool.idle_timeout_ns)
+        {
+            if (pool_retire(slot))
+            {
+                return arg;
+            }
+            idle_since = now;
+        }
+        pool_set_idle(true);
+        bool readable = wait_readable(down_pipe[0], idle_since + pool.idle_timeout_ns - now);
+        pool_set_idle(false);
+        if (!readable)
+        {
+            continue;
+        }
 
-        /* Read packet. */
+        /* Read packet. In the benchmark, another worker may have taken the
+         * packet that woke us while we waited for the lock. */
         char *packet;
         ssize_t length;
+        if (pool.bench)
+        {
+            pthread_mutex_lock(&pool.down_lock);
+            if (!wait_readable(down_pipe[0], 0))
+            {
+                pthread_mutex_unlock(&pool.down_lock);
+                continue;
+            }
+        }
         read_packet(&packet, &length, down_pipe[0]);
+        if (pool.bench)
+        {
+            pthread_mutex_unlock(&pool.down_lock);
+        }
 
         /* Zero length packet is a request to exit. */
-        if (!length) return arg;
+        if (!length)
+        {
+            free(packet);
+            pool_exit(slot);
+            return arg;
+        }
+        uint64_t start = monotonic_ns();
+        pthread_mutex_lock(&pool.lock);
+        --pool.queued;
+        pthread_mutex_unlock(&pool.lock);
+
+        if (pool.bench)
+        {
+            /* Serve the request, standing in for a call to a slow service. */
+            struct bench_request *request = (struct bench_request *)packet;
+            struct timespec service = { .tv_sec = request->service_ns / 1000000000,
+                                        .tv_nsec = request->service_ns % 1000000000 };
+            nanosleep(&service, NULL);
+            pthread_mutex_lock(&pool.up_lock);
+        }
 
         /* Write result packet. */
         write_packet(packet, length, up_pipe[1]);
+        if (pool.bench)
+        {
+            pthread_mutex_unlock(&pool.up_lock);
+        }
         free(packet);
+
+        pthread_mutex_lock(&pool.lock);
+        double elapsed = monotonic_ns() - start;
+        pool.service_ns = pool.service_ns == 0 ? elapsed : pool.service_ns * 0.9 + elapsed * 0.1;
+        pthread_mutex_unlock(&pool.lock);
+        idle_since = monotonic_ns();
+    }
+}
+
+static size_t
+env_size(const char *name, size_t fallback)
+{
+    const char *value = getenv(name);
+    return value && *value ? strtoul(value, NULL, 10) : fallback;
+}
+
+/* Arguments and results of bench_collect(). */
+struct bench_results
+{
+    size_t n;
+    uint64_t *latency_ns;
+};
+
+/* Read the results of all the requests and record each one's latency,
+ * measured from when it was due to be sent. */
+static void *
+bench_collect(void *arg)
+{
+    struct bench_results *results = arg;
+    for (size_t i = 0; i < results->n; ++i)
+    {
+        char *packet;
+        ssize_t length;
+        read_packet(&packet, &length, up_pipe[0]);
+        assert(length == sizeof(struct bench_request));
+        results->latency_ns[i] = monotonic_ns() - ((struct bench_request *)packet)->sent_ns;
+        free(packet);
+    }
+    return NULL;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Return an exponentially distributed random time with the given mean. */
+static uint64_t
+random_exponential_ns(double mean_ns)
+{
+    return (uint64_t)(-log(1 - prng_double()) * mean_ns);
+}
+
+/* Bursty load: every 100 ms, a 10 ms burst with a request every 100 us on
+ * average, then requests every 5 ms on average. Requests take 300 us to
+ * serve on average, so a burst needs about 3 workers and the rest 1. */
+#define BENCH_PERIOD_NS 100000000
+#define BENCH_BURST_NS 10000000
+#define BENCH_BURST_INTERVAL_NS 100000
+#define BENCH_QUIET_INTERVAL_NS 5000000
+#define BENCH_SERVICE_NS 300000
+
+/* Send <n> requests at the times in <schedule> to a pool of min_threads to
+ * max_threads workers and print the latency percentiles. */
+static void
+bench_run(const char *name, const uint64_t *schedule, const uint64_t *service, size_t n, size_t min_threads,
+          size_t max_threads, uint64_t idle_timeout_ns)
+{
+    struct bench_results results = { n, malloc(n * sizeof(uint64_t)) };
+    assert(results.latency_ns != NULL);
+    pool_start(min_threads, max_threads, idle_timeout_ns, true);
+    pthread_t collector;
+    int r = pthread_create(&collector, NULL, bench_collect, &results);
+    assert(r == 0);
+
+    uint64_t start = monotonic_ns();
+    for (size_t i = 0; i < n; ++i)
+    {
+        struct bench_request request = { start + schedule[i], service[i] };
+        sleep_until_ns(request.sent_ns);
+        pool_submit();
+        write_packet((const char *)&request, sizeof request, down_pipe[1]);
     }
+    r = pthread_join(collector, NULL);
+    assert(r == 0);
+    pool_stop();
+
+    qsort(results.latency_ns, n, sizeof(uint64_t), compare_u64);
+    printf("%-9s threads=%zu-%zu peak=%zu started=%zu retired=%zu requests=%zu latency p50=%.2fms p90=%.2fms "
+           "p99=%.2fms p999=%.2fms max=%.2fms\n",
+           name, min_threads, max_threads, pool.peak_threads, pool.started, pool.retired, n,
+           results.latency_ns[n / 2] * 1e-6, results.latency_ns[n * 90 / 100] * 1e-6,
+           results.latency_ns[n * 99 / 100] * 1e-6, results.latency_ns[n * 999 / 1000] * 1e-6,
+           results.latency_ns[n - 1] * 1e-6);
+    free(results.latency_ns);
+}
+
+static int
+bench(double seconds, size_t min_threads, size_t max_threads, uint64_t idle_timeout_ns)
+{
+    /* Both pools get the same schedule of requests. */
+    uint64_t duration = (uint64_t)(seconds * 1e9);
+    size_t capacity = 1024, n = 0;
+    uint64_t *schedule = malloc(capacity * sizeof *schedule);
+    uint64_t *service = malloc(capacity * sizeof *service);
+    assert(schedule && service);
+    for (uint64_t t = 0;;)
+    {
+        bool burst = t % BENCH_PERIOD_NS < BENCH_BURST_NS;
+        t += random_exponential_ns(burst ? BENCH_BURST_INTERVAL_NS : BENCH_QUIET_INTERVAL_NS);
+        if (t >= duration)
+        {
+            break;
+        }
+        if (n == capacity)
+        {
+            capacity *= 2;
+            schedule = realloc(schedule, capacity * sizeof *schedule);
+            service = realloc(service, capacity * sizeof *service);
+            assert(schedule && service);
+        }
+        schedule[n] = t;
+        service[n] = random_exponential_ns(BENCH_SERVICE_NS);
+        ++n;
+    }
+    if (n == 0)
+    {
+        fprintf(stderr, "No requests in %g seconds\n", seconds);
+        return EXIT_FAILURE;
+    }
+    bench_run("fixed", schedule, service, n, 2, 2, idle_timeout_ns);
+    bench_run("adaptive", schedule, service, n, min_threads, max_threads, idle_timeout_ns);
+    free(schedule);
+    free(service);
+    return EXIT_SUCCESS;
 }
 
 int
-main(void)
+main(int argc, char **argv)
 {
     int r = pipe(down_pipe);
     assert(r == 0);
     r = pipe(up_pipe);
     assert(r == 0);
 
-    /* Create the worker threads. */
-    size_t nthreads = 2;
-    pthread_t *thread = calloc(nthreads, sizeof *thread);
-    assert(thread != NULL);
-    for (size_t i = 0; i < nthreads; ++i)
+    size_t min_threads = env_size("WORKERS_MIN_THREADS", 2);
+    size_t max_threads = env_size("WORKERS_MAX_THREADS", 8);
+    uint64_t idle_timeout_ns = env_size("WORKERS_IDLE_MS", 50) * 1000000;
+
+    if (argc >= 2 && !strcmp(argv[1], "--bench"))
+    {
+        double seconds = argc > 2 ? atof(argv[2]) : 5;
+        if (argc == 5)
+        {
+            min_threads = strtoul(argv[3], NULL, 10);
+            max_threads = strtoul(argv[4], NULL, 10);
+        }
+        if ((argc != 5 && argc > 3) || min_threads < 1 || max_threads < min_threads || seconds <= 0)
+        {
+            fprintf(stderr, "Usage: %s [--bench [SECONDS [MIN MAX]]]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        return bench(seconds, min_threads, max_threads, idle_timeout_ns);
+    }
+    if (argc > 1 || min_threads < 1 || max_threads < min_threads)
     {
-        r = pthread_create(&thread[i], NULL, worker_thread, NULL);
-        assert(r == 0);
+        fprintf(stderr, "Usage: %s [--bench [SECONDS [MIN MAX]]]\n"
+                "WORKERS_MIN_THREADS must be at least 1 and at most WORKERS_MAX_THREADS.\n", argv[0]);
+        return EXIT_FAILURE;
     }
 
+    /* Create the worker threads. */
+    pool_start(min_threads, max_threads, idle_timeout_ns, false);
+
     /* Distribute some work to the workers and collect the results. */
     for (size_t i = 0; i < 16; ++i)
     {
         ssize_t length1 = 1 << i;
         char *packet1 = calloc(1, length1);
         memset(packet1, 'A' + i % 26, length1);
+        pool_submit();
         write_packet(packet1, length1, down_pipe[1]);
         char *packet2;
         ssize_t length2;
@@ -118,18 +561,7 @@ main(void)
         printf("Checked packet, length=%zu\n", length1);
     }
 
-    /* Tell the workers to exit by sending zero-length packets. */
-    for (size_t i = 0; i < nthreads; ++i)
-    {
-        write_packet("", 0, down_pipe[1]);
-    }
-
-    /* Wait for the workers to exit. */
-    for (size_t i = 0; i < nthreads; ++i)
-    {
-        r = pthread_join(thread[i], NULL);
-        assert(r == 0);
-    }
-    free(thread);
+    /* Tell the workers to exit and wait for them. */
+    pool_stop();
     return EXIT_SUCCESS;
 }